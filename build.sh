@@ -2,10 +2,15 @@
 
 : ${CC=gcc}
 : ${BIN=libterminal.so}
+: ${DAEMON_BIN=libterminal-daemon}
 
 CFLAGS="$CFLAGS -fPIC -Ilib/lite-xl/resources/include"
 LDFLAGS=""
 
-[[ "$@" == "clean" ]] && rm -f *.so *.dll && exit 0
-[[ $OSTYPE != 'msys'* && $OSTYPE != 'cygwin'* && $CC != *'mingw'* ]] && LDFLAGS="$LDFLAGS -lutil"
-$CC $CFLAGS src/*.c $@ -shared -o $BIN $LDFLAGS
+[[ "$@" == "clean" ]] && rm -f *.so *.dll $DAEMON_BIN && exit 0
+[[ $OSTYPE != 'msys'* && $OSTYPE != 'cygwin'* && $CC != *'mingw'* ]] && POSIX=1 && LDFLAGS="$LDFLAGS -lutil -lpthread"
+$CC $CFLAGS src/*.c $@ -shared -o $BIN $LDFLAGS || exit 1
+# The session daemon is the same source, built as an executable; it only exists on POSIX systems.
+if [[ -n $POSIX ]]; then
+  $CC $CFLAGS src/libterminal.c -DLIBTERMINAL_DAEMON $@ -o $DAEMON_BIN $LDFLAGS
+fi
@@ -42,6 +42,28 @@ local default_config = {
   delete = "\x1B[3~",
   -- the amount of lines you can emit before we start cutting them off
   scrollback_limit = 10000,
+  -- if set, lines that fall off the scrollback are written to a temporary file instead of being discarded; set to a directory, or true to use the system's temporary directory
+  scrollback_spill = false,
+  -- the maximum amount of lines to keep on disk when spilling scrollback. nil for no limit
+  scrollback_spill_limit = nil,
+  -- the maximum amount of bytes a single terminal's scrollback can take up. nil for no limit
+  scrollback_memory_limit = nil,
+  -- the maximum amount of bytes the scrollback of all terminals together can take up; the oldest history goes first. nil for no limit
+  global_scrollback_memory_limit = nil,
+  -- the amount of shells to keep spawned in the background, so that opening a terminal is instant. 0 to disable
+  pool_size = 0,
+  -- if set, shells are run by a daemon, which keeps them, and everything they've output, across editor restarts; they're reattached the next time the plugin loads. true to use the daemon built alongside the plugin, or the path to one. not available on windows
+  daemon = false,
+  -- the socket the daemon listens on
+  daemon_socket = (os.getenv("XDG_RUNTIME_DIR") or os.getenv("TMPDIR") or "/tmp"):gsub("/$", "") .. "/lite-xl-terminal-" .. (os.getenv("USER") or "user") .. ".sock",
+  -- patterns matched against each line of output as it completes, as { pattern = "...", callback = function(view, text, line) end, literal = false }; non-literal patterns support ., [classes], \d, \w, \s, *, +, ?, ^ and $
+  triggers = {},
+  -- whether applications can set the clipboard with OSC 52, as vim and tmux can over ssh
+  clipboard_write = true,
+  -- called with the view whenever the shell rings the bell
+  on_bell = nil,
+  -- the amount of seconds a terminal can go without being drawn before we give back any memory it doesn't need. nil to disable
+  trim_after = 60,
   -- the default height of the console drawer
   drawer_height = 300,
   -- the default console font. non-monsospace is unsupported
@@ -178,6 +200,41 @@ default_config.config_spec = set_config_default_values {
     description = "Number of lines to store for scrolling in the terminal.",
     path = "scrollback_limit", type = "NUMBER"
   },
+  {
+    label = "Spill Scrollback To Disk",
+    description = "Write lines that fall off the scrollback buffer to a temporary file, rather than discarding them.",
+    path = "scrollback_spill", type = "TOGGLE"
+  },
+  {
+    label = "Scrollback Memory Limit",
+    description = "Maximum bytes of scrollback per terminal (0 for no limit).",
+    path = "scrollback_memory_limit", type = "NUMBER"
+  },
+  {
+    label = "Global Scrollback Memory Limit",
+    description = "Maximum bytes of scrollback across all terminals; the oldest history is dropped first (0 for no limit).",
+    path = "global_scrollback_memory_limit", type = "NUMBER"
+  },
+  {
+    label = "Trim Idle Terminals",
+    description = "Seconds a terminal can go undisplayed before its unused memory is released.",
+    path = "trim_after", type = "NUMBER"
+  },
+  {
+    label = "Shell Pool Size",
+    description = "Amount of shells to keep spawned in the background, so that terminals open instantly (0 to disable).",
+    path = "pool_size", type = "NUMBER"
+  },
+  {
+    label = "Session Daemon",
+    description = "Run shells in a daemon, so that they survive restarting the editor, and are reattached on startup.",
+    path = "daemon", type = "TOGGLE"
+  },
+  {
+    label = "Allow Clipboard Writes",
+    description = "Allow applications to set the clipboard with OSC 52, as vim and tmux can over ssh.",
+    path = "clipboard_write", type = "TOGGLE"
+  },
   {
     label = "Change Other Options",
     description = "For other options such as the color palette, you can change them in the user module.",
@@ -266,22 +323,57 @@ local TerminalView = View:extend()
 function TerminalView:get_name() return (self.modified_since_last_focus and "* " or "") .. (self.terminal and self.terminal:name() or "Terminal") end
 function TerminalView:supports_text_input() return true end
 
-function TerminalView:new(options)
-  TerminalView.super.new(self)
+local function resolve_options(options)
   options = common.merge(common.merge({}, config.plugins.terminal), options)
-  self.size.y = options.drawer_height
-  self.options = options
-  self.options.environment = common.merge(options.environment, {})
-  for k,v in pairs(self.options.environment) do
-    self.options.environment[k] = type(v) == "function" and v() or v
+  options.environment = common.merge(options.environment, {})
+  for k,v in pairs(options.environment) do
+    options.environment[k] = type(v) == "function" and v() or v
   end
   if PLATFORM == "Windows" then
     local t = {}
-    for k,v in pairs(common.merge(terminal_native.getenv(), self.options.environment)) do
+    for k,v in pairs(common.merge(terminal_native.getenv(), options.environment)) do
       table.insert(t, k .. "=" .. v)
     end
-    self.options.environment = table.concat(t, "\0") .. "\0\0"
+    options.environment = table.concat(t, "\0") .. "\0\0"
   end
+  return options
+end
+
+local plugin_directory = debug.getinfo(1, "S").source:match("^@(.*)[/\\]") or "."
+local function daemon_path()
+  local daemon = config.plugins.terminal.daemon
+  if not daemon or PLATFORM == "Windows" then return nil end
+  return type(daemon) == "string" and daemon or (plugin_directory .. "/libterminal-daemon")
+end
+
+-- The size of the last terminal we spawned; pooled shells are started at this size, so that most hand-offs don't need a resize.
+local pool_columns, pool_lines = 80, 24
+local pool_refilling = false
+local function refill_pool()
+  -- the daemon spawns our shells, so there's nothing to pool
+  if pool_refilling or (config.plugins.terminal.pool_size or 0) <= 0 or daemon_path() then return end
+  pool_refilling = true
+  core.add_thread(function()
+    -- one shell per frame, so as not to stall the editor
+    while true do
+      local options = resolve_options({})
+      local ok, count = pcall(terminal_native.prespawn, pool_columns, pool_lines, options.scrollback_limit, options.term, options.shell, options.arguments, options.environment, config.plugins.terminal.pool_size or 0)
+      if not ok then core.warn("Unable to pre-spawn terminal: %s", count) end
+      if not ok or count >= (config.plugins.terminal.pool_size or 0) then break end
+      coroutine.yield()
+    end
+    pool_refilling = false
+  end)
+end
+
+-- pass `attach` in options to share another view's terminal, rather than spawning a shell of its own, `session` to reattach to one left in the daemon,
+-- or `restore` (a string from `terminal:snapshot()`) or `restore_file` (a path given to it) to show a snapshot, without a shell;
+-- `file` shows a file, such as a log, read-only, however large it is
+function TerminalView:new(options)
+  TerminalView.super.new(self)
+  self.source = options and options.attach
+  self.options = self.source and self.source.options or resolve_options(options)
+  self.size.y = self.options.drawer_height
   self.cursor = "ibeam"
   self.scrollable = true
   self.last_size = { x = self.size.x, y = self.size.y }
@@ -290,33 +382,106 @@ function TerminalView:new(options)
 end
 
 function TerminalView:shift_selection_update()
-  local shifts = self.terminal:update()
+  local shifts, exit_code = self.terminal:update()
+  -- make sure we notice the exit straight away
+  if exit_code then core.redraw = true end
   if shifts and not self.focused then self.modified_since_last_focus = true end
-  if self.selection and shifts then
-    self.selection[2] = self.selection[2] - shifts
-    self.selection[4] = self.selection[4] - shifts
-    if math.abs(math.min(self.selection[2], self.selection[4])) > self.options.scrollback_limit then
-      self.selection = nil
+  local clipboard, target = self.terminal:clipboard()
+  if clipboard and self.options.clipboard_write then
+    if target:find("p") and system.set_primary_selection then
+      system.set_primary_selection(clipboard)
+    else
+      system.set_clipboard(clipboard)
+    end
+  end
+  local events = self.terminal:triggered()
+  if events then
+    for _, event in ipairs(events) do
+      local id, line, text = table.unpack(event)
+      if id == 0 then
+        if not self.focused then self.modified_since_last_focus = true end
+        if self.options.on_bell then self.options.on_bell(self) end
+      elseif self.triggers[id] then
+        self.triggers[id](self, text, line)
+      end
     end
+    core.redraw = true
   end
   return shifts
 end
 
 
+-- callbacks are called with the view, the text of the line, and the line relative to the top of the screen
+function TerminalView:add_trigger(pattern, callback, literal)
+  local id = self.terminal:trigger(pattern, literal)
+  self.triggers[id] = callback
+  return id
+end
+
+
+function TerminalView:remove_trigger(id)
+  self.terminal:untrigger(id)
+  self.triggers[id] = nil
+end
+
+
 function TerminalView:spawn()
-  self.terminal = terminal_native.new(self.columns, self.lines, self.options.scrollback_limit, self.options.term, self.options.shell, self.options.arguments, self.options.environment, self.options.debug)
+  if self.source and self.source.terminal then
+    -- shares the grid, scrollback and shell; whichever view polls first handles triggers, so they share callbacks too
+    self.terminal = self.source.terminal:attach(self.columns, self.lines)
+    self.triggers = self.source.triggers
+  else
+    local daemon = daemon_path()
+    if self.options.file then
+      local err
+      self.terminal, err = terminal_native.open(self.options.file, self.columns, self.lines)
+      if not self.terminal then core.warn("Unable to open %s, starting a shell instead: %s", self.options.file, err) end
+    elseif self.options.restore or self.options.restore_file then
+      local err
+      self.terminal, err = terminal_native.restore(self.options.restore_file or self.options.restore, self.options.restore_file ~= nil)
+      if not self.terminal then core.warn("Unable to restore terminal snapshot, starting a shell instead: %s", err) end
+    elseif daemon then
+      local err
+      self.terminal, err = terminal_native.connect(self.columns, self.lines, self.options.scrollback_limit, self.options.term, self.options.shell, self.options.arguments, self.options.environment, self.options.debug, self.options.daemon_socket, self.options.session, daemon)
+      if not self.terminal then core.warn("Unable to use terminal daemon, starting the shell directly: %s", err) end
+    end
+    if not self.terminal then
+      self.terminal = terminal_native.new(self.columns, self.lines, self.options.scrollback_limit, self.options.term, self.options.shell, self.options.arguments, self.options.environment, self.options.debug)
+      pool_columns, pool_lines = self.columns, self.lines
+      refill_pool()
+    end
+    if self.options.scrollback_memory_limit then self.terminal:memory_limit(self.options.scrollback_memory_limit) end
+    terminal_native.global_memory_limit(config.plugins.terminal.global_scrollback_memory_limit or 0)
+    if self.options.scrollback_spill then
+      local directory = type(self.options.scrollback_spill) == "string" and self.options.scrollback_spill or os.getenv("TMPDIR") or os.getenv("TEMP") or "/tmp"
+      if not self.terminal:spill(directory, self.options.scrollback_spill_limit or 0) then core.warn("Unable to spill terminal scrollback to %s.", directory) end
+    end
+    self.triggers = {}
+    for _, trigger in ipairs(self.options.triggers or {}) do
+      self:add_trigger(trigger.pattern, trigger.callback, trigger.literal)
+    end
+  end
   -- We make this weak so that any other method of closing the view gets caught up in the garbage collection and the coroutine doesn't count as a reference for gc purposes.
   local weak_table = { self = self }
   setmetatable(weak_table, { __mode = "v" })
   self.routine = self.routine or core.add_thread(function()
     while weak_table.self and weak_table.self.terminal do
       core.redraw = weak_table.self:shift_selection_update() or core.redraw
+      weak_table.self:trim()
       coroutine.yield(1 / config.fps)
     end
   end)
 end
 
 
+function TerminalView:trim()
+  if self.options.trim_after and not self.trimmed and system.get_time() - (self.last_viewed or 0) > self.options.trim_after then
+    self.terminal:trim()
+    self.trimmed = true
+  end
+end
+
+
 function TerminalView:update()
   if self.last_font_size and self.last_font_size ~= self.options.font:get_size() then
     self.options.bold_font:set_size(self.options.font:get_size())
@@ -328,7 +493,9 @@ function TerminalView:update()
       if not self.terminal then
         self:spawn()
       else
-        self.terminal:size(self.columns, self.lines)
+        -- a collapsed view doesn't hold back the size of any others sharing its terminal
+        local visible = self.size.x > 0 and self.size.y > 0
+        self.terminal:size(visible and self.columns or 0, visible and self.lines or 0)
         self.last_size = { x = self.size.x, y = self.size.y }
       end
     end
@@ -338,6 +505,11 @@ function TerminalView:update()
       self:input(self.deferred_input)
       self.deferred_input = nil
     end
+    if self.pending_input then
+      -- keep ticking over until the shell has taken all our input
+      self.pending_input = self.terminal:input("") > 0
+      core.redraw = true
+    end
     local exited = self.terminal:exited()
     if exited == false then
       self.cursor = "ibeam"
@@ -407,19 +579,18 @@ function TerminalView:convert_color(int, target, should_bright)
   return nil
 end
 
+-- the selection lives in the native terminal, anchored to lines rather than the screen, so it follows the text as it scrolls
 function TerminalView:sorted_selection()
-  if not self.selection then return nil end
-  local selection = { table.unpack(self.selection) }
-  if selection[2] > selection[4] or (selection[2] == selection[4] and selection[1] > selection[3]) then
-    selection = { selection[3], selection[4], selection[1], selection[2] }
-  end
-  return selection
+  if not self.terminal or not self.terminal:selection() then return nil end
+  return { self.terminal:selection() }
 end
 
 
 local contrast_foreground = {}
 function TerminalView:draw()
   TerminalView.super.draw_background(self, self.options.background)
+  self.last_viewed = system.get_time()
+  self.trimmed = false
   if self.terminal then
     local cursor_x, cursor_y, mode = self.terminal:cursor()
     local space_width = self.options.font:get_width(" ")
@@ -458,6 +629,23 @@ function TerminalView:draw()
         
         local font = (((text_style >> 3) & 0x1) ~= 0) and self.options.bold_font or self.options.font
         local text = line[i+1]
+        local cell_class = (line[i] >> 56) & 0xC0
+        if cell_class ~= 0 then
+          -- wide characters and clusters come as a group of their own; one cell, selected or under the cursor as a whole
+          local width = (cell_class & 0x40) ~= 0 and 2 or 1
+          local idx = (line_idx - 1) - self.terminal:scrollback()
+          local inverted = selection and (idx > selection[2] or (idx == selection[2] and offset >= selection[1])) and (idx < selection[4] or (idx == selection[4] and offset < selection[3]))
+          if should_draw_cursor and cursor_x >= offset and cursor_x < offset + width then inverted = not inverted end
+          local cell_background, cell_foreground = background, foreground
+          if inverted then cell_background, cell_foreground = foreground, background end
+          if cell_background and cell_background ~= self.options.background then
+            renderer.draw_rect(x, y, width*space_width, lh, cell_background)
+          end
+          renderer.draw_text(font, text, x, y, cell_foreground)
+          x = x + width*space_width
+          offset = offset + width
+          goto continue
+        end
         local length = text:ulen()
         local valid_utf8 = length ~= nil
         local subfunc, lengthfunc = string.usub, string.ulen
@@ -511,9 +699,12 @@ function TerminalView:draw()
           end
         end
         offset = offset + length
+        ::continue::
       end
       y = y + lh
     end
+    -- for the latency probe; see terminal:show-latency
+    self.terminal:presented()
   end
   TerminalView.super.draw_scrollbar(self)
 end
@@ -526,29 +717,40 @@ function TerminalView:convert_coordinates(x, y)
   return math.max(0, col_exact), math.max(0, row), math.max(0, col_approx)
 end
 
-function TerminalView:get_word_boundaries(col, row)
-  for line_idx, line in ipairs(self.terminal:lines()) do
-    if line_idx == row + 1 then
-      local text = ""
-      for i = 1, #line, 2 do
-        text = text .. line[i+1]
-      end
-      local scrollback = self.terminal:scrollback()
-      row = row - scrollback
-      if text:sub(col + 1, col + 1):match("%s") then
-        return col, row, col + 1, row
-      end
-      local next_space = text:find("%s", col + 1) or #text
-      local last_space = 0
-      local idx = text:reverse():find("%s", #text - col)
-      if idx then
-        last_space = (#text - idx) + 1
-      end
-      return last_space, row, next_space - 1, row
+-- links are found natively as lines of output complete; a wrapped link can start a few lines above the one it's clicked on
+function TerminalView:link_at(col, row)
+  local line = row - self.terminal:scrollback()
+  for _, link in ipairs(self.terminal:links(line - 16, line)) do
+    if (link[2] < line or (link[2] == line and link[1] <= col)) and (link[4] > line or (link[4] == line and link[3] > col)) then
+      return link
     end
   end
 end
 
+local function open_url(url)
+  if PLATFORM == "Windows" then
+    system.exec(string.format('start "" "%s"', url))
+  else
+    system.exec(string.format("%s '%s'", PLATFORM == "Mac OS X" and "open" or "xdg-open", (url:gsub("'", "'\\''"))))
+  end
+end
+
+function TerminalView:open_link(col, row)
+  local link = self:link_at(col, row)
+  if not link then return false end
+  if link[5] == "url" then
+    open_url(link[6])
+  else
+    local path, line, column = link[6]:match("^(.-):(%d+):?(%d*)$")
+    if not common.is_absolute_path(path) then path = core.root_project().path .. PATHSEP .. path end
+    if not system.get_file_info(path) then return false end
+    local doc = core.open_doc(path)
+    core.root_view:open_doc(doc)
+    doc:set_selection(tonumber(line), tonumber(column) or 1)
+  end
+  return true
+end
+
 function TerminalView:on_mouse_pressed(button, x, y, clicks)
   local result = self.v_scrollbar:on_mouse_pressed(button, x, y, clicks)
   if result then
@@ -558,27 +760,25 @@ function TerminalView:on_mouse_pressed(button, x, y, clicks)
     end
     return true
   end
+  local col, row = self:convert_coordinates(x, y)
+  local inverted = config.plugins.terminal.inversion_key and keymap.modkeys[config.plugins.terminal.inversion_key]
+  if not inverted and self.terminal:mouse("press", button, col, row, keymap.modkeys) then
+    return true
+  end
   if button == "left" then
-    local col, row = self:convert_coordinates(x, y)
-    local inverted = config.plugins.terminal.inversion_key and keymap.modkeys[config.plugins.terminal.inversion_key]
-    if not inverted and self.terminal:mouse_tracking_mode() == "x10" then
-      self.terminal:input("\x1B[M" .. string.char(32) .. string.char(32 + col + 1) .. string.char(32 + row + 1) )
-    elseif not inverted and self.terminal:mouse_tracking_mode() == "normal" then
-      self.terminal:input("\x1B[M" .. string.char(32) .. string.char(32 + col + 1) .. string.char(32 + row + 1) )
-    elseif not inverted and self.terminal:mouse_tracking_mode() == "sgr" then
-      self.terminal:input("\x1B[<0;" .. (col+1) .. ";" .. (row+1) .. "M" )
+    if keymap.modkeys["ctrl"] and self:open_link(col, row) then
+      return true
     else
+      local scrollback = self.terminal:scrollback()
       if clicks % 4 == 1 then
-        self.selection = nil
+        self.terminal:select()
         self.pressing = true
       elseif clicks % 4 == 2 then
-        self.word_selecting = { self:get_word_boundaries(col, row) }
-        self.selection = { table.unpack(self.word_selecting) }
+        self.terminal:select(row - scrollback, col, "word")
+        self.selecting = true
       elseif clicks % 4 == 3 then
-        local scrollback = self.terminal:scrollback()
-        row = row - scrollback
-        self.row_selecting = { 0, row, 0, row + 1 }
-        self.selection = { 0, row, 0, row + 1 }
+        self.terminal:select(row - scrollback, col, "line")
+        self.selecting = true
       end
     end
   end
@@ -595,7 +795,7 @@ function TerminalView:on_mouse_moved(x, y, dx, dy)
   end
   self.mouse_x = x
   self.mouse_y = y
-  if self.pressing or self.word_selecting or self.row_selecting then
+  if self.pressing or self.selecting then
     if y < self.position.y then
       self.scrolling_offscreen = 1
     elseif y > self.position.y + self.size.y then
@@ -605,32 +805,15 @@ function TerminalView:on_mouse_moved(x, y, dx, dy)
     end
     local col, line, col_approx = self:convert_coordinates(x, y)
     local scrollback = self.terminal:scrollback()
-    if not self.selection then self.selection = { col_approx, line - scrollback } end
-    if not self.word_selecting and not self.row_selecting then
-      self.selection[3] = col_approx
-      self.selection[4] = line - scrollback
-    elseif self.word_selecting then
-      local col1, line1, col2, line2 = self:get_word_boundaries(col, line)
-      if not col1 then
-        self.selection[3] = col
-        self.selection[4] = line - scrollback
-      elseif self.word_selecting[2] > line1 or (self.word_selecting[2] == line1 and self.word_selecting[1] >= col1) then
-        self.selection[1] = col1
-        self.selection[2] = line1
-        self.selection[3] = self.word_selecting[3]
-        self.selection[4] = self.word_selecting[4]
-      else
-        self.selection[1] = self.word_selecting[1]
-        self.selection[2] = self.word_selecting[2]
-        self.selection[3] = col2
-        self.selection[4] = line2
-      end
-    else
-      self.selection[1] = 0
-      self.selection[2] = math.min(self.row_selecting[2], line - scrollback)
-      self.selection[3] = 0
-      self.selection[4] = math.max(self.row_selecting[4], line - scrollback + 1)
+    if not self.selecting then
+      self.terminal:select(line - scrollback, col_approx, "character")
+      self.selecting = true
     end
+    self.terminal:extend(line - scrollback, self.pressing and col_approx or col)
+  elseif self.terminal then
+    -- Only reported if the application tracks motion; it's coalesced natively, and sent once a frame.
+    local col, row = self:convert_coordinates(x, y)
+    self.terminal:mouse("move", nil, col, row, keymap.modkeys)
   end
 end
 
@@ -639,16 +822,11 @@ function TerminalView:on_mouse_released(button, x, y)
   self.v_scrollbar:on_mouse_released(button, x, y)
   if button == "left" then
     self.pressing = false
-    self.word_selecting = nil
-    self.row_selecting = nil
+    self.selecting = nil
     self.scrolling_offscreen = nil
-    local col, row = self:convert_coordinates(x, y)
-    if self.terminal:mouse_tracking_mode() == "normal" then
-      self.terminal:input("\x1B[M" .. string.char(32 + 3) .. string.char(32 + col + 1) .. string.char(32 + row + 1) )
-    elseif self.terminal:mouse_tracking_mode() == "sgr" then
-      self.terminal:input("\x1B[<0;" .. (col+1) .. ";" .. (row+1) .. "m")
-    end
   end
+  local col, row = self:convert_coordinates(x, y)
+  self.terminal:mouse("release", button, col, row, keymap.modkeys)
 end
 
 
@@ -662,7 +840,7 @@ end
 
 function TerminalView:input(text)
   if self.terminal then
-    self.terminal:input(text)
+    self.pending_input = self.terminal:input(text) > 0
     if self.terminal:scrollback() ~= 0 then self.terminal:scrollback(0) end
     self:shift_selection_update()
     core.redraw = true
@@ -673,6 +851,17 @@ function TerminalView:input(text)
   return false
 end
 
+function TerminalView:paste(text)
+  if self.terminal then
+    self.pending_input = self.terminal:paste(text) > 0
+    if self.terminal:scrollback() ~= 0 then self.terminal:scrollback(0) end
+    self:shift_selection_update()
+    core.redraw = true
+    return true
+  end
+  return self:input(text)
+end
+
 function TerminalView:on_text_input(text)
   return self:input(text)
 end
@@ -680,14 +869,22 @@ end
 
 function TerminalView:close()
   if self.terminal then self.terminal:close() end
+  self.terminal = nil
   local node = core.root_view.root_node:get_node_for_view(self)
   node:close_view(core.root_view.root_node, self)
   if core.terminal_view == self then core.terminal_view = nil end
-  self.terminal = nil
   self.routine = nil
 end
 
 
+-- closing the tab ends the shell; otherwise, with the daemon, it'd carry on detached until the editor restarts
+function TerminalView:try_close(do_close)
+  if self.terminal then self.terminal:close() end
+  self.terminal = nil
+  TerminalView.super.try_close(self, do_close)
+end
+
+
 function TerminalView:get_text(line1, col1, line2, col2)
   local full_buffer = {}
   for line_idx, line in ipairs(self.terminal:lines(line1, line2)) do
@@ -737,11 +934,7 @@ end, {
   ["terminal:scroll"] = function(view, amount)
     if view.terminal:mouse_tracking_mode() then
       local col, row = view:convert_coordinates(view.mouse_x, view.mouse_y)
-      if view.terminal:mouse_tracking_mode() == "normal" then
-        view.terminal:input("\x1B[M" .. string.char(amount > 0 and 64 or 65) .. string.char(32 + col + 1) .. string.char(32 + row + 1) )
-      elseif view.terminal:mouse_tracking_mode() == "sgr" then
-        view.terminal:input("\x1B[<" .. (amount > 0 and 64 or 65) .. ";" .. (col+1) .. ";" .. (row+1) .. "M" )
-      end
+      view.terminal:mouse("wheel", amount > 0 and "up" or "down", col, row, keymap.modkeys)
     else
       view.accumulated_scroll = (view.accumulated_scroll or 0) + (amount or 1)
       if math.abs(view.accumulated_scroll) >= 1 then
@@ -770,18 +963,33 @@ command.add(active_terminal_predicate, {
   ["terminal:suspend"] = function(view) view:input("\x1A") end,
   ["terminal:tab"] = function(view) view:input("\t") end,
   ["terminal:paste"] = function(view)
-    if view.terminal:paste_mode() == "bracketed" then
-      view:input("\x1B[200~" .. system.get_clipboard() .. "\x1B[201~")
-    else
-      view:input(system.get_clipboard())
-    end
+    view:paste(system.get_clipboard())
   end,
   ["terminal:page-up"] = function(view) view:input("\x1B[5~") end,
   ["terminal:page-down"] = function(view) view:input("\x1B[6~") end,
   ["terminal:scroll-up"] = function(view) view.terminal:scrollback(view.terminal:scrollback() + view.lines) end,
   ["terminal:scroll-down"] = function(view) view.terminal:scrollback(view.terminal:scrollback() - view.lines) end,
   ["terminal:scroll-to-end"] = function(view) view.terminal:scrollback(0) end,
-  ["terminal:scroll-to-top"] = function(view) view.terminal:scrollback(view.options.scrollback_limit) end,
+  ["terminal:scroll-to-top"] = function(view) view.terminal:scrollback(select(2, view.terminal:scrollback())) end,
+  -- these rely on the shell marking its prompts with OSC 133
+  ["terminal:previous-prompt"] = function(view)
+    local line = view.terminal:prompt(-view.terminal:scrollback(), -1)
+    if line then view.terminal:scrollback(math.max(-line, 0)) end
+  end,
+  ["terminal:next-prompt"] = function(view)
+    local line = view.terminal:prompt(-view.terminal:scrollback(), 1)
+    view.terminal:scrollback(line and math.max(-line, 0) or 0)
+  end,
+  ["terminal:copy-last-output"] = function(view)
+    local output = view.terminal:command_output()
+    if output then system.set_clipboard(output) end
+  end,
+  -- keystroke to echo, as measured inside the terminal; echo is the grid changing, present is that change being drawn
+  ["terminal:show-latency"] = function(view)
+    local latency = view.terminal:latency(true)
+    core.log("Terminal latency over %d echoes: echo p50 %.1fms, p99 %.1fms; present p50 %.1fms, p99 %.1fms, max %.1fms",
+      latency.echo.count, latency.echo.p50, latency.echo.p99, latency.present.p50, latency.present.p99, latency.present.max)
+  end,
   ["terminal:up"] = function(view) view:input(view.terminal:cursor_keys_mode() == "application" and "\x1BOA" or "\x1B[A") end,
   ["terminal:down"] = function(view) view:input(view.terminal:cursor_keys_mode() == "application" and "\x1BOB" or "\x1B[B") end,
   ["terminal:left"] = function(view) view:input(view.terminal:cursor_keys_mode() == "application" and "\x1BOD" or "\x1B[D") end,
@@ -843,11 +1051,10 @@ if system.get_primary_selection then -- check for master vs. 2.1.7
 end
 
 command.add(function()
-  return core.active_view and core.active_view:is(TerminalView) and core.active_view.selection and #core.active_view.selection == 4
+  return core.active_view and core.active_view:is(TerminalView) and core.active_view:sorted_selection() ~= nil
 end, {
   ["terminal:copy"] = function()
-    local selection = core.active_view:sorted_selection()
-    system.set_clipboard(core.active_view:get_text(selection[2], selection[1], selection[4], selection[3]))
+    system.set_clipboard(core.active_view.terminal:selection_text())
   end
 })
 
@@ -890,6 +1097,26 @@ command.add(nil, {
   ["terminal:open-tab"] = function()
     local tv = TerminalView(config.plugins.terminal)
     core.root_view:get_active_node_default():add_view(tv)
+  end,
+  ["terminal:open-file"] = function()
+    core.command_view:enter("Open File In Terminal", {
+      submit = function(path)
+        core.root_view:get_active_node_default():add_view(TerminalView({ file = system.absolute_path(common.home_expand(path)) or path }))
+      end,
+      suggest = function(text) return common.path_suggest(common.home_expand(text)) end
+    })
+  end
+})
+command.add(active_terminal_predicate, {
+  ["terminal:split"] = function(view)
+    local tv = TerminalView({ attach = view })
+    local node = core.root_view.root_node:get_node_for_view(view)
+    -- the drawer can't be split, so its terminal is mirrored into a tab instead
+    if node.locked then
+      core.root_view:get_active_node_default():add_view(tv)
+    else
+      node:split("right", tv)
+    end
   end
 })
 command.add(function() return core.terminal_view and core.active_view ~= core.terminal_view end, {
@@ -910,7 +1137,9 @@ core.status_view:add_item({
     return {
       style.text, style.font, (dv.terminal:name() or config.plugins.terminal.shell),
       style.dim, style.font, core.status_view.separator2,
-      style.text, style.font, x .. "x" .. y
+      style.text, style.font, x .. "x" .. y,
+      style.dim, style.font, core.status_view.separator2,
+      style.text, style.font, string.format("%.1fMB", dv.terminal:memory() / (1024 * 1024))
     }
   end
 })
@@ -945,6 +1174,8 @@ local keys = {
   ["shift+pagedown"] = "terminal:scroll-down",
   ["shift+end"] = "terminal:scroll-to-end",
   ["shift+home"] = "terminal:scroll-to-top",
+  ["ctrl+shift+up"] = "terminal:previous-prompt",
+  ["ctrl+shift+down"] = "terminal:next-prompt",
   ["up"] = "terminal:up",
   ["down"] = "terminal:down",
   ["left"] = "terminal:left",
@@ -1023,6 +1254,26 @@ if config.plugins.terminal.inversion_key then
   keymap.add(settings)
 end
 
+refill_pool()
+
+-- shells of closed terminals get a moment to exit before being killed; with no terminals left to update, nothing else would check
+core.add_thread(function()
+  while true do
+    terminal_native.reap()
+    coroutine.yield(0.25)
+  end
+end)
+
+-- pick up whatever shells the daemon kept running for us since the editor last closed
+if daemon_path() then
+  core.add_thread(function()
+    for _, session in ipairs(terminal_native.sessions(config.plugins.terminal.daemon_socket) or {}) do
+      local node = core.root_view:get_active_node_default()
+      node:add_view(TerminalView({ session = session.id }))
+    end
+  end)
+end
+
 return {
   class = TerminalView
 }
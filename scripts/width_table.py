@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+# Generates src/width_table.h, the table of how many cells each codepoint takes up, from python's unicodedata:
+#
+#   python3 scripts/width_table.py > src/width_table.h
+#
+# Wide and fullwidth characters (which includes emoji with emoji presentation) take two cells; combining marks, format
+# characters and hangul medial vowels and final consonants take none, and are joined onto the cell before them.
+import sys
+import unicodedata
+
+def width(codepoint):
+    if codepoint == 0xAD:
+        return 1
+    if 0x1160 <= codepoint <= 0x11FF or 0xD7B0 <= codepoint <= 0xD7FF:
+        return 0
+    if 0x20000 <= codepoint <= 0x2FFFD or 0x30000 <= codepoint <= 0x3FFFD:
+        return 2
+    character = chr(codepoint)
+    if unicodedata.category(character) in ("Mn", "Me", "Cf"):
+        return 0
+    if unicodedata.east_asian_width(character) in ("W", "F"):
+        return 2
+    return 1
+
+blocks, block_index, indices = [], {}, []
+for start in range(0, 0x110000, 256):
+    data = bytearray(64)
+    for offset in range(256):
+        data[offset >> 2] |= width(start + offset) << ((offset & 3) * 2)
+    data = bytes(data)
+    if data not in block_index:
+        block_index[data] = len(blocks)
+        blocks.append(data)
+    indices.append(block_index[data])
+assert len(blocks) <= 256
+
+out = sys.stdout
+out.write("// Generated by scripts/width_table.py from Unicode %s; do not edit.\n" % unicodedata.unidata_version)
+out.write("// Cell widths of every codepoint, two bits each, in blocks of 256 codepoints; identical blocks are shared.\n")
+out.write("static const uint8_t width_table_blocks[%d] = {\n" % len(indices))
+for i in range(0, len(indices), 32):
+    out.write("  " + ",".join("%d" % index for index in indices[i:i+32]) + ",\n")
+out.write("};\n")
+out.write("static const uint8_t width_table_data[%d][64] = {\n" % len(blocks))
+for block in blocks:
+    out.write("  {" + ",".join("0x%02X" % byte for byte in block) + "},\n")
+out.write("};\n")
@@ -1,3 +1,6 @@
+#if __linux__
+  #define _GNU_SOURCE // For POSIX_SPAWN_SETSID.
+#endif
 #if _WIN32
   // https://devblogs.microsoft.com/commandline/windows-command-line-introducing-the-windows-pseudo-console-conpty/
   #if __MINGW32__ || __MINGW64__ // https://stackoverflow.com/questions/66419746/is-there-support-for-winpty-in-mingw-w64
@@ -11,16 +14,35 @@
   #include <unistd.h>
   #include <fcntl.h>
   #include <sys/ioctl.h>
+  #include <sys/mman.h>
   #include <sys/types.h>
   #include <sys/wait.h>
   #include <signal.h>
+  #include <spawn.h>
+  #include <poll.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <pthread.h>
+  #include <setjmp.h>
+  #if __linux__
+    #include <sys/syscall.h>
+  #endif
   #if __APPLE__
     #include <util.h>
+    #include <crt_externs.h>
+    #define environ (*_NSGetEnviron())
   #else
     #include <pty.h>
+    extern char** environ;
+  #endif
+  #if __linux__ && defined(POSIX_SPAWN_SETSID)
+    // Opening the pty slave in a new session makes it the controlling terminal on linux, so we don't need to fork at all.
+    #define LIBTERMINAL_POSIX_SPAWN
   #endif
 #endif
 #include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
@@ -30,6 +52,9 @@
 #include <string.h>
 #include <math.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+  #include <sys/time.h>
+#endif
 
 #ifdef LIBTERMINAL_STANDALONE
   #include <lua.h>
@@ -40,6 +65,8 @@
   #include <lite_xl_plugin_api.h>
 #endif
 
+#include "width_table.h"
+
 #ifndef min
   static int min(int a, int b) { return a < b ? a : b; }
   static int max(int a, int b) { return a > b ? a : b; }
@@ -48,9 +75,27 @@
 #define LIBTERMINAL_BACKBUFFER_PAGE_LINES 200
 #define LIBTERMINAL_CHUNK_SIZE 4096
 #define LIBTERMINAL_MAX_CHUNKS_PROCESSED 10
-#define LIBTERMINAL_MAX_LINE_WIDTH 1024
+#define LIBTERMINAL_MAX_FLOOD_SIZE (8*1024*1024) // The most we'll read in one update if we can fast-forward through it.
 #define LIBTERMINAL_NAME_MAX 256
 #define LIBTERMINAL_DEFAULT_TAB_SIZE 8
+#define LIBTERMINAL_SPILL_SEGMENT_SIZE (64*1024*1024)
+#define LIBTERMINAL_RESIZE_DEBOUNCE 0.1 // Seconds to wait after the last resize before telling the pty.
+#define LIBTERMINAL_MAX_LOGICAL_LINE_ROWS 16 // How far back we'll follow wrapped rows, when looking at a completed line.
+#define LIBTERMINAL_MAX_TRIGGER_EVENTS 256
+#define LIBTERMINAL_MAX_MATCH_STEPS 100000 // A pattern that takes longer than this to match against a line doesn't match.
+#define LIBTERMINAL_SYNCHRONIZED_TIMEOUT 0.2 // How long an application can hold back a frame with synchronized output, in seconds.
+#define LIBTERMINAL_MAX_SEQUENCE_SIZE (64*1024) // Escape sequences longer than this are read through, and dropped.
+#define LIBTERMINAL_MAX_CLIPBOARD_SIZE (8*1024*1024) // The most an application can put on the clipboard with OSC 52, decoded.
+#define LIBTERMINAL_ORPHAN_GRACE 2.0 // How long a closed terminal's shell has to exit after SIGHUP, before we SIGKILL it.
+#define LIBTERMINAL_WIDE_CONTINUATION 0x110000 // The codepoint of the cell under the right half of a wide character.
+#define LIBTERMINAL_CLUSTER_FLAG 0x80000000 // If set on a cell's codepoint, the rest of it is an index into the terminal's clusters.
+#define LIBTERMINAL_MAX_CLUSTER_LENGTH 8 // Codepoints in a cluster, including the base; any more marks are dropped.
+#define LIBTERMINAL_MAX_CLUSTERS 65536 // Distinct clusters a terminal will hold; past this, marks are dropped.
+#define LIBTERMINAL_REMOTE_FRAME_HEADER 5 // Type byte, and 32 bit length.
+#define LIBTERMINAL_REMOTE_TIMEOUT 5000 // How long we'll wait on the daemon when connecting, in milliseconds.
+#define LIBTERMINAL_SNAPSHOT_VERSION 3 // Bumped whenever the layout of snapshots changes; we only read back our own.
+#define LIBTERMINAL_FILE_CHECKPOINT_LINES 256 // Lines of a file between each point we can start parsing from; the most we parse that isn't on screen.
+#define LIBTERMINAL_LATENCY_BUCKETS 96 // Four per doubling, from a microsecond; the last takes anything over about 30 seconds.
 
 typedef enum attributes_e {
   // Colors
@@ -63,7 +108,10 @@ typedef enum attributes_e {
   ATTRIBUTE_BOLD = 8,
   ATTRIBUTE_ITALIC = 16,
   ATTRIBUTE_UNDERLINE = 32,
-  ATTRIBUTE_STYLING_MASK = (32 | 16 | 8)
+  ATTRIBUTE_STYLING_MASK = (32 | 16 | 8),
+  // Never stored in cells; only set on the foreground of groups handed to lua, which are then always a single cell.
+  ATTRIBUTE_WIDE = 64,                 // The cell takes up two columns.
+  ATTRIBUTE_CLUSTER = 128              // The cell has combining marks, so its text is more than one codepoint.
 } attributes_e;
 
 typedef struct color_t {
@@ -105,11 +153,18 @@ typedef struct buffer_char_t {
   uint32_t codepoint;
 } buffer_char_t;
 
+// A character along with the zero-width codepoints that were joined onto it. Zero-terminated, unless full.
+typedef struct cluster_t {
+  uint32_t codepoints[LIBTERMINAL_MAX_CLUSTER_LENGTH];
+} cluster_t;
+
 typedef struct backbuffer_page_t {
   struct backbuffer_page_t* prev;
   struct backbuffer_page_t* next;
   int columns, lines, line;
-  buffer_char_t buffer[];
+  int spill_segment;                  // If this page has been spilled to disk, the index of the segment it lives in; -1 otherwise.
+  uint64_t serial;                    // Monotonically increasing across all terminals; lets us find the globally oldest page.
+  buffer_char_t* buffer;              // Points either just past this header, or into a spill segment.
 } backbuffer_page_t;
 
 typedef enum view_e {
@@ -118,6 +173,31 @@ typedef enum view_e {
   VIEW_MAX = 2
 } view_e;
 
+typedef enum terminal_escape_type_e {
+  ESCAPE_TYPE_NONE,
+  ESCAPE_TYPE_OPEN,
+  ESCAPE_TYPE_CSI,
+  ESCAPE_TYPE_OS,
+  ESCAPE_TYPE_DCS,                     // Device control strings, and the other strings terminated like them; read through, and dropped.
+  ESCAPE_TYPE_FIXED_WIDTH,
+  ESCAPE_TYPE_UNKNOWN
+} terminal_escape_type_e;
+
+// Frames on the daemon's socket are a type byte, the length of the payload as a native 32 bit integer, then the payload.
+typedef enum remote_frame_e {
+  REMOTE_FRAME_SPAWN = 's',            // To the daemon: starts a session; columns, lines and scrollback limit, then term, path, arguments and environment.
+  REMOTE_FRAME_ATTACH = 'a',           // To the daemon: attaches to a detached session, by id.
+  REMOTE_FRAME_LIST = 'l',             // To the daemon, empty; back, the id, whether it's exited, and name of each detached session.
+  REMOTE_FRAME_INPUT = 'i',            // To the daemon: input for the shell.
+  REMOTE_FRAME_RESIZE = 'r',           // To the daemon: columns and lines.
+  REMOTE_FRAME_KILL = 'k',             // To the daemon: ends the session, rather than leaving it detached when we disconnect.
+  REMOTE_FRAME_SESSION = 'n',          // From the daemon: the id of the session we're now attached to.
+  REMOTE_FRAME_SNAPSHOT = 'S',         // From the daemon: the terminal as it is when we attach.
+  REMOTE_FRAME_OUTPUT = 'o',           // From the daemon: output from the shell, exactly as the daemon parsed it.
+  REMOTE_FRAME_EXIT = 'x',             // From the daemon: the shell's wait status.
+  REMOTE_FRAME_ERROR = 'e'             // From the daemon: why a spawn or attach failed.
+} remote_frame_e;
+
 typedef enum cursor_mode_e {
   CURSOR_SOLID         = 0,
   CURSOR_HIDDEN        = 1,
@@ -129,6 +209,64 @@ typedef enum paste_mode_e {
   PASTE_BRACKETED
 } paste_mode_e;
 
+typedef enum selection_mode_e {
+  SELECTION_NONE,
+  SELECTION_CHARACTER,
+  SELECTION_WORD,
+  SELECTION_LINE
+} selection_mode_e;
+
+typedef struct selection_point_t {
+  int64_t line;                        // Absolute line id.
+  int column;
+} selection_point_t;
+
+// What a single lua handle on a terminal is looking at. Views that share a terminal each have their own, so they can scroll
+// and select independently of one another, while sharing the grid and scrollback.
+typedef struct viewport_t {
+  struct viewport_t* next;                 // Every viewport on a terminal is in a linked list hung off of it.
+  backbuffer_page_t* scrollback_target;    // Target based on scrollback_position.
+  int scrollback_target_top_offset;        // The offset that the top of the scrollback_target page is from the start of the buffer.
+  int scrollback_position;                 // Canonical amount of lines we've scrolled back.
+  selection_mode_e selection_mode;
+  selection_point_t selection_anchor[2];   // What was initially selected; a word or line when expanding, otherwise empty.
+  selection_point_t selection[2];          // Start and end (exclusive) of the selection, in order.
+  int columns, lines;                      // The size the view would like the terminal to be; 0 if it doesn't mind.
+} viewport_t;
+
+// A command run at a prompt, as marked by the shell with OSC 133. Any point the shell hasn't marked (yet) has a line of -1.
+typedef struct command_t {
+  selection_point_t prompt;            // A: where the prompt starts.
+  selection_point_t input;             // B: where the user's input starts.
+  selection_point_t output;            // C: where the command's output starts.
+  selection_point_t end;               // D: where the command's output ends.
+  int exit_code;                       // From D; -1 if not given.
+} command_t;
+
+typedef enum link_type_e {
+  LINK_URL,
+  LINK_FILE                            // path:line, or path:line:column.
+} link_type_e;
+
+// A span of output that looks like something clickable; may cross wrapped lines.
+typedef struct link_t {
+  selection_point_t start, end;        // End is exclusive.
+  link_type_e type;
+} link_t;
+
+// A pattern that's matched against every line as it's completed. Events are queued until the next call to `triggered`.
+typedef struct trigger_t {
+  int id;
+  int literal;                         // If true, pattern is matched as a plain substring; otherwise, see match_pattern.
+  char* pattern;
+} trigger_t;
+
+typedef struct trigger_event_t {
+  int id;                              // The trigger's id, or 0 for a bell.
+  int64_t line;                        // Id of the first line of what matched.
+  char* text;                          // The line that matched; NULL for a bell.
+} trigger_event_t;
+
 typedef enum keys_mode_e {
   KEYS_MODE_NORMAL,
   KEYS_MODE_APPLICATION
@@ -136,11 +274,18 @@ typedef enum keys_mode_e {
 
 typedef enum mouse_tracking_mode_e {
   MOUSE_TRACKING_NONE,
-  MOUSE_TRACKING_X10,
-  MOUSE_TRACKING_NORMAL,
-  MOUSE_TRACKING_SGR
+  MOUSE_TRACKING_X10,                  // 9: presses only.
+  MOUSE_TRACKING_NORMAL,               // 1000: presses and releases.
+  MOUSE_TRACKING_BUTTON,               // 1002: as above, and motion while a button is held.
+  MOUSE_TRACKING_ANY                   // 1003: as above, and all motion.
 } mouse_tracking_mode_e;
 
+typedef enum mouse_event_e {
+  MOUSE_PRESS,
+  MOUSE_RELEASE,
+  MOUSE_MOTION
+} mouse_event_e;
+
 typedef enum charset_e {
   CHARSET_US,
   CHARSET_DEC,
@@ -150,6 +295,8 @@ typedef enum charset_e {
 typedef struct view_t {
   buffer_char_t* buffer;
   int* overflows; // I don't like this, but as a result of how this is architected, this is necessary to ensure proper line outputs.
+  int buffer_capacity;                 // Amount of cells allocated in buffer; we only ever grow this, so that dragging a window around doesn't thrash the allocator.
+  int overflows_capacity;              // Amount of lines allocated in overflows.
   int cursor_x, cursor_y;
   int cursor_styling_inversed;
   buffer_styling_t cursor_styling; // What characters are currently being emitted as.
@@ -157,6 +304,7 @@ typedef struct view_t {
   keys_mode_e cursor_keys_mode;
   keys_mode_e keypad_keys_mode;
   mouse_tracking_mode_e mouse_tracking_mode;
+  int mouse_sgr;                       // 1006; if set, mouse reports are CSI < button ; x ; y M (or m), rather than raw bytes.
   color_t palette[256];                // Custom palette as per the ^][4;#;rgb:24/04/3C command. The fuck?
   charset_e charset;
   int last_graphical_character; // for CSI b
@@ -167,32 +315,100 @@ typedef struct view_t {
   // text wherever. However, if you hit newline, at the bottom of the scroll region
   // shifts only that region up.
   int scrolling_region_start, scrolling_region_end;
+  int margins_enabled;                 // DECLRMM (?69); if set, CSI s sets left and right margins rather than saving the cursor.
+  // Left and right margins, as set by DECSLRM, with the right exclusive; -1 if unset. Scrolling, whether from a newline
+  // at the bottom of the region or explicit, only moves the text between them.
+  int margin_left, margin_right;
+  unsigned int generation;             // Bumped whenever cells are written; how the latency probe tells that the grid has changed.
 } view_t;
 
+typedef enum latency_stage_e {
+  LATENCY_ECHO,                        // From a keystroke to the first change to the grid after it.
+  LATENCY_PRESENT,                     // From a keystroke to the first draw that shows that change.
+  LATENCY_STAGE_COUNT
+} latency_stage_e;
+
+typedef struct latency_histogram_t {
+  unsigned int counts[LIBTERMINAL_LATENCY_BUCKETS];
+  unsigned int total;
+  double max;                          // Longest sample, in seconds.
+} latency_histogram_t;
+
 typedef enum mode_e {
   // Acts as a normal terminal, with a pty, and a shell.
   MODE_PTY,
   // Acts as a dummy; text is pumped in manually from lua.
-  MODE_DUMMY
+  MODE_DUMMY,
+  // Mirrors a terminal held by the daemon, over its socket in master; the daemon owns the pty, and answers the shell's queries.
+  MODE_REMOTE,
+  // Shows a file, read-only, drawing only what's on screen; see file_view_t.
+  MODE_FILE
 } mode_e;
 
-typedef struct {
+typedef struct terminal_t {
+  struct terminal_t* prev;                           // Every live terminal is in a linked list, so that we can enforce a global scrollback memory limit.
+  struct terminal_t* next;
   int debug;                                         // If true, dumps output to working directory in a file called `terminal.log`.
+  uint64_t spawn_key;                                // Hash of what was spawned; lets us match pooled terminals to requests.
   backbuffer_page_t* scrollback_buffer_end;          // End of the linked list.
   backbuffer_page_t* scrollback_buffer_start;        // Beginning of linked list.
-  backbuffer_page_t* scrollback_target;              // Target based on scrollback_position.
-  int scrollback_target_top_offset;                  // The offset that the top of the scrollback_target page is from the start of the buffer.
   int scrollback_total_lines;                        // Cached total amount of lines we can scroll bcak.
-  int scrollback_position;                           // Canonical amount of lines we've scrolled back.
   int scrollback_limit;                              // The amount of lines we'll hold in memory maximum.
+  int64_t line_id_base;                              // Id of the top line of the screen; goes up by one for every line that enters the scrollback.
+  backbuffer_page_t* scrollback_resident_end;        // Oldest page that's still in memory; everything older has been spilled to disk.
+  int scrollback_resident_lines;                     // Amount of lines in pages that are still in memory.
+  int scrollback_spill_limit;                        // The amount of lines we'll hold on disk maximum; 0 for no limit.
+  size_t scrollback_bytes;                           // The amount of bytes our in-memory scrollback pages currently take up.
+  size_t scrollback_bytes_limit;                     // The amount of bytes we'll hold in scrollback maximum; 0 for no limit.
   int columns, lines;
+  int resize_pending;                                // If true, the pty hasn't yet been told about our latest size.
+  double resize_deadline;                            // When we should tell the pty about our size, if no other resize comes in.
   view_e current_view;
   view_t views[VIEW_MAX];                            // Normally just two buffers, normal, and alternate.
   paste_mode_e paste_mode;
+  viewport_t* viewports;                             // One for each view onto us; the grid is sized to fit the smallest of them.
+  int references;                                    // Lua handles that still point at us; we're only freed once they're all collected.
+  command_t* commands;                               // Commands, in order of their prompt; pruned as their lines leave the scrollback.
+  int command_count, command_capacity;
+  link_t* links;                                     // Links found in completed lines of the normal buffer, in order.
+  int link_count, link_capacity;
+  trigger_t* triggers;
+  int trigger_count, trigger_next_id;
+  trigger_event_t* trigger_events;                   // Events not yet picked up by lua; we stop queueing once it's full.
+  int trigger_event_count;
+  cluster_t* clusters;                               // Interned, so they're shared between every cell that uses them, and never freed before we are.
+  int cluster_count, cluster_capacity;
+  int* cluster_table;                                // Open addressed hash of clusters; index + 1, or 0 if empty.
+  int cluster_table_capacity;
+  double synchronized_deadline;                      // While output is synchronized (mode 2026), when we stop waiting for the frame to end; otherwise 0.
+  int synchronized_damage;                           // If true, output arrived while synchronized that we've yet to report.
+  buffer_char_t* frame;                              // The screen as it was when output became synchronized, which is what we draw until it ends.
+  int* frame_overflows;
+  int frame_cursor_x, frame_cursor_y;
+  cursor_mode_e frame_cursor_mode;
   mode_e mode;                                       // The mode the terminal is in. 
   int reporting_focus;                               // Enables/disbles reporting focus.
   char name[LIBTERMINAL_NAME_MAX];                   // Window name, set with OS command.
-  char buffered_sequence[LIBTERMINAL_CHUNK_SIZE];
+  terminal_escape_type_e escape_type;                // The kind of sequence we're partway through, if any.
+  char* sequence;                                    // The sequence we're partway through, zero-terminated; grows as needed, up to a point.
+  int sequence_length, sequence_capacity;
+  int sequence_overflowed;                           // If true, the sequence is too long, and is only being read through to its end.
+  int sequence_escaped;                              // If true, the last byte of a string was an escape; the start of its terminator.
+  char* clipboard;                                   // The contents of an OSC 52, decoded as it streams in; handed to lua once complete.
+  int clipboard_length, clipboard_capacity;
+  int clipboard_streaming, clipboard_ready, clipboard_overflowed;
+  unsigned int clipboard_bits;                       // Base64 bits that don't yet make up a whole byte, and how many there are.
+  int clipboard_bit_count;
+  char clipboard_target[16];                         // The selections the clipboard is for; c, p, s and so on.
+  char* input_queue;                                 // Input the pty wouldn't take yet; flushed in terminal_update.
+  int input_queue_offset, input_queue_length, input_queue_capacity;
+  int mouse_buttons;                                 // The buttons the application has been told are held, as 1 << button.
+  int mouse_x, mouse_y;                              // The cell the application was last told the pointer is in.
+  int mouse_motion_pending;                          // If true, the pointer has moved to another cell since; reported in terminal_update.
+  int mouse_motion_x, mouse_motion_y, mouse_motion_modifiers;
+  double latency_input;                              // When the earliest keystroke we've yet to see echoed was sent; 0 if none.
+  double latency_echoed;                             // When the keystroke whose echo is yet to be drawn was sent; 0 if none.
+  latency_histogram_t latency[LATENCY_STAGE_COUNT];
   #if _WIN32
     PROCESS_INFORMATION process_information;
     HPCON hpcon;
@@ -206,10 +422,39 @@ typedef struct {
   #else
     int master;                                        // FD for pty.
     pid_t pid;                                         // pid for shell.
+    int spilling;                                      // If true, pages evicted from scrollback are written to spill_fd rather than freed.
+    int spill_fd;                                      // Unlinked temporary file; pages live in it in fixed size, memory-mapped segments.
+    char** spill_segments;                             // Mapped segments; NULL once all pages within a segment have been dropped.
+    int spill_segment_count;
+    size_t spill_segment_offset;                       // Where the next page goes in the last segment.
+    int pidfd;                                         // Readable once the shell exits; -1 if we have to rely on SIGCHLD instead.
+    int exited;                                        // If true, the shell has been reaped, and its status is in exit_status.
+    int exit_status;
+    int exit_reported;                                 // If true, terminal_update has already reported the exit.
+    int session;                                       // In MODE_REMOTE, the id of our session in the daemon.
+    char* remote_buffer;                               // In MODE_REMOTE, what we've read from the daemon that isn't yet a whole frame.
+    int remote_length, remote_capacity;
+    struct file_view_t* file;                          // In MODE_FILE, the file we're showing.
   #endif
 } terminal_t;
 
 
+static terminal_t* terminals;                      // All live terminals.
+static terminal_t* terminal_pool;                  // Pre-spawned terminals, waiting to be handed out; not in the above.
+static size_t scrollback_global_bytes;             // Sum of scrollback_bytes across all terminals.
+static size_t scrollback_global_bytes_limit;       // Maximum for the above; 0 for no limit.
+static uint64_t scrollback_page_serial;
+static char* scratch_buffer;                       // Space for laying out rows as text; grows to fit the widest we've seen.
+static size_t scratch_capacity;
+
+static char* scratch_reserve(size_t size) {
+  if (size > scratch_capacity) {
+    scratch_capacity = size > scratch_capacity * 2 ? size : scratch_capacity * 2;
+    scratch_buffer = realloc(scratch_buffer, scratch_capacity);
+  }
+  return scratch_buffer;
+}
+
 static int utf8_to_codepoint(const char *p, unsigned *dst) {
   const unsigned char *up = (unsigned char*)p;
   unsigned res, n;
@@ -248,6 +493,134 @@ static int codepoint_to_utf8(unsigned int codepoint, char* target) {
   return 4;
 }
 
+// The amount of cells a codepoint takes up; 0 for those that join onto the character before them.
+static int codepoint_width(unsigned int codepoint) {
+  if (codepoint < 0x300)
+    return 1;
+  if (codepoint >= 0x110000)
+    return 1;
+  return (width_table_data[width_table_blocks[codepoint >> 8]][(codepoint & 0xFF) >> 2] >> ((codepoint & 3) * 2)) & 3;
+}
+
+static uint64_t hash_cluster(const cluster_t* cluster) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < LIBTERMINAL_MAX_CLUSTER_LENGTH; ++i)
+    hash = (hash ^ cluster->codepoints[i]) * 1099511628211ULL;
+  return hash;
+}
+
+// Returns the index of the cluster, adding it if we haven't seen it before, or -1 if we're full.
+static int terminal_intern_cluster(terminal_t* terminal, const cluster_t* cluster) {
+  if (terminal->cluster_table_capacity == 0 || terminal->cluster_count * 2 >= terminal->cluster_table_capacity) {
+    if (terminal->cluster_count >= LIBTERMINAL_MAX_CLUSTERS)
+      goto lookup;
+    int capacity = terminal->cluster_table_capacity ? terminal->cluster_table_capacity * 2 : 64;
+    int* table = calloc(sizeof(int), capacity);
+    for (int i = 0; i < terminal->cluster_count; ++i) {
+      int slot = hash_cluster(&terminal->clusters[i]) & (capacity - 1);
+      while (table[slot])
+        slot = (slot + 1) & (capacity - 1);
+      table[slot] = i + 1;
+    }
+    free(terminal->cluster_table);
+    terminal->cluster_table = table;
+    terminal->cluster_table_capacity = capacity;
+  }
+  lookup:;
+  int slot = hash_cluster(cluster) & (terminal->cluster_table_capacity - 1);
+  for (; terminal->cluster_table[slot]; slot = (slot + 1) & (terminal->cluster_table_capacity - 1)) {
+    if (memcmp(&terminal->clusters[terminal->cluster_table[slot] - 1], cluster, sizeof(cluster_t)) == 0)
+      return terminal->cluster_table[slot] - 1;
+  }
+  if (terminal->cluster_count >= LIBTERMINAL_MAX_CLUSTERS)
+    return -1;
+  if (terminal->cluster_count == terminal->cluster_capacity) {
+    terminal->cluster_capacity = terminal->cluster_capacity ? terminal->cluster_capacity * 2 : 32;
+    terminal->clusters = realloc(terminal->clusters, sizeof(cluster_t) * terminal->cluster_capacity);
+  }
+  terminal->clusters[terminal->cluster_count] = *cluster;
+  terminal->cluster_table[slot] = ++terminal->cluster_count;
+  return terminal->cluster_count - 1;
+}
+
+// Writes out the text of a cell; nothing for the right half of a wide character, and every codepoint of a cluster.
+static int cell_to_utf8(terminal_t* terminal, uint32_t codepoint, char* target) {
+  if (codepoint == LIBTERMINAL_WIDE_CONTINUATION)
+    return 0;
+  if (codepoint & LIBTERMINAL_CLUSTER_FLAG) {
+    cluster_t* cluster = &terminal->clusters[codepoint & ~LIBTERMINAL_CLUSTER_FLAG];
+    int length = 0;
+    for (int i = 0; i < LIBTERMINAL_MAX_CLUSTER_LENGTH && cluster->codepoints[i]; ++i)
+      length += codepoint_to_utf8(cluster->codepoints[i], &target[length]);
+    return length;
+  }
+  return codepoint_to_utf8(codepoint ? codepoint : ' ', target);
+}
+
+// The cell that a zero-width codepoint written now would join onto: the one before the cursor, or the left half of it, if wide.
+static buffer_char_t* view_previous_cell(view_t* view, int columns) {
+  if (view->cursor_x == 0)
+    return NULL;
+  buffer_char_t* cell = &view->buffer[view->cursor_y * columns + min(view->cursor_x, columns) - 1];
+  if (cell->codepoint == LIBTERMINAL_WIDE_CONTINUATION && view->cursor_x > 1)
+    --cell;
+  return cell->codepoint && cell->codepoint != LIBTERMINAL_WIDE_CONTINUATION ? cell : NULL;
+}
+
+// Whether the character before the cursor ends in a zero width joiner, in which case the next character is part of it.
+static int terminal_joins_previous(terminal_t* terminal, view_t* view) {
+  buffer_char_t* cell = view_previous_cell(view, terminal->columns);
+  if (!cell || !(cell->codepoint & LIBTERMINAL_CLUSTER_FLAG))
+    return 0;
+  cluster_t* cluster = &terminal->clusters[cell->codepoint & ~LIBTERMINAL_CLUSTER_FLAG];
+  int length = 0;
+  while (length < LIBTERMINAL_MAX_CLUSTER_LENGTH && cluster->codepoints[length])
+    ++length;
+  return cluster->codepoints[length - 1] == 0x200D;
+}
+
+static void terminal_join_codepoint(terminal_t* terminal, view_t* view, unsigned int codepoint) {
+  buffer_char_t* cell = view_previous_cell(view, terminal->columns);
+  if (!cell)
+    return;
+  ++view->generation;
+  cluster_t cluster = {{0}};
+  if (cell->codepoint & LIBTERMINAL_CLUSTER_FLAG)
+    cluster = terminal->clusters[cell->codepoint & ~LIBTERMINAL_CLUSTER_FLAG];
+  else
+    cluster.codepoints[0] = cell->codepoint;
+  int length = 0;
+  while (length < LIBTERMINAL_MAX_CLUSTER_LENGTH && cluster.codepoints[length])
+    ++length;
+  if (length == LIBTERMINAL_MAX_CLUSTER_LENGTH)
+    return;
+  cluster.codepoints[length] = codepoint;
+  int index = terminal_intern_cluster(terminal, &cluster);
+  if (index != -1)
+    cell->codepoint = LIBTERMINAL_CLUSTER_FLAG | index;
+}
+
+static double terminal_get_time() {
+  #if _WIN32
+    return GetTickCount64() / 1000.0;
+  #else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+  #endif
+}
+
+// Unlike the above, never jumps when the wall clock is set; what the latency probe times with, as it's after milliseconds.
+static double terminal_get_monotonic_time() {
+  #if _WIN32
+    return GetTickCount64() / 1000.0;
+  #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+  #endif
+}
+
 // Starts searching for the desired scrollback page based on offset, given the starting page of start; should pass NULL if you don't care.
 // Target should contain the desired offset, top_offset should match the top offset of start, if start is not null.
 static backbuffer_page_t* terminal_find_scrollback_page(terminal_t* terminal, backbuffer_page_t* start, int* offset, int* top_offset) {
@@ -281,976 +654,3786 @@ static backbuffer_page_t* terminal_find_scrollback_page(terminal_t* terminal, ba
   return start;
 }
 
-static int terminal_scrollback(terminal_t* terminal, int target) {
-  terminal->scrollback_target = terminal_find_scrollback_page(terminal, terminal->scrollback_target, &target, &terminal->scrollback_target_top_offset);
-  terminal->scrollback_position = target;
-  return terminal->scrollback_position;
+static int* backbuffer_page_overflows(backbuffer_page_t* page) {
+  return (int*)&page->buffer[page->lines*page->columns];
 }
 
-static int terminal_output(terminal_t* terminal, const char* str, int len);
-static void terminal_input(terminal_t* terminal, const char* str, int len) {
-  if (terminal->mode == MODE_PTY) {
-    #ifdef _WIN32
-      WriteFile(terminal->topty, str, len, NULL, NULL);
-    #else
-      write(terminal->master, str, len);
-    #endif
-  } else
-    terminal_output(terminal, str, len);
+#ifndef _WIN32
+  static int terminal_scroll_file(terminal_t* terminal, viewport_t* viewport, int target);
+  static int terminal_update_file(terminal_t* terminal);
+  static void terminal_layout_file(terminal_t* terminal);
+  static void terminal_draw_file(terminal_t* terminal);
+  static void terminal_close_file(terminal_t* terminal);
+#endif
+
+static int terminal_scrollback(terminal_t* terminal, viewport_t* viewport, int target) {
+  #ifndef _WIN32
+    if (terminal->mode == MODE_FILE)
+      return terminal_scroll_file(terminal, viewport, target);
+  #endif
+  viewport->scrollback_target = terminal_find_scrollback_page(terminal, viewport->scrollback_target, &target, &viewport->scrollback_target_top_offset);
+  viewport->scrollback_position = target;
+  return viewport->scrollback_position;
 }
 
-static void terminal_clear_scrollback_buffer(terminal_t* terminal) {
-  backbuffer_page_t* scrollback_buffer = terminal->scrollback_buffer_start;
-  while (scrollback_buffer) {
-      backbuffer_page_t* prev = scrollback_buffer->prev;
-      free(scrollback_buffer);
-      scrollback_buffer = prev;
+// Makes sure no viewport is left pointing at a page that's going away; those that were are re-targeted from the start.
+static void terminal_forget_scrollback_page(terminal_t* terminal, backbuffer_page_t* page) {
+  for (viewport_t* viewport = terminal->viewports; viewport; viewport = viewport->next) {
+    if (viewport->scrollback_target == page) {
+      viewport->scrollback_target = NULL;
+      viewport->scrollback_target_top_offset = 0;
+      terminal_scrollback(terminal, viewport, viewport->scrollback_position);
+    }
   }
-  terminal->scrollback_buffer_start = NULL;
-  terminal->scrollback_buffer_end = NULL;
-  terminal->scrollback_target = NULL;
-  terminal->scrollback_target_top_offset = 0;
-  terminal->scrollback_total_lines = 0;
 }
 
-static void terminal_shift_buffer(terminal_t* terminal) {
+// Where a walk over consecutive lines has got to in the scrollback, so that each line is found from the page of the one before.
+typedef struct line_cursor_t {
+  backbuffer_page_t* page;
+  int top_offset;
+} line_cursor_t;
+
+// Finds the cells for a line by id, if we still have it; only the screen is addressable in the alternate buffer. Lines in the
+// scrollback keep the width they were written at, which goes in columns. Walks should pass a cursor, starting zeroed; it's only
+// good for as long as the scrollback doesn't change.
+static buffer_char_t* terminal_find_line(terminal_t* terminal, int64_t line, int* columns, int* overflows, line_cursor_t* cursor) {
   view_t* view = &terminal->views[terminal->current_view];
+  if (line >= terminal->line_id_base && line < terminal->line_id_base + terminal->lines) {
+    *columns = terminal->columns;
+    *overflows = view->overflows[line - terminal->line_id_base];
+    return &view->buffer[(line - terminal->line_id_base) * terminal->columns];
+  }
+  if (terminal->current_view != VIEW_NORMAL_BUFFER || line >= terminal->line_id_base || terminal->line_id_base - line > terminal->scrollback_total_lines)
+    return NULL;
+  line_cursor_t start = { NULL, 0 };
+  if (!cursor)
+    cursor = &start;
+  int offset = terminal->line_id_base - line;
+  cursor->page = terminal_find_scrollback_page(terminal, cursor->page, &offset, &cursor->top_offset);
+  // Coming from an older page, the start of the next is given as the end of the one before, as suits reading on from there.
+  if (cursor->page && cursor->top_offset - offset == cursor->page->line) {
+    cursor->top_offset -= cursor->page->line;
+    cursor->page = cursor->page->next;
+  }
+  if (!cursor->page)
+    return NULL;
+  *columns = cursor->page->columns;
+  *overflows = backbuffer_page_overflows(cursor->page)[cursor->top_offset - offset];
+  return &cursor->page->buffer[(cursor->top_offset - offset) * cursor->page->columns];
+}
 
-  if (view->scrolling_region_start != -1 && view->scrolling_region_end != -1) {
-    // We perform this song and dance in case of Guldoman levels of resizing.
-    int start = min(view->scrolling_region_start, terminal->lines - 1);
-    int start_plus_1 = min((view->scrolling_region_start + 1), terminal->lines - 1);
-    int end = min(view->scrolling_region_end, terminal->lines);
-    if (start_plus_1 != start)
-      memmove(&view->buffer[terminal->columns * start], &view->buffer[terminal->columns * start_plus_1], sizeof(buffer_char_t) * terminal->columns * (end - start));
-    memset(&view->buffer[terminal->columns * max(end - 1 , 0)], 0, sizeof(buffer_char_t) * terminal->columns);
+static int selection_point_compare(selection_point_t a, selection_point_t b) {
+  if (a.line != b.line)
+    return a.line < b.line ? -1 : 1;
+  return a.column < b.column ? -1 : (a.column > b.column ? 1 : 0);
+}
+
+static int is_selection_space(buffer_char_t cell) {
+  return cell.codepoint == 0 || cell.codepoint == ' ' || cell.codepoint == '\t';
+}
+
+// Expands a point to the word or line around it, or leaves it empty.
+static void terminal_expand_selection_point(terminal_t* terminal, selection_mode_e mode, selection_point_t point, selection_point_t* range) {
+  range[0] = range[1] = point;
+  if (mode == SELECTION_LINE) {
+    range[0].column = range[1].column = 0;
+    range[1].line++;
+  } else if (mode == SELECTION_WORD) {
+    int columns, overflows;
+    buffer_char_t* cells = terminal_find_line(terminal, point.line, &columns, &overflows, NULL);
+    if (!cells || point.column >= columns)
+      return;
+    range[1].column = point.column + 1;
+    if (!is_selection_space(cells[point.column])) {
+      while (range[0].column > 0 && !is_selection_space(cells[range[0].column - 1]))
+        --range[0].column;
+      while (range[1].column < columns && !is_selection_space(cells[range[1].column]))
+        ++range[1].column;
+    }
+  }
+}
+
+// Starts a selection at a line relative to the top of the screen, as passed to `lines`; with a mode of SELECTION_NONE, clears it.
+static void terminal_select(terminal_t* terminal, viewport_t* viewport, int line, int column, selection_mode_e mode) {
+  viewport->selection_mode = mode;
+  if (mode != SELECTION_NONE) {
+    terminal_expand_selection_point(terminal, mode, (selection_point_t){ terminal->line_id_base + line, column }, viewport->selection_anchor);
+    viewport->selection[0] = viewport->selection_anchor[0];
+    viewport->selection[1] = viewport->selection_anchor[1];
+  }
+}
+
+// Extends the selection from its anchor to cover a point, expanded in the same way as the anchor was.
+static void terminal_extend_selection(terminal_t* terminal, viewport_t* viewport, int line, int column) {
+  if (viewport->selection_mode == SELECTION_NONE)
     return;
+  selection_point_t range[2];
+  terminal_expand_selection_point(terminal, viewport->selection_mode, (selection_point_t){ terminal->line_id_base + line, column }, range);
+  if (selection_point_compare(range[0], viewport->selection_anchor[0]) < 0) {
+    viewport->selection[0] = range[0];
+    viewport->selection[1] = viewport->selection_anchor[1];
+  } else {
+    viewport->selection[0] = viewport->selection_anchor[0];
+    viewport->selection[1] = selection_point_compare(range[1], viewport->selection_anchor[1]) > 0 ? range[1] : viewport->selection_anchor[1];
   }
-  if (terminal->current_view == VIEW_NORMAL_BUFFER) {
-    if (terminal->scrollback_total_lines++ > terminal->scrollback_limit) {
-      backbuffer_page_t* page = terminal->scrollback_buffer_end;
-      if (page->next)
-        page->next->prev = NULL;
-      terminal->scrollback_buffer_end = page->next;
-      terminal->scrollback_total_lines -= page->line;
-      free(page);
+}
+
+// Returns true if there's a selection that's still in the buffer; once its start has scrolled off, it's dropped.
+static int terminal_has_selection(terminal_t* terminal, viewport_t* viewport) {
+  if (viewport->selection_mode != SELECTION_NONE && viewport->selection[0].line < terminal->line_id_base - terminal->scrollback_total_lines)
+    viewport->selection_mode = SELECTION_NONE;
+  return viewport->selection_mode != SELECTION_NONE && selection_point_compare(viewport->selection[0], viewport->selection[1]) != 0;
+}
+
+// Writes out the text between two points in the same form as `lines` gives it; trailing blanks are dropped, and lines that didn't
+// overflow end with a newline. Returns the length, and only writes if target isn't NULL.
+static size_t terminal_range_text(terminal_t* terminal, selection_point_t from, selection_point_t to, char* target) {
+  size_t length = 0;
+  char codepoint[LIBTERMINAL_MAX_CLUSTER_LENGTH * 4];
+  line_cursor_t cursor = { NULL, 0 };
+  for (int64_t line = from.line; line <= to.line; ++line) {
+    int columns, overflows;
+    buffer_char_t* cells = terminal_find_line(terminal, line, &columns, &overflows, &cursor);
+    if (!cells)
+      continue;
+    int start = line == from.line ? from.column : 0;
+    int end = line == to.line ? to.column : columns + 1;
+    int text_end = columns;
+    while (text_end > 0 && cells[text_end - 1].codepoint == 0)
+      --text_end;
+    for (int x = start; x < min(end, text_end); ++x) {
+      int codepoint_length = cell_to_utf8(terminal, cells[x].codepoint, codepoint);
+      if (target)
+        memcpy(&target[length], codepoint, codepoint_length);
+      length += codepoint_length;
+    }
+    if (!overflows && end > text_end) {
+      if (target)
+        target[length] = '\n';
+      ++length;
     }
-    if (!terminal->scrollback_buffer_start || terminal->scrollback_buffer_start->columns != terminal->columns || terminal->scrollback_buffer_start->line >= terminal->scrollback_buffer_start->lines) {
-      backbuffer_page_t* page = calloc(sizeof(backbuffer_page_t) + LIBTERMINAL_BACKBUFFER_PAGE_LINES*terminal->columns*sizeof(buffer_char_t) + sizeof(int)*LIBTERMINAL_BACKBUFFER_PAGE_LINES, 1);
-      if (!terminal->scrollback_buffer_start)
-        terminal->scrollback_buffer_end = page;
-      backbuffer_page_t* prev = terminal->scrollback_buffer_start;
-      page->prev = prev;
-      if (prev)
-        prev->next = page;
-      terminal->scrollback_buffer_start = page;
-      page->lines = LIBTERMINAL_BACKBUFFER_PAGE_LINES;
-      page->columns = terminal->columns;
-      page->line = 0;
-    }
-    memcpy(&terminal->scrollback_buffer_start->buffer[terminal->scrollback_buffer_start->line * terminal->columns], &view->buffer[0], sizeof(buffer_char_t) * terminal->columns);
-    int* backbuffer_overflows = (int*)&terminal->scrollback_buffer_start->buffer[LIBTERMINAL_BACKBUFFER_PAGE_LINES*terminal->scrollback_buffer_start->columns];
-    backbuffer_overflows[terminal->scrollback_buffer_start->line] = view->overflows[0];
-    terminal->scrollback_buffer_start->line++;
   }
-  memmove(&view->buffer[0], &view->buffer[terminal->columns], sizeof(buffer_char_t) * terminal->columns * (terminal->lines - 1));
-  memmove(&view->overflows[0], &view->overflows[1], sizeof(int) * (terminal->lines - 1));
-  memset(&view->buffer[terminal->columns * (terminal->lines - 1)], 0, sizeof(buffer_char_t) * terminal->columns);
-  view->overflows[terminal->lines - 1] = 0;
+  return length;
 }
 
-static void terminal_switch_buffer(terminal_t* terminal, view_e view) {
-  terminal->current_view = view;
-  if (view == VIEW_ALTERNATE_BUFFER) {
-    memset(terminal->views[VIEW_ALTERNATE_BUFFER].buffer, 0, sizeof(buffer_char_t) * terminal->columns * terminal->lines);
-    memset(terminal->views[VIEW_ALTERNATE_BUFFER].overflows, 0, terminal->lines * sizeof(int));
-    terminal->views[VIEW_ALTERNATE_BUFFER].cursor_x = 0;
-    terminal->views[VIEW_ALTERNATE_BUFFER].cursor_y = 0;
-    terminal->views[VIEW_ALTERNATE_BUFFER].cursor_styling = LIBTERMINAL_NO_STYLING;
-    terminal->views[VIEW_ALTERNATE_BUFFER].cursor_styling_inversed = 0;
-    terminal->views[VIEW_ALTERNATE_BUFFER].scrolling_region_end = -1;
-    terminal->views[VIEW_ALTERNATE_BUFFER].scrolling_region_start = -1;
-    for (int i = 0; i < 256; ++i)
-      terminal->views[VIEW_ALTERNATE_BUFFER].palette[i] = indexed_color(i);
+// Drops commands whose prompts have left the scrollback; they're in line order, so they all go from the front.
+static void terminal_prune_commands(terminal_t* terminal) {
+  int64_t oldest_line = terminal->line_id_base - terminal->scrollback_total_lines;
+  int pruned = 0;
+  while (pruned < terminal->command_count && terminal->commands[pruned].prompt.line < oldest_line)
+    ++pruned;
+  if (pruned > 0) {
+    memmove(terminal->commands, &terminal->commands[pruned], sizeof(command_t) * (terminal->command_count - pruned));
+    terminal->command_count -= pruned;
   }
 }
 
-static int parse_number(const char* seq, int def) {
-  if (seq[0] >= '0' && seq[0] <= '9')
-    return atoi(seq);
-  return def;
+// Handles OSC 133 shell integration marks, with the cursor as the point they refer to.
+static void terminal_mark_command(terminal_t* terminal, char mark, const char* parameters) {
+  view_t* view = &terminal->views[terminal->current_view];
+  if (terminal->current_view != VIEW_NORMAL_BUFFER)
+    return;
+  selection_point_t cursor = { terminal->line_id_base + view->cursor_y, view->cursor_x };
+  command_t* command = terminal->command_count > 0 ? &terminal->commands[terminal->command_count - 1] : NULL;
+  if (mark == 'A') {
+    // A command that never got a D, because it was interrupted, say, ends where the next prompt starts.
+    if (command && command->output.line != -1 && command->end.line == -1)
+      command->end = cursor;
+    if (command && command->prompt.line == cursor.line && command->input.line == -1) {
+      command->prompt = cursor;
+      return;
+    }
+    terminal_prune_commands(terminal);
+    if (terminal->command_count == terminal->command_capacity) {
+      terminal->command_capacity = terminal->command_capacity ? terminal->command_capacity * 2 : 16;
+      terminal->commands = realloc(terminal->commands, sizeof(command_t) * terminal->command_capacity);
+    }
+    selection_point_t unmarked = { -1, 0 };
+    terminal->commands[terminal->command_count++] = (command_t){ cursor, unmarked, unmarked, unmarked, -1 };
+  } else if (command && command->end.line == -1) {
+    switch (mark) {
+      case 'B': command->input = cursor; break;
+      case 'C': command->output = cursor; break;
+      case 'D':
+        command->end = cursor;
+        if (parameters[0] == ';')
+          command->exit_code = atoi(&parameters[1]);
+      break;
+    }
+  }
 }
 
-typedef enum terminal_escape_type_e {
-  ESCAPE_TYPE_NONE,
-  ESCAPE_TYPE_OPEN,
-  ESCAPE_TYPE_CSI,
-  ESCAPE_TYPE_OS,
-  ESCAPE_TYPE_FIXED_WIDTH,
-  ESCAPE_TYPE_UNKNOWN
-} terminal_escape_type_e;
+// Finds the last command whose prompt is before a line, or, if direction is positive, the first that's after it. Returns -1 if
+// there's none.
+static int terminal_find_command(terminal_t* terminal, int64_t line, int direction) {
+  terminal_prune_commands(terminal);
+  int low = 0, high = terminal->command_count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (terminal->commands[middle].prompt.line < line)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  // low is now the first command at or after line.
+  if (direction > 0) {
+    while (low < terminal->command_count && terminal->commands[low].prompt.line <= line)
+      ++low;
+    return low < terminal->command_count ? low : -1;
+  }
+  return low - 1;
+}
 
+static void terminal_prune_links(terminal_t* terminal) {
+  int64_t oldest_line = terminal->line_id_base - terminal->scrollback_total_lines;
+  int pruned = 0;
+  while (pruned < terminal->link_count && terminal->links[pruned].start.line < oldest_line)
+    ++pruned;
+  if (pruned > 0) {
+    memmove(terminal->links, &terminal->links[pruned], sizeof(link_t) * (terminal->link_count - pruned));
+    terminal->link_count -= pruned;
+  }
+}
 
-static int terminal_escape_sequence(terminal_t* terminal, terminal_escape_type_e type, const char* seq) {
-  #ifdef LIBTERMINAL_DEBUG_ESCAPE
-  fprintf(stderr, "ESC");
-  for (int i = 1; i < strlen(seq); ++i) {
-    fprintf(stderr, "%c", seq[i]);
+// Finds the first link that starts on or after a line.
+static int terminal_find_link(terminal_t* terminal, int64_t line) {
+  int low = 0, high = terminal->link_count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (terminal->links[middle].start.line < line)
+      low = middle + 1;
+    else
+      high = middle;
   }
-  fprintf(stderr, "\n");
-  #endif
-  view_t* view = &terminal->views[terminal->current_view];
-  int unhandled = 0;
-  int end = (view->scrolling_region_end == -1 ? terminal->lines : view->scrolling_region_end);
-  if (type == ESCAPE_TYPE_CSI) {
-    int seq_end = strlen(seq) - 1;
-    switch (seq[seq_end]) {
-      case '@': {
-        int length = parse_number(&seq[2], 1);
-        memmove(&view->buffer[terminal->columns * view->cursor_y + view->cursor_x + length], &view->buffer[terminal->columns * view->cursor_y + view->cursor_x], sizeof(buffer_char_t) * max(terminal->columns - (view->cursor_x + length), 0));
-        for (int i = view->cursor_x; i < min(view->cursor_x + length, terminal->columns); ++i)
-          view->buffer[terminal->columns * view->cursor_y + i].codepoint = ' ';
-      } break;
-      case 'A': view->cursor_y = max(view->cursor_y - max(parse_number(&seq[2], 1), 1), 0);     break;
-      case 'B': view->cursor_y = min(view->cursor_y + max(parse_number(&seq[2], 1), 1), terminal->lines - 1); break;
-      case 'C': view->cursor_x = min(view->cursor_x + max(parse_number(&seq[2], 1), 1), terminal->columns - 1); break;
-      case 'D': view->cursor_x = max(view->cursor_x - max(parse_number(&seq[2], 1), 1), 0); break;
-      case 'E': view->cursor_y = min(view->cursor_y + max(parse_number(&seq[2], 1), 1), terminal->lines - 1); view->cursor_x = 0; break;
-      case 'F': view->cursor_y = min(view->cursor_y - max(parse_number(&seq[2], 1), 1), 0); view->cursor_x = 0; break;
-      case 'G': view->cursor_x = min(max(max(parse_number(&seq[2], 1), 1) - 1, 0), terminal->columns - 1); break;
-      case 'f':
-      case 'H': {
-        int semicolon = -1;
-        for (semicolon = 2; semicolon < seq_end && seq[semicolon] != ';'; ++semicolon);
-        if (seq[semicolon] != ';') {
-          view->cursor_x = 0;
-          view->cursor_y = 0;
-        } else {
-          view->cursor_y = max(min(parse_number(&seq[2], 1) - 1, terminal->lines - 1), 0);
-          view->cursor_x = max(min(parse_number(&seq[semicolon+1], 1) - 1, terminal->columns - 1), 0);
-        }
-      } break;
-      case 'J': {
-        switch (seq[2]) {
-          case '1':
-            for (int y = 0; y <= view->cursor_y; ++y) {
-              int w = y == view->cursor_y ? (view->cursor_x+1) : terminal->columns;
-              memset(&view->buffer[terminal->columns * y], 0, sizeof(buffer_char_t) * w);
-            }
-          break;
-          case '3':
-            terminal_clear_scrollback_buffer(terminal);
-            // intentional fallthrough
-          case '2':
-            memset(view->buffer, 0, sizeof(buffer_char_t) * (terminal->columns * terminal->lines));
-            view->cursor_x = 0;
-            view->cursor_y = 0;
-          break;
-          default:
-            for (int y = view->cursor_y; y < terminal->lines; ++y) {
-              int x = y == view->cursor_y ? view->cursor_x : 0;
-              memset(&view->buffer[terminal->columns * y + x], 0, sizeof(buffer_char_t) * (terminal->columns - x));
-            }
-          break;
-        }
-      } break;
-      case 'K': {
-        int s, e;
-        switch (seq[2]) {
-          case '1': s = 0; e = view->cursor_x + 1; break;
-          case '2': s = 0; e = terminal->columns; break;
-          default: s = view->cursor_x; e = terminal->columns; break;
-        }
-        for (int i = s; i < e; ++i)
-          view->buffer[view->cursor_y * terminal->columns + i] = (buffer_char_t){ view->cursor_styling, ' ' };
-      } break;
-      case 'L': {
-        int length = parse_number(&seq[2], 1);
-        memmove(&view->buffer[terminal->columns * (view->cursor_y + length)], &view->buffer[terminal->columns * view->cursor_y], sizeof(buffer_char_t) * terminal->columns * max(end - (view->cursor_y + length), 0));
-        for (int y = view->cursor_y; y < min(view->cursor_y + length, end); ++y) {
-          for (int i = 0; i < terminal->columns; ++i)
-            view->buffer[terminal->columns * y + i].codepoint = ' ';
-        }
-      } break;
-      case 'M': {
-        int length = parse_number(&seq[2], 1);
-        memmove(&view->buffer[terminal->columns * view->cursor_y], &view->buffer[terminal->columns * (view->cursor_y + length)], sizeof(buffer_char_t) * terminal->columns * max(end - (view->cursor_y + length), 0));
-        for (int y = end - length; y < end; ++y) {
-          for (int i = 0; i < terminal->columns; ++i)
-            view->buffer[terminal->columns * y + i].codepoint = ' ';
-        }
-      } break;
-      case 'P': {
-        int length = parse_number(&seq[2], 1);
-        for (int i = view->cursor_x; i < terminal->columns; ++i) {
-          if (i + length < terminal->columns)
-            view->buffer[view->cursor_y * terminal->columns + i] = view->buffer[view->cursor_y * terminal->columns + i + length];
-          else
-            view->buffer[view->cursor_y * terminal->columns + i].codepoint = ' ';
-        }
-      } break;
-      case 'X': {
-        int length = parse_number(&seq[2], 1);
-        for (int i = view->cursor_x; i < view->cursor_x + length && i < terminal->columns; ++i)
-          view->buffer[view->cursor_y * terminal->columns + i] = (buffer_char_t){ view->cursor_styling, ' ' };
-      } break;
-      case 'b': {
-        if (view->last_graphical_character) {
-          int length = parse_number(&seq[2], 1);
-          for (int i = view->cursor_x; i < min(view->cursor_x + length, terminal->columns); ++i)
-            view->buffer[view->cursor_y * terminal->columns + i].codepoint = view->last_graphical_character;
-        }
-      } break;
-      case 'c': {
-        terminal_input(terminal, "\e[?1;2c", 7);
-      } break;
-      case 'd': view->cursor_y = min(max(max(parse_number(&seq[2], 1), 1) - 1, 0), terminal->lines - 1); break;
-      case 'h': {
-        if (seq[2] == '?') {
-          const char* next = &seq[3];
-          while (next) {
-            switch (parse_number(next, 0)) {
-              case 1: view->cursor_keys_mode = KEYS_MODE_APPLICATION; break;
-              case 9: view->mouse_tracking_mode = MOUSE_TRACKING_X10; break;
-              case 12: view->cursor_mode = CURSOR_BLINKING; break;
-              case 25: view->cursor_mode = CURSOR_SOLID; break;
-              case 1000: if (view->mouse_tracking_mode != MOUSE_TRACKING_SGR) view->mouse_tracking_mode = MOUSE_TRACKING_NORMAL; break;
-              case 1006: view->mouse_tracking_mode = MOUSE_TRACKING_SGR; break;
-              case 1004: terminal->reporting_focus = 1; break;
-              case 1047: terminal_switch_buffer(terminal, VIEW_ALTERNATE_BUFFER); break;
-              case 1049: terminal_switch_buffer(terminal, VIEW_ALTERNATE_BUFFER); break;
-              case 2004: terminal->paste_mode = PASTE_BRACKETED; break;
-              default: unhandled = 1; break;
-            }
-            if ((next = strstr(next, ";")))
-              next++;
-          }
-        }
-      } break;
-      case 'l': {
-        if (seq[2] == '?') {
-          const char* next = &seq[3];
-          while (next) {
-            switch (parse_number(next, 0)) {
-              case 1: view->cursor_keys_mode = KEYS_MODE_NORMAL; break;
-              case 9: view->mouse_tracking_mode = MOUSE_TRACKING_NONE; break;
-              case 12: view->cursor_mode = CURSOR_SOLID; break;
-              case 25: view->cursor_mode = CURSOR_HIDDEN; break;
-              case 1000: view->mouse_tracking_mode = MOUSE_TRACKING_NONE; break;
-              case 1006: view->mouse_tracking_mode = MOUSE_TRACKING_NONE; break;
-              case 1004: terminal->reporting_focus = 0; break;
-              case 1047: terminal_switch_buffer(terminal, VIEW_NORMAL_BUFFER); break;
-              case 1049: terminal_switch_buffer(terminal, VIEW_NORMAL_BUFFER); break;
-              case 2004: terminal->paste_mode = PASTE_NORMAL; break;
-              default: unhandled = 1; break;
-            }
-            if (next = strstr(next, ";"))
-              next++;
+  return low;
+}
+
+static int is_url_character(char c) {
+  return isalnum((unsigned char)c) || (c && strchr("-._~:/?#[]@!$&'()*+,;=%", c));
+}
+
+static int is_path_character(char c) {
+  return isalnum((unsigned char)c) || (c && strchr("-._~/\\+", c));
+}
+
+// Scans a completed line, as text with one byte per cell, for URLs and path:line:column references. Anything that isn't ASCII is
+// a \x01, which nothing matches. Calls back with the span of every match.
+static void scan_links(const char* text, int length, void (*callback)(int, int, link_type_e, void*), void* data) {
+  for (int i = 0; i < length; ++i) {
+    if (i > 0 && is_path_character(text[i-1]))
+      continue;
+    int scheme = 0;
+    for (const char** prefix = (const char*[]){ "https://", "http://", "file://", "ftp://", NULL }; *prefix; ++prefix) {
+      // The text is only as long as length says; it isn't terminated.
+      int prefix_length = strlen(*prefix);
+      if (length - i >= prefix_length && memcmp(&text[i], *prefix, prefix_length) == 0)
+        scheme = prefix_length;
+    }
+    if (scheme) {
+      int end = i + scheme, parentheses = 0, brackets = 0;
+      while (end < length && is_url_character(text[end])) {
+        parentheses += text[end] == '(' ? 1 : (text[end] == ')' ? -1 : 0);
+        brackets += text[end] == '[' ? 1 : (text[end] == ']' ? -1 : 0);
+        ++end;
+      }
+      // Trailing punctuation, and unbalanced closing brackets, are more likely to be part of the sentence than the URL.
+      while (end > i + scheme && (strchr(".,;:!?'\"", text[end-1]) || (text[end-1] == ')' && parentheses < 0) || (text[end-1] == ']' && brackets < 0))) {
+        parentheses += text[end-1] == ')';
+        brackets += text[end-1] == ']';
+        --end;
+      }
+      if (end > i + scheme)
+        callback(i, end, LINK_URL, data);
+      i = end;
+      continue;
+    }
+    int end = i, path_like = 0;
+    while (end < length && is_path_character(text[end])) {
+      path_like = path_like || text[end] == '/' || text[end] == '\\' || (text[end] == '.' && end + 1 < length && isalpha((unsigned char)text[end+1]));
+      ++end;
+    }
+    // Has to have a directory or an extension, so as not to pick up version numbers, and be followed by :line, and optionally
+    // :column.
+    if (end > i && path_like && end < length - 1 && text[end] == ':' && isdigit((unsigned char)text[end+1])) {
+      for (++end; end < length && isdigit((unsigned char)text[end]); ++end);
+      if (end < length - 1 && text[end] == ':' && isdigit((unsigned char)text[end+1]))
+        for (++end; end < length && isdigit((unsigned char)text[end]); ++end);
+      callback(i, end, LINK_FILE, data);
+    }
+    i = end;
+  }
+}
+
+typedef struct {
+  terminal_t* terminal;
+  int64_t start_line;
+} link_scan_t;
+
+static void terminal_add_link(int start, int end, link_type_e type, void* data) {
+  link_scan_t* scan = data;
+  terminal_t* terminal = scan->terminal;
+  if (terminal->link_count == terminal->link_capacity) {
+    terminal->link_capacity = terminal->link_capacity ? terminal->link_capacity * 2 : 64;
+    terminal->links = realloc(terminal->links, sizeof(link_t) * terminal->link_capacity);
+  }
+  terminal->links[terminal->link_count++] = (link_t){
+    { scan->start_line + start / terminal->columns, start % terminal->columns },
+    { scan->start_line + end / terminal->columns, end % terminal->columns },
+    type
+  };
+}
+
+static void terminal_index_links(terminal_t* terminal, int64_t start_line, int64_t end_line) {
+  char* text = scratch_reserve((size_t)(end_line - start_line + 1) * terminal->columns);
+  int length = 0, columns, overflows;
+  line_cursor_t cursor = { NULL, 0 };
+  for (int64_t line = start_line; line <= end_line; ++line) {
+    buffer_char_t* cells = terminal_find_line(terminal, line, &columns, &overflows, &cursor);
+    if (!cells)
+      return;
+    // Rows from before a resize are padded, or cut, to the current width, which is what link positions are worked out in.
+    for (int x = 0; x < terminal->columns; ++x)
+      text[length++] = x >= columns ? ' ' : (cells[x].codepoint < 0x80 ? (cells[x].codepoint ? cells[x].codepoint : ' ') : 0x01);
+  }
+  while (length > 0 && text[length-1] == ' ')
+    --length;
+  // If the line has been completed before, as happens when programs redraw, its old links go.
+  int first = terminal_find_link(terminal, start_line);
+  if (first < terminal->link_count) {
+    int last = terminal_find_link(terminal, end_line + 1);
+    memmove(&terminal->links[first], &terminal->links[last], sizeof(link_t) * (terminal->link_count - last));
+    terminal->link_count -= last - first;
+    if (first < terminal->link_count) {
+      // Rare enough that we just scan into the end, and rotate the new links into place.
+      int previous_count = terminal->link_count;
+      link_scan_t scan = { terminal, start_line };
+      scan_links(text, length, terminal_add_link, &scan);
+      int added = terminal->link_count - previous_count;
+      if (added > 0) {
+        link_t* added_links = malloc(sizeof(link_t) * added);
+        memcpy(added_links, &terminal->links[previous_count], sizeof(link_t) * added);
+        memmove(&terminal->links[first + added], &terminal->links[first], sizeof(link_t) * (previous_count - first));
+        memcpy(&terminal->links[first], added_links, sizeof(link_t) * added);
+        free(added_links);
+      }
+      return;
+    }
+  }
+  terminal_prune_links(terminal);
+  link_scan_t scan = { terminal, start_line };
+  scan_links(text, length, terminal_add_link, &scan);
+}
+
+// A deliberately small regex dialect that can't run away: literals, `.`, classes like `[a-z]` and `[^0-9]`, `\d`, `\w` and `\s`,
+// the quantifiers `*`, `+` and `?`, and the anchors `^` and `$`. No groups or alternation. Matching is a backtracking search, with
+// a budget of steps, after which we give up.
+static int pattern_atom_length(const char* pattern) {
+  if (pattern[0] == '\\' && pattern[1])
+    return 2;
+  if (pattern[0] == '[') {
+    int i = 1;
+    if (pattern[i] == '^')
+      ++i;
+    if (pattern[i] == ']')
+      ++i;
+    while (pattern[i] && pattern[i] != ']')
+      ++i;
+    return pattern[i] ? i + 1 : i;
+  }
+  return 1;
+}
+
+static int pattern_atom_matches(const char* atom, int length, char c) {
+  if (atom[0] == '.')
+    return 1;
+  if (atom[0] == '\\') {
+    switch (atom[1]) {
+      case 'd': return isdigit((unsigned char)c) != 0;
+      case 'w': return isalnum((unsigned char)c) || c == '_';
+      case 's': return isspace((unsigned char)c) != 0;
+      default: return atom[1] == c;
+    }
+  }
+  if (atom[0] == '[') {
+    int negated = atom[1] == '^', matched = 0;
+    for (int i = 1 + negated; i < length - 1 && !matched; ++i) {
+      if (atom[i+1] == '-' && i + 2 < length - 1) {
+        matched = c >= atom[i] && c <= atom[i+2];
+        i += 2;
+      } else
+        matched = atom[i] == c;
+    }
+    return matched != negated;
+  }
+  return atom[0] == c;
+}
+
+static int match_pattern_here(const char* pattern, const char* text, const char* end, int* steps) {
+  if (++*steps > LIBTERMINAL_MAX_MATCH_STEPS)
+    return 0;
+  if (!pattern[0])
+    return 1;
+  if (pattern[0] == '$' && !pattern[1])
+    return text == end;
+  int atom_length = pattern_atom_length(pattern);
+  char quantifier = pattern[atom_length];
+  if (quantifier == '*' || quantifier == '+' || quantifier == '?') {
+    int count = 0, minimum = quantifier == '+' ? 1 : 0;
+    while (text + count < end && (quantifier != '?' || count < 1) && pattern_atom_matches(pattern, atom_length, text[count]))
+      ++count;
+    for (; count >= minimum; --count) {
+      if (match_pattern_here(&pattern[atom_length + 1], text + count, end, steps))
+        return 1;
+    }
+    return 0;
+  }
+  return text < end && pattern_atom_matches(pattern, atom_length, *text) && match_pattern_here(&pattern[atom_length], text + 1, end, steps);
+}
+
+static int match_pattern(const char* pattern, const char* text, int length) {
+  int steps = 0;
+  if (pattern[0] == '^')
+    return match_pattern_here(&pattern[1], text, text + length, &steps);
+  for (int i = 0; i <= length; ++i) {
+    if (match_pattern_here(pattern, &text[i], text + length, &steps))
+      return 1;
+  }
+  return 0;
+}
+
+static void terminal_queue_trigger_event(terminal_t* terminal, int id, int64_t line, char* text) {
+  if (terminal->trigger_event_count == LIBTERMINAL_MAX_TRIGGER_EVENTS) {
+    free(text);
+    return;
+  }
+  if (!terminal->trigger_events)
+    terminal->trigger_events = malloc(sizeof(trigger_event_t) * LIBTERMINAL_MAX_TRIGGER_EVENTS);
+  terminal->trigger_events[terminal->trigger_event_count++] = (trigger_event_t){ id, line, text };
+}
+
+static void terminal_match_triggers(terminal_t* terminal, int64_t start_line, int64_t end_line) {
+  selection_point_t from = { start_line, 0 }, to = { end_line, terminal->columns };
+  size_t length = terminal_range_text(terminal, from, to, NULL);
+  char* text = malloc(length + 1);
+  terminal_range_text(terminal, from, to, text);
+  if (length > 0 && text[length-1] == '\n')
+    --length;
+  text[length] = 0;
+  for (int i = 0; i < terminal->trigger_count; ++i) {
+    trigger_t* trigger = &terminal->triggers[i];
+    if (trigger->literal ? strstr(text, trigger->pattern) != NULL : match_pattern(trigger->pattern, text, length))
+      terminal_queue_trigger_event(terminal, trigger->id, start_line, strdup(text));
+  }
+  free(text);
+}
+
+// Called whenever a line feed completes a line on the normal buffer, before the cursor moves. This is the one place that looks at
+// the text of new output; the line, including any rows it wrapped from, is read off the grid once for each kind of matcher.
+static void terminal_line_completed(terminal_t* terminal) {
+  view_t* view = &terminal->views[VIEW_NORMAL_BUFFER];
+  int64_t end_line = terminal->line_id_base + view->cursor_y, start_line = end_line;
+  int columns, overflows;
+  line_cursor_t cursor = { NULL, 0 };
+  while (end_line - start_line < LIBTERMINAL_MAX_LOGICAL_LINE_ROWS - 1 && terminal_find_line(terminal, start_line - 1, &columns, &overflows, &cursor) && overflows)
+    --start_line;
+  terminal_index_links(terminal, start_line, end_line);
+  if (terminal->trigger_count > 0)
+    terminal_match_triggers(terminal, start_line, end_line);
+}
+
+static int terminal_output(terminal_t* terminal, const char* str, int len);
+// Writes as much of the queue as the pty will take without blocking; on windows, where writes always block, as much as we'd read
+// in a single update. Returns the amount of bytes still pending.
+static int terminal_flush_input(terminal_t* terminal) {
+  while (terminal->input_queue_offset < terminal->input_queue_length) {
+    int remaining = terminal->input_queue_length - terminal->input_queue_offset;
+    #ifdef _WIN32
+      DWORD written = 0;
+      if (!WriteFile(terminal->topty, &terminal->input_queue[terminal->input_queue_offset], min(remaining, LIBTERMINAL_CHUNK_SIZE * LIBTERMINAL_MAX_CHUNKS_PROCESSED), &written, NULL)) {
+        terminal->input_queue_offset = terminal->input_queue_length;
+        break;
+      }
+      terminal->input_queue_offset += written;
+      break;
+    #else
+      int written = write(terminal->master, &terminal->input_queue[terminal->input_queue_offset], remaining);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        // If the pty is gone, there's nobody to deliver the rest to.
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          terminal->input_queue_offset = terminal->input_queue_length;
+        break;
+      }
+      terminal->input_queue_offset += written;
+    #endif
+  }
+  if (terminal->input_queue_offset == terminal->input_queue_length) {
+    terminal->input_queue_offset = 0;
+    terminal->input_queue_length = 0;
+    // Don't hang onto the buffer from a large paste.
+    if (terminal->input_queue_capacity > LIBTERMINAL_CHUNK_SIZE) {
+      free(terminal->input_queue);
+      terminal->input_queue = NULL;
+      terminal->input_queue_capacity = 0;
+    }
+  }
+  return terminal->input_queue_length - terminal->input_queue_offset;
+}
+
+static void terminal_queue_bytes(terminal_t* terminal, const char* str, int len) {
+  if (terminal->input_queue_offset > 0 && terminal->input_queue_length + len > terminal->input_queue_capacity) {
+    memmove(terminal->input_queue, &terminal->input_queue[terminal->input_queue_offset], terminal->input_queue_length - terminal->input_queue_offset);
+    terminal->input_queue_length -= terminal->input_queue_offset;
+    terminal->input_queue_offset = 0;
+  }
+  if (terminal->input_queue_length + len > terminal->input_queue_capacity) {
+    terminal->input_queue_capacity = max(terminal->input_queue_length + len, terminal->input_queue_capacity * 2);
+    terminal->input_queue = realloc(terminal->input_queue, terminal->input_queue_capacity);
+  }
+  memcpy(&terminal->input_queue[terminal->input_queue_length], str, len);
+  terminal->input_queue_length += len;
+}
+
+static void terminal_queue_remote_frame(terminal_t* terminal, char type, const void* payload, int len) {
+  char header[LIBTERMINAL_REMOTE_FRAME_HEADER] = { type };
+  uint32_t length = len;
+  memcpy(&header[1], &length, sizeof(length));
+  terminal_queue_bytes(terminal, header, sizeof(header));
+  if (len > 0)
+    terminal_queue_bytes(terminal, payload, len);
+}
+
+static void terminal_queue_input(terminal_t* terminal, const char* str, int len) {
+  if (terminal->mode == MODE_REMOTE)
+    terminal_queue_remote_frame(terminal, REMOTE_FRAME_INPUT, str, len);
+  else
+    terminal_queue_bytes(terminal, str, len);
+}
+
+// Buckets are a microsecond wide up to 4, then four to each doubling, so a bucket is never more than a quarter off of its samples.
+static int latency_bucket(double seconds) {
+  unsigned long long microseconds = seconds > 0 ? (unsigned long long)(seconds * 1000000.0) : 0;
+  if (microseconds < 4)
+    return (int)microseconds;
+  int octave = 2;
+  while ((microseconds >> (octave + 1)) > 0)
+    ++octave;
+  return min(octave * 4 + (int)((microseconds >> (octave - 2)) & 3) - 4, LIBTERMINAL_LATENCY_BUCKETS - 1);
+}
+
+static double latency_bucket_start(int bucket) {
+  if (bucket < 4)
+    return bucket / 1000000.0;
+  return (double)((4ULL + bucket % 4) << (bucket / 4 - 1)) / 1000000.0;
+}
+
+static void latency_record(latency_histogram_t* histogram, double seconds) {
+  ++histogram->counts[latency_bucket(seconds)];
+  ++histogram->total;
+  if (seconds > histogram->max)
+    histogram->max = seconds;
+}
+
+// The middle of the bucket the sample at this fraction of the way through falls in, in seconds; never past the longest sample.
+static double latency_percentile(latency_histogram_t* histogram, double fraction) {
+  unsigned int target = (unsigned int)(fraction * histogram->total + 0.999999), seen = 0;
+  for (int i = 0; i < LIBTERMINAL_LATENCY_BUCKETS; ++i) {
+    seen += histogram->counts[i];
+    if (seen > 0 && seen >= target) {
+      double middle = i == LIBTERMINAL_LATENCY_BUCKETS - 1 ? histogram->max : (latency_bucket_start(i) + latency_bucket_start(i + 1)) / 2;
+      return middle < histogram->max ? middle : histogram->max;
+    }
+  }
+  return 0;
+}
+
+// An echo is whatever output first changes what's on screen after a keystroke. During a burst of typing, it's timed from the
+// earliest keystroke it could be answering, so that we err on the side of reporting too much latency, rather than too little.
+static void terminal_probe_echo(terminal_t* terminal) {
+  latency_record(&terminal->latency[LATENCY_ECHO], terminal_get_monotonic_time() - terminal->latency_input);
+  if (!terminal->latency_echoed)
+    terminal->latency_echoed = terminal->latency_input;
+  terminal->latency_input = 0;
+}
+
+// Input is always queued behind anything that's still pending, so it arrives in order; returns the amount of bytes pending.
+static int terminal_input(terminal_t* terminal, const char* str, int len) {
+  if (terminal->mode == MODE_PTY || terminal->mode == MODE_REMOTE) {
+    terminal_queue_input(terminal, str, len);
+    return terminal_flush_input(terminal);
+  }
+  if (terminal->mode == MODE_FILE)
+    return 0;
+  terminal_output(terminal, str, len);
+  return 0;
+}
+
+// Only a shell has a queue to put pieces of a paste in; a dummy terminal takes them straight in as output.
+static void terminal_paste_piece(terminal_t* terminal, const char* str, int len) {
+  if (terminal->mode == MODE_PTY || terminal->mode == MODE_REMOTE)
+    terminal_queue_input(terminal, str, len);
+  else
+    terminal_input(terminal, str, len);
+}
+
+// Pastes text, bracketing it if the application has asked for that. The closing bracket is stripped out of the text itself, so
+// that a paste can't break out of the bracket and have its contents interpreted as typed.
+static int terminal_paste(terminal_t* terminal, const char* str, int len) {
+  if (terminal->paste_mode != PASTE_BRACKETED)
+    return terminal_input(terminal, str, len);
+  static const char end_bracket[] = "\x1B[201~";
+  int end_bracket_length = sizeof(end_bracket) - 1, start = 0;
+  terminal_paste_piece(terminal, "\x1B[200~", 6);
+  for (int i = 0; i <= len - end_bracket_length; ++i) {
+    if (memcmp(&str[i], end_bracket, end_bracket_length) == 0) {
+      terminal_paste_piece(terminal, &str[start], i - start);
+      start = i + end_bracket_length;
+      i = start - 1;
+    }
+  }
+  terminal_paste_piece(terminal, &str[start], len - start);
+  return terminal_input(terminal, end_bracket, end_bracket_length);
+}
+
+// Encodes a mouse report the way the application asked for it; button is 0 to 2, 3 for motion with nothing held, or 64 and 65 for
+// the wheel. Without SGR, releases can't say which button, and coordinates past 223 can't be expressed, so are clamped.
+static int terminal_encode_mouse(view_t* view, mouse_event_e event, int button, int x, int y, int modifiers, char* buffer) {
+  int code = button | modifiers | (event == MOUSE_MOTION ? 32 : 0);
+  if (view->mouse_sgr)
+    return sprintf(buffer, "\x1B[<%d;%d;%d%c", code, x + 1, y + 1, event == MOUSE_RELEASE ? 'm' : 'M');
+  if (event == MOUSE_RELEASE)
+    code = 3 | modifiers;
+  return sprintf(buffer, "\x1B[M%c%c%c", 32 + code, 32 + min(x + 1, 223), 32 + min(y + 1, 223));
+}
+
+// Motion is only encoded once a frame, so that however many times the pointer moved, only where it ended up is reported.
+static void terminal_queue_mouse_motion(terminal_t* terminal) {
+  if (!terminal->mouse_motion_pending)
+    return;
+  terminal->mouse_motion_pending = 0;
+  view_t* view = &terminal->views[terminal->current_view];
+  int button = 3;
+  if (view->mouse_tracking_mode == MOUSE_TRACKING_BUTTON && !terminal->mouse_buttons)
+    return;
+  if (view->mouse_tracking_mode != MOUSE_TRACKING_BUTTON && view->mouse_tracking_mode != MOUSE_TRACKING_ANY)
+    return;
+  for (int i = 0; i < 3; ++i) {
+    if (terminal->mouse_buttons & (1 << i)) {
+      button = i;
+      break;
+    }
+  }
+  char buffer[64];
+  terminal_queue_input(terminal, buffer, terminal_encode_mouse(view, MOUSE_MOTION, button, terminal->mouse_motion_x, terminal->mouse_motion_y, terminal->mouse_motion_modifiers, buffer));
+  terminal->mouse_x = terminal->mouse_motion_x;
+  terminal->mouse_y = terminal->mouse_motion_y;
+}
+
+// Reports a mouse event to the application, if it's asked for them; returns true if it has, in which case the event is its to
+// handle, rather than ours. Presses, releases and the wheel are queued, along with any motion before them, and written in one go
+// on the next update.
+static int terminal_mouse(terminal_t* terminal, mouse_event_e event, int button, int x, int y, int modifiers) {
+  view_t* view = &terminal->views[terminal->current_view];
+  if (view->mouse_tracking_mode == MOUSE_TRACKING_NONE || (terminal->mode != MODE_PTY && terminal->mode != MODE_REMOTE))
+    return 0;
+  x = max(min(x, terminal->columns - 1), 0);
+  y = max(min(y, terminal->lines - 1), 0);
+  if (view->mouse_tracking_mode == MOUSE_TRACKING_X10)
+    modifiers = 0;
+  if (event == MOUSE_MOTION) {
+    if (view->mouse_tracking_mode == MOUSE_TRACKING_ANY || (view->mouse_tracking_mode == MOUSE_TRACKING_BUTTON && terminal->mouse_buttons)) {
+      terminal->mouse_motion_pending = x != terminal->mouse_x || y != terminal->mouse_y;
+      terminal->mouse_motion_x = x;
+      terminal->mouse_motion_y = y;
+      terminal->mouse_motion_modifiers = modifiers;
+      return 1;
+    }
+    return 0;
+  }
+  terminal_queue_mouse_motion(terminal);
+  if (button < 3) {
+    if (event == MOUSE_PRESS)
+      terminal->mouse_buttons |= 1 << button;
+    else
+      terminal->mouse_buttons &= ~(1 << button);
+  }
+  // The wheel has no releases, and X10 reports nothing but presses.
+  if (event == MOUSE_RELEASE && (button >= 64 || view->mouse_tracking_mode == MOUSE_TRACKING_X10))
+    return 1;
+  char buffer[64];
+  terminal_queue_input(terminal, buffer, terminal_encode_mouse(view, event, button, x, y, modifiers, buffer));
+  terminal->mouse_x = x;
+  terminal->mouse_y = y;
+  return 1;
+}
+
+// Answers a query from the shell. A remote terminal parses the same output as the daemon does, so leaves answering to it.
+static void terminal_reply(terminal_t* terminal, const char* str, int len) {
+  if (terminal->mode != MODE_REMOTE)
+    terminal_input(terminal, str, len);
+}
+
+static size_t backbuffer_page_size(int columns, int lines) {
+  return sizeof(backbuffer_page_t) + lines * (columns * sizeof(buffer_char_t) + sizeof(int));
+}
+
+static backbuffer_page_t* backbuffer_page_new(int columns, int lines) {
+  backbuffer_page_t* page = calloc(backbuffer_page_size(columns, lines), 1);
+  page->buffer = (buffer_char_t*)(page + 1);
+  page->columns = columns;
+  page->lines = lines;
+  page->spill_segment = -1;
+  page->serial = ++scrollback_page_serial;
+  return page;
+}
+
+static void terminal_account_scrollback(terminal_t* terminal, long long bytes) {
+  terminal->scrollback_bytes += bytes;
+  scrollback_global_bytes += bytes;
+}
+
+// Swaps out a page for a new copy of itself in the scrollback list, fixing up anything that pointed at it.
+static void terminal_relink_scrollback_page(terminal_t* terminal, backbuffer_page_t* page, backbuffer_page_t* replacement) {
+  if (replacement->prev)
+    replacement->prev->next = replacement;
+  if (replacement->next)
+    replacement->next->prev = replacement;
+  if (terminal->scrollback_buffer_start == page)
+    terminal->scrollback_buffer_start = replacement;
+  if (terminal->scrollback_buffer_end == page)
+    terminal->scrollback_buffer_end = replacement;
+  if (terminal->scrollback_resident_end == page)
+    terminal->scrollback_resident_end = replacement;
+  for (viewport_t* viewport = terminal->viewports; viewport; viewport = viewport->next) {
+    if (viewport->scrollback_target == page)
+      viewport->scrollback_target = replacement;
+  }
+}
+
+#ifndef _WIN32
+  static void terminal_clear_spill(terminal_t* terminal) {
+    for (int i = 0; i < terminal->spill_segment_count; ++i) {
+      if (terminal->spill_segments[i])
+        munmap(terminal->spill_segments[i], LIBTERMINAL_SPILL_SEGMENT_SIZE);
+    }
+    free(terminal->spill_segments);
+    terminal->spill_segments = NULL;
+    terminal->spill_segment_count = 0;
+    terminal->spill_segment_offset = 0;
+    if (terminal->spilling)
+      ftruncate(terminal->spill_fd, 0);
+  }
+
+  // Called when a spilled page is dropped; if it was the last page in its segment, and we're not still writing to that segment, unmap it.
+  static void terminal_release_spilled_page(terminal_t* terminal, backbuffer_page_t* page) {
+    int segment = page->spill_segment;
+    if (segment == terminal->spill_segment_count - 1 || (page->next && page->next->spill_segment == segment))
+      return;
+    munmap(terminal->spill_segments[segment], LIBTERMINAL_SPILL_SEGMENT_SIZE);
+    terminal->spill_segments[segment] = NULL;
+    #ifdef FALLOC_FL_PUNCH_HOLE
+      fallocate(terminal->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)segment * LIBTERMINAL_SPILL_SEGMENT_SIZE, LIBTERMINAL_SPILL_SEGMENT_SIZE);
+    #endif
+  }
+
+  // Moves the oldest in-memory page into the spill file. The copy in the mapping is dropped from our resident set immediately; if anyone
+  // scrolls back to it, it's simply faulted back in from the page cache, or the disk.
+  static int terminal_spill_scrollback_page(terminal_t* terminal) {
+    backbuffer_page_t* page = terminal->scrollback_resident_end;
+    size_t size = page->lines * (page->columns * sizeof(buffer_char_t) + sizeof(int));
+    if (size > LIBTERMINAL_SPILL_SEGMENT_SIZE)
+      return 0;
+    if (!terminal->spill_segment_count || terminal->spill_segment_offset + size > LIBTERMINAL_SPILL_SEGMENT_SIZE) {
+      int segment = terminal->spill_segment_count;
+      if (ftruncate(terminal->spill_fd, (off_t)(segment + 1) * LIBTERMINAL_SPILL_SEGMENT_SIZE) != 0)
+        return 0;
+      char* mapping = mmap(NULL, LIBTERMINAL_SPILL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, terminal->spill_fd, (off_t)segment * LIBTERMINAL_SPILL_SEGMENT_SIZE);
+      if (mapping == MAP_FAILED)
+        return 0;
+      terminal->spill_segments = realloc(terminal->spill_segments, sizeof(char*) * (segment + 1));
+      terminal->spill_segments[segment] = mapping;
+      terminal->spill_segment_count = segment + 1;
+      terminal->spill_segment_offset = 0;
+    }
+    char* target = &terminal->spill_segments[terminal->spill_segment_count - 1][terminal->spill_segment_offset];
+    memcpy(target, page->buffer, size);
+    terminal->spill_segment_offset += (size + 15) & ~(size_t)15;
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t resident_start = ((uintptr_t)target + page_size - 1) & ~(page_size - 1), resident_end = ((uintptr_t)target + size) & ~(page_size - 1);
+    if (resident_end > resident_start)
+      madvise((void*)resident_start, resident_end - resident_start, MADV_DONTNEED);
+
+    backbuffer_page_t* spilled = malloc(sizeof(backbuffer_page_t));
+    *spilled = *page;
+    spilled->buffer = (buffer_char_t*)target;
+    spilled->spill_segment = terminal->spill_segment_count - 1;
+    terminal_relink_scrollback_page(terminal, page, spilled);
+    terminal->scrollback_resident_end = spilled->next;
+    terminal->scrollback_resident_lines -= spilled->line;
+    terminal_account_scrollback(terminal, -(long long)backbuffer_page_size(page->columns, page->lines));
+    free(page);
+    return 1;
+  }
+
+  // Starts spilling evicted scrollback into an anonymous file in the specified directory.
+  static int terminal_spill(terminal_t* terminal, const char* directory, int limit) {
+    terminal->scrollback_spill_limit = limit;
+    if (terminal->spilling)
+      return 1;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/lite-xl-terminal-XXXXXX", directory);
+    int fd = mkstemp(path);
+    if (fd == -1)
+      return 0;
+    // Shells started after this, and the daemon, would otherwise hold on to it, and its space with it, once we're done with it.
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unlink(path);
+    terminal->spill_fd = fd;
+    terminal->spilling = 1;
+    return 1;
+  }
+#endif
+
+static void terminal_clear_scrollback_buffer(terminal_t* terminal) {
+  backbuffer_page_t* scrollback_buffer = terminal->scrollback_buffer_start;
+  while (scrollback_buffer) {
+      backbuffer_page_t* prev = scrollback_buffer->prev;
+      free(scrollback_buffer);
+      scrollback_buffer = prev;
+  }
+  terminal->scrollback_buffer_start = NULL;
+  terminal->scrollback_buffer_end = NULL;
+  terminal->scrollback_resident_end = NULL;
+  for (viewport_t* viewport = terminal->viewports; viewport; viewport = viewport->next) {
+    viewport->scrollback_target = NULL;
+    viewport->scrollback_target_top_offset = 0;
+  }
+  terminal->scrollback_total_lines = 0;
+  terminal->scrollback_resident_lines = 0;
+  terminal_account_scrollback(terminal, -(long long)terminal->scrollback_bytes);
+  #ifndef _WIN32
+    terminal_clear_spill(terminal);
+  #endif
+}
+
+// Removes the oldest page from the scrollback entirely, making sure we don't leave our scrollback target dangling.
+static void terminal_drop_scrollback_page(terminal_t* terminal) {
+  backbuffer_page_t* page = terminal->scrollback_buffer_end;
+  if (page->next)
+    page->next->prev = NULL;
+  else
+    terminal->scrollback_buffer_start = NULL;
+  terminal->scrollback_buffer_end = page->next;
+  terminal->scrollback_total_lines -= page->line;
+  if (page->spill_segment == -1) {
+    terminal->scrollback_resident_end = page->next;
+    terminal->scrollback_resident_lines -= page->line;
+    terminal_account_scrollback(terminal, -(long long)backbuffer_page_size(page->columns, page->lines));
+  }
+  #ifndef _WIN32
+  else
+    terminal_release_spilled_page(terminal, page);
+  #endif
+  terminal_forget_scrollback_page(terminal, page);
+  free(page);
+  // There's less to scroll back through now, so every position needs clamping.
+  for (viewport_t* viewport = terminal->viewports; viewport; viewport = viewport->next)
+    terminal_scrollback(terminal, viewport, viewport->scrollback_position);
+}
+
+// Gets the oldest in-memory page out of memory; either by spilling it to disk, or if we're not doing that, dropping it.
+static void terminal_evict_scrollback_page(terminal_t* terminal) {
+  #ifndef _WIN32
+    if (terminal->spilling) {
+      if (terminal_spill_scrollback_page(terminal))
+        return;
+      terminal->spilling = 0;
+    }
+  #endif
+  terminal_drop_scrollback_page(terminal);
+}
+
+// Evicts pages until we're under all our limits. The page we're currently writing into is never evicted for the sake of a byte limit.
+// For the global limit, we evict from whichever terminal has the oldest page, so that one chatty terminal can't wipe out everyone else's
+// history without first losing its own old history.
+static void terminal_enforce_scrollback_limits(terminal_t* terminal) {
+  while (terminal->scrollback_resident_end && terminal->scrollback_resident_lines > terminal->scrollback_limit + terminal->scrollback_resident_end->line)
+    terminal_evict_scrollback_page(terminal);
+  while (terminal->scrollback_bytes_limit && terminal->scrollback_bytes > terminal->scrollback_bytes_limit && terminal->scrollback_resident_end != terminal->scrollback_buffer_start)
+    terminal_evict_scrollback_page(terminal);
+  while (terminal->scrollback_spill_limit && terminal->scrollback_buffer_end && terminal->scrollback_buffer_end->spill_segment != -1 && terminal->scrollback_total_lines - terminal->scrollback_resident_lines > terminal->scrollback_spill_limit + terminal->scrollback_buffer_end->line)
+    terminal_drop_scrollback_page(terminal);
+  while (scrollback_global_bytes_limit && scrollback_global_bytes > scrollback_global_bytes_limit) {
+    terminal_t* oldest = NULL;
+    for (terminal_t* candidate = terminals; candidate; candidate = candidate->next) {
+      if (candidate->scrollback_resident_end && candidate->scrollback_resident_end != candidate->scrollback_buffer_start && (!oldest || candidate->scrollback_resident_end->serial < oldest->scrollback_resident_end->serial))
+        oldest = candidate;
+    }
+    if (!oldest)
+      break;
+    terminal_evict_scrollback_page(oldest);
+  }
+}
+
+// The kernels every edit goes through. Fills write one cell and then double it up with memcpy, which the C library vectorizes;
+// an unstyled blank is all zeroes, so that goes straight to memset.
+static void cells_fill(buffer_char_t* cells, int count, buffer_char_t cell) {
+  if (count <= 0)
+    return;
+  if (cell.codepoint == 0 && cell.styling.value == 0) {
+    memset(cells, 0, sizeof(buffer_char_t) * count);
+    return;
+  }
+  cells[0] = cell;
+  for (int filled = 1; filled < count; filled *= 2)
+    memcpy(&cells[filled], cells, sizeof(buffer_char_t) * min(filled, count - filled));
+}
+
+static void cells_move(buffer_char_t* dst, const buffer_char_t* src, int count) {
+  if (count > 0)
+    memmove(dst, src, sizeof(buffer_char_t) * count);
+}
+
+// What erased cells become: blank, but in the current background color, as with xterm's back color erase. An unset background
+// leaves the cell empty, rather than a space, so that it doesn't count as text when copying.
+static buffer_char_t view_blank_cell(view_t* view) {
+  if (view->cursor_styling.background.value == UNSET_COLOR.value)
+    return (buffer_char_t){ LIBTERMINAL_NO_STYLING, 0 };
+  return (buffer_char_t){ { .foreground = UNSET_COLOR, .background = view->cursor_styling.background }, ' ' };
+}
+
+// Moves a rectangle of cells within a view; the source and destination may overlap. Callers clip to the grid.
+static void view_copy_rect(view_t* view, int columns, int src_x, int src_y, int dst_x, int dst_y, int width, int height) {
+  if (width <= 0 || height <= 0)
+    return;
+  ++view->generation;
+  if (width == columns)
+    cells_move(&view->buffer[dst_y * columns], &view->buffer[src_y * columns], width * height);
+  else if (dst_y > src_y) {
+    for (int y = height - 1; y >= 0; --y)
+      cells_move(&view->buffer[(dst_y + y) * columns + dst_x], &view->buffer[(src_y + y) * columns + src_x], width);
+  } else {
+    for (int y = 0; y < height; ++y)
+      cells_move(&view->buffer[(dst_y + y) * columns + dst_x], &view->buffer[(src_y + y) * columns + src_x], width);
+  }
+}
+
+static void view_fill_rect(view_t* view, int columns, int x, int y, int width, int height, buffer_char_t cell) {
+  if (width <= 0 || height <= 0)
+    return;
+  ++view->generation;
+  if (width == columns)
+    cells_fill(&view->buffer[y * columns], width * height, cell);
+  else {
+    for (int j = y; j < y + height; ++j)
+      cells_fill(&view->buffer[j * columns + x], width, cell);
+  }
+}
+
+// The scrolling region and margins, clamped in case of Guldoman levels of resizing.
+static void terminal_scrolling_bounds(terminal_t* terminal, int* top, int* bottom, int* left, int* right) {
+  view_t* view = &terminal->views[terminal->current_view];
+  int region = view->scrolling_region_start != -1 && view->scrolling_region_end != -1;
+  *top = region ? min(view->scrolling_region_start, terminal->lines - 1) : 0;
+  *bottom = region ? min(view->scrolling_region_end, terminal->lines) : terminal->lines;
+  *left = view->margin_left != -1 ? min(view->margin_left, terminal->columns - 1) : 0;
+  *right = view->margin_right != -1 ? min(view->margin_right, terminal->columns) : terminal->columns;
+}
+
+// Scrolls the text inside a rectangle by amount lines; up if positive, down if negative, blanking what's uncovered. Nothing goes
+// to the scrollback. When the rectangle spans the whole width, whole rows are moved at once, along with whether they overflow.
+static void terminal_scroll_rect(terminal_t* terminal, int top, int bottom, int left, int right, int amount) {
+  view_t* view = &terminal->views[terminal->current_view];
+  int height = bottom - top, width = right - left, distance = min(abs(amount), height);
+  if (height <= 0 || width <= 0 || distance == 0)
+    return;
+  buffer_char_t blank = view_blank_cell(view);
+  if (amount > 0) {
+    view_copy_rect(view, terminal->columns, left, top + distance, left, top, width, height - distance);
+    view_fill_rect(view, terminal->columns, left, bottom - distance, width, distance, blank);
+  } else {
+    view_copy_rect(view, terminal->columns, left, top, left, top + distance, width, height - distance);
+    view_fill_rect(view, terminal->columns, left, top, width, distance, blank);
+  }
+  if (width == terminal->columns) {
+    if (amount > 0) {
+      memmove(&view->overflows[top], &view->overflows[top + distance], sizeof(int) * (height - distance));
+      memset(&view->overflows[bottom - distance], 0, sizeof(int) * distance);
+    } else {
+      memmove(&view->overflows[top + distance], &view->overflows[top], sizeof(int) * (height - distance));
+      memset(&view->overflows[top], 0, sizeof(int) * distance);
+    }
+  }
+}
+
+static void terminal_scroll_region(terminal_t* terminal, int amount) {
+  int top, bottom, left, right;
+  terminal_scrolling_bounds(terminal, &top, &bottom, &left, &right);
+  terminal_scroll_rect(terminal, top, bottom, left, right, amount);
+}
+
+// Adds a line to the newest end of the scrollback, starting a new page if the current one is full, or a different width.
+static void terminal_push_scrollback_line(terminal_t* terminal, const buffer_char_t* cells, int columns, int overflows) {
+  if (!terminal->scrollback_buffer_start || terminal->scrollback_buffer_start->columns != columns || terminal->scrollback_buffer_start->line >= terminal->scrollback_buffer_start->lines) {
+    backbuffer_page_t* page = backbuffer_page_new(columns, LIBTERMINAL_BACKBUFFER_PAGE_LINES);
+    terminal_account_scrollback(terminal, backbuffer_page_size(columns, LIBTERMINAL_BACKBUFFER_PAGE_LINES));
+    if (!terminal->scrollback_buffer_start)
+      terminal->scrollback_buffer_end = page;
+    if (!terminal->scrollback_resident_end)
+      terminal->scrollback_resident_end = page;
+    backbuffer_page_t* prev = terminal->scrollback_buffer_start;
+    page->prev = prev;
+    if (prev)
+      prev->next = page;
+    terminal->scrollback_buffer_start = page;
+  }
+  memcpy(&terminal->scrollback_buffer_start->buffer[terminal->scrollback_buffer_start->line * columns], cells, sizeof(buffer_char_t) * columns);
+  int* backbuffer_overflows = backbuffer_page_overflows(terminal->scrollback_buffer_start);
+  backbuffer_overflows[terminal->scrollback_buffer_start->line] = overflows;
+  terminal->scrollback_buffer_start->line++;
+  terminal->scrollback_total_lines++;
+  terminal->scrollback_resident_lines++;
+  terminal->line_id_base++;
+  terminal_enforce_scrollback_limits(terminal);
+}
+
+static void terminal_shift_buffer(terminal_t* terminal) {
+  view_t* view = &terminal->views[terminal->current_view];
+
+  if ((view->scrolling_region_start != -1 && view->scrolling_region_end != -1) || view->margin_left != -1) {
+    terminal_scroll_region(terminal, 1);
+    return;
+  }
+  if (terminal->current_view == VIEW_NORMAL_BUFFER)
+    terminal_push_scrollback_line(terminal, &view->buffer[0], terminal->columns, view->overflows[0]);
+  ++view->generation;
+  memmove(&view->buffer[0], &view->buffer[terminal->columns], sizeof(buffer_char_t) * terminal->columns * (terminal->lines - 1));
+  memmove(&view->overflows[0], &view->overflows[1], sizeof(int) * (terminal->lines - 1));
+  cells_fill(&view->buffer[terminal->columns * (terminal->lines - 1)], terminal->columns, view_blank_cell(view));
+  view->overflows[terminal->lines - 1] = 0;
+}
+
+// SU and SD. Scrolling up the whole of the normal buffer goes through the scrollback like any newline would; anything else only
+// moves the text within the region.
+static void terminal_scroll_lines(terminal_t* terminal, int amount) {
+  view_t* view = &terminal->views[terminal->current_view];
+  if (amount > 0 && terminal->current_view == VIEW_NORMAL_BUFFER && (view->scrolling_region_start == -1 || view->scrolling_region_end == -1) && view->margin_left == -1) {
+    for (int i = 0; i < min(amount, terminal->lines); ++i)
+      terminal_shift_buffer(terminal);
+  } else
+    terminal_scroll_region(terminal, amount);
+}
+
+static void terminal_free_view(view_t* view) {
+  free(view->buffer);
+  free(view->overflows);
+  view->buffer = NULL;
+  view->overflows = NULL;
+  view->buffer_capacity = 0;
+  view->overflows_capacity = 0;
+}
+
+// The alternate buffer is only allocated while it's in use; most shells never touch it, and there's no reason to carry it around.
+static void terminal_switch_buffer(terminal_t* terminal, view_e view) {
+  terminal->current_view = view;
+  view_t* alternate = &terminal->views[VIEW_ALTERNATE_BUFFER];
+  if (view == VIEW_ALTERNATE_BUFFER) {
+    if (!alternate->buffer) {
+      alternate->buffer = calloc(sizeof(buffer_char_t), terminal->columns * terminal->lines);
+      alternate->overflows = calloc(sizeof(int), terminal->lines);
+      alternate->buffer_capacity = terminal->columns * terminal->lines;
+      alternate->overflows_capacity = terminal->lines;
+    } else {
+      memset(alternate->buffer, 0, sizeof(buffer_char_t) * terminal->columns * terminal->lines);
+      memset(alternate->overflows, 0, terminal->lines * sizeof(int));
+    }
+    alternate->cursor_x = 0;
+    alternate->cursor_y = 0;
+    alternate->cursor_styling = LIBTERMINAL_NO_STYLING;
+    alternate->cursor_styling_inversed = 0;
+    alternate->scrolling_region_end = -1;
+    alternate->scrolling_region_start = -1;
+    alternate->margins_enabled = 0;
+    alternate->margin_left = -1;
+    alternate->margin_right = -1;
+    for (int i = 0; i < 256; ++i)
+      alternate->palette[i] = indexed_color(i);
+  } else
+    terminal_free_view(alternate);
+}
+
+static int parse_number(const char* seq, int def) {
+  if (seq[0] >= '0' && seq[0] <= '9')
+    return atoi(seq);
+  return def;
+}
+
+// Reads up to count semicolon separated parameters; missing or empty ones are left as def. Returns how many were present.
+static int parse_numbers(const char* seq, int* numbers, int count, int def) {
+  int present = 0;
+  for (int i = 0; i < count; ++i)
+    numbers[i] = def;
+  for (int i = 0; i < count; ++i) {
+    if (*seq >= '0' && *seq <= '9') {
+      numbers[i] = atoi(seq);
+      while (*seq >= '0' && *seq <= '9')
+        ++seq;
+    }
+    ++present;
+    if (*seq != ';')
+      break;
+    ++seq;
+  }
+  return present;
+}
+
+
+
+// Synchronized output: applications bracket each frame with ?2026h and ?2026l, so that we don't draw one half-written. We keep drawing
+// a copy of the screen as it was when the frame started until it ends, or until it's taken too long, in case the application died.
+static void terminal_begin_synchronized(terminal_t* terminal) {
+  view_t* view = &terminal->views[terminal->current_view];
+  if (!terminal->synchronized_deadline) {
+    terminal->frame = realloc(terminal->frame, sizeof(buffer_char_t) * terminal->columns * terminal->lines);
+    terminal->frame_overflows = realloc(terminal->frame_overflows, sizeof(int) * terminal->lines);
+    memcpy(terminal->frame, view->buffer, sizeof(buffer_char_t) * terminal->columns * terminal->lines);
+    memcpy(terminal->frame_overflows, view->overflows, sizeof(int) * terminal->lines);
+    terminal->frame_cursor_x = view->cursor_x;
+    terminal->frame_cursor_y = view->cursor_y;
+    terminal->frame_cursor_mode = view->cursor_mode;
+  }
+  terminal->synchronized_deadline = terminal_get_time() + LIBTERMINAL_SYNCHRONIZED_TIMEOUT;
+}
+
+static void terminal_end_synchronized(terminal_t* terminal) {
+  if (terminal->synchronized_deadline)
+    terminal->synchronized_damage = 1;
+  terminal->synchronized_deadline = 0;
+}
+
+static int terminal_is_synchronized(terminal_t* terminal) {
+  if (terminal->synchronized_deadline && terminal_get_time() >= terminal->synchronized_deadline)
+    terminal_end_synchronized(terminal);
+  return terminal->synchronized_deadline != 0;
+}
+
+// Called once the terminal has been drawn; an echo is on screen as of then, unless synchronized output is still holding it back.
+static void terminal_presented(terminal_t* terminal) {
+  if (terminal->latency_echoed && !terminal_is_synchronized(terminal)) {
+    latency_record(&terminal->latency[LATENCY_PRESENT], terminal_get_monotonic_time() - terminal->latency_echoed);
+    terminal->latency_echoed = 0;
+  }
+}
+
+// Applies SGR (CSI ... m) to what characters are being emitted as. Only touches the view's styling, and reads its palette, so it's
+// safe to use on a view of our own, away from any terminal.
+static void view_apply_sgr(view_t* view, const char* seq) {
+  int offset = 2;
+  enum DisplayState {
+    DISPLAY_STATE_NONE,
+    DISPLAY_STATE_COLOR_MODE,
+    DISPLAY_STATE_COLOR_VALUE_IDX,
+    DISPLAY_STATE_COLOR_VALUE_R,
+    DISPLAY_STATE_COLOR_VALUE_G,
+    DISPLAY_STATE_COLOR_VALUE_B
+  };
+  enum DisplayState state = DISPLAY_STATE_NONE;
+  uint8_t r = 0,g = 0,b = 0;
+  int foreground = 0;
+  while (1) {
+    color_t target_color = UNTARGETED_COLOR;
+    int target_foreground = 0;
+    switch (state) {
+      case DISPLAY_STATE_NONE: {
+        int display_number = parse_number(&seq[offset], 0);
+        switch (display_number) {
+          case 0  : view->cursor_styling = LIBTERMINAL_NO_STYLING; view->cursor_styling_inversed = 0; break;
+          case 1  : view->cursor_styling.foreground.attributes |= ATTRIBUTE_BOLD; break;
+          case 3  : view->cursor_styling.foreground.attributes |= ATTRIBUTE_ITALIC; break;
+          case 4  : view->cursor_styling.foreground.attributes |= ATTRIBUTE_UNDERLINE; break;
+          case 27:
+          case 7  : {
+            int is_inversed = display_number == 7;
+            if (is_inversed != view->cursor_styling_inversed) {
+              view->cursor_styling_inversed = is_inversed;
+              color_t background = view->cursor_styling.background;
+              if (view->cursor_styling.foreground.value == UNSET_COLOR.value)
+                view->cursor_styling.background = INVERSE_COLOR;
+              else if (view->cursor_styling.foreground.value == INVERSE_COLOR.value)
+                view->cursor_styling.background = UNSET_COLOR;
+              else
+                view->cursor_styling.background = view->cursor_styling.foreground;
+              if (background.value == UNSET_COLOR.value)
+                view->cursor_styling.foreground = INVERSE_COLOR;
+              else if (background.value == INVERSE_COLOR.value)
+                view->cursor_styling.foreground = UNSET_COLOR;
+              else
+                view->cursor_styling.foreground = view->cursor_styling.background;
+            }
+          } break;
+          case 30 : target_foreground = 1; target_color = view->palette[0]; break;
+          case 31 : target_foreground = 1; target_color = view->palette[1]; break;
+          case 32 : target_foreground = 1; target_color = view->palette[2]; break;
+          case 33 : target_foreground = 1; target_color = view->palette[3]; break;
+          case 34 : target_foreground = 1; target_color = view->palette[4]; break;
+          case 35 : target_foreground = 1; target_color = view->palette[5]; break;
+          case 36 : target_foreground = 1; target_color = view->palette[6]; break;
+          case 37 : target_foreground = 1; target_color = view->palette[7]; break;
+          case 38 : state = DISPLAY_STATE_COLOR_MODE; foreground = 1; break;
+          case 39 : target_foreground = 1; target_color = UNSET_COLOR; break;
+          case 40 : target_foreground = 0; target_color = view->palette[0]; break;
+          case 41 : target_foreground = 0; target_color = view->palette[1]; break;
+          case 42 : target_foreground = 0; target_color = view->palette[2]; break;
+          case 43 : target_foreground = 0; target_color = view->palette[3]; break;
+          case 44 : target_foreground = 0; target_color = view->palette[4]; break;
+          case 45 : target_foreground = 0; target_color = view->palette[5]; break;
+          case 46 : target_foreground = 0; target_color = view->palette[6]; break;
+          case 47 : target_foreground = 0; target_color = view->palette[7]; break;
+          case 48 : state = DISPLAY_STATE_COLOR_MODE; foreground = 0; break;
+          case 49 : target_foreground = 0; target_color = UNSET_COLOR; break;
+          case 90 : target_foreground = 1; target_color = view->palette[8]; break;
+          case 91 : target_foreground = 1; target_color = view->palette[9]; break;
+          case 92 : target_foreground = 1; target_color = view->palette[10]; break;
+          case 93 : target_foreground = 1; target_color = view->palette[11]; break;
+          case 94 : target_foreground = 1; target_color = view->palette[12]; break;
+          case 95 : target_foreground = 1; target_color = view->palette[13]; break;
+          case 96 : target_foreground = 1; target_color = view->palette[14]; break;
+          case 97 : target_foreground = 1; target_color = view->palette[15]; break;
+          case 100: target_foreground = 0; target_color = view->palette[8]; break;
+          case 101: target_foreground = 0; target_color = view->palette[9]; break;
+          case 102: target_foreground = 0; target_color = view->palette[10]; break;
+          case 103: target_foreground = 0; target_color = view->palette[11]; break;
+          case 104: target_foreground = 0; target_color = view->palette[12]; break;
+          case 105: target_foreground = 0; target_color = view->palette[13]; break;
+          case 106: target_foreground = 0; target_color = view->palette[14]; break;
+          case 107: target_foreground = 0; target_color = view->palette[15]; break;
+          default: break;
+        }
+      } break;
+      case DISPLAY_STATE_COLOR_MODE: state = parse_number(&seq[offset], 0) != 5 ? DISPLAY_STATE_COLOR_VALUE_R : DISPLAY_STATE_COLOR_VALUE_IDX; break;
+      case DISPLAY_STATE_COLOR_VALUE_IDX:
+        target_foreground = foreground;
+        int idx = (parse_number(&seq[offset], 0) & 0xFF);
+        target_color = view->palette[idx];
+        state = DISPLAY_STATE_NONE;
+      break;
+      case DISPLAY_STATE_COLOR_VALUE_R: r = (parse_number(&seq[offset], 0) & 0xFF); state = DISPLAY_STATE_COLOR_VALUE_G; break;
+      case DISPLAY_STATE_COLOR_VALUE_G: g = (parse_number(&seq[offset], 0) & 0xFF); state = DISPLAY_STATE_COLOR_VALUE_B; break;
+      case DISPLAY_STATE_COLOR_VALUE_B: {
+        target_foreground = foreground;
+        b = parse_number(&seq[offset], 0) & 0xFF;
+        target_color = rgb_color(r, g, b);
+        state = DISPLAY_STATE_NONE;
+      } break;
+    }
+    if (target_color.value != UNTARGETED_COLOR.value) {
+      if (view->cursor_styling_inversed)
+        target_foreground = !target_foreground;
+      if (target_foreground) {
+        uint8_t attributes = view->cursor_styling.foreground.attributes;
+        view->cursor_styling.foreground = target_color;
+        view->cursor_styling.foreground.attributes |= (attributes & ATTRIBUTE_STYLING_MASK);
+      } else
+        view->cursor_styling.background = target_color;
+    }
+    char* next = strchr(&seq[offset], ';');
+    if (!next)
+      break;
+    offset = (next - seq) + 1;
+  }
+}
+
+static int terminal_escape_sequence(terminal_t* terminal, terminal_escape_type_e type, const char* seq) {
+  #ifdef LIBTERMINAL_DEBUG_ESCAPE
+  fprintf(stderr, "ESC");
+  for (int i = 1; i < strlen(seq); ++i) {
+    fprintf(stderr, "%c", seq[i]);
+  }
+  fprintf(stderr, "\n");
+  #endif
+  view_t* view = &terminal->views[terminal->current_view];
+  int unhandled = 0;
+  if (type == ESCAPE_TYPE_CSI) {
+    int seq_end = strlen(seq) - 1;
+    // Edits that write cells themselves, rather than through view_fill_rect and the like.
+    if (strchr("@JKPXb", seq[seq_end]))
+      ++view->generation;
+    switch (seq[seq_end]) {
+      case '@': {
+        buffer_char_t* row = &view->buffer[terminal->columns * view->cursor_y];
+        int length = min(max(parse_number(&seq[2], 1), 1), terminal->columns - view->cursor_x);
+        cells_move(&row[view->cursor_x + length], &row[view->cursor_x], terminal->columns - (view->cursor_x + length));
+        cells_fill(&row[view->cursor_x], length, view_blank_cell(view));
+      } break;
+      case 'A': view->cursor_y = max(view->cursor_y - max(parse_number(&seq[2], 1), 1), 0);     break;
+      case 'B': view->cursor_y = min(view->cursor_y + max(parse_number(&seq[2], 1), 1), terminal->lines - 1); break;
+      case 'C': view->cursor_x = min(view->cursor_x + max(parse_number(&seq[2], 1), 1), terminal->columns - 1); break;
+      case 'D': view->cursor_x = max(view->cursor_x - max(parse_number(&seq[2], 1), 1), 0); break;
+      case 'E': view->cursor_y = min(view->cursor_y + max(parse_number(&seq[2], 1), 1), terminal->lines - 1); view->cursor_x = 0; break;
+      case 'F': view->cursor_y = min(view->cursor_y - max(parse_number(&seq[2], 1), 1), 0); view->cursor_x = 0; break;
+      case 'G': view->cursor_x = min(max(max(parse_number(&seq[2], 1), 1) - 1, 0), terminal->columns - 1); break;
+      case 'f':
+      case 'H': {
+        int semicolon = -1;
+        for (semicolon = 2; semicolon < seq_end && seq[semicolon] != ';'; ++semicolon);
+        if (seq[semicolon] != ';') {
+          view->cursor_x = 0;
+          view->cursor_y = 0;
+        } else {
+          view->cursor_y = max(min(parse_number(&seq[2], 1) - 1, terminal->lines - 1), 0);
+          view->cursor_x = max(min(parse_number(&seq[semicolon+1], 1) - 1, terminal->columns - 1), 0);
+        }
+      } break;
+      case 'J': {
+        int cursor = terminal->columns * view->cursor_y + view->cursor_x;
+        switch (seq[2]) {
+          case '1': cells_fill(view->buffer, cursor + 1, view_blank_cell(view)); break;
+          case '3':
+            terminal_clear_scrollback_buffer(terminal);
+            // intentional fallthrough
+          case '2':
+            cells_fill(view->buffer, terminal->columns * terminal->lines, view_blank_cell(view));
+            view->cursor_x = 0;
+            view->cursor_y = 0;
+          break;
+          default: cells_fill(&view->buffer[cursor], terminal->columns * terminal->lines - cursor, view_blank_cell(view)); break;
+        }
+      } break;
+      case 'K': {
+        int s, e;
+        switch (seq[2]) {
+          case '1': s = 0; e = view->cursor_x + 1; break;
+          case '2': s = 0; e = terminal->columns; break;
+          default: s = view->cursor_x; e = terminal->columns; break;
+        }
+        cells_fill(&view->buffer[view->cursor_y * terminal->columns + s], e - s, view_blank_cell(view));
+      } break;
+      case 'L':
+      case 'M': {
+        // Only inside the scrolling region and margins; the lines from the cursor down to the bottom of the region scroll.
+        int top, bottom, left, right;
+        terminal_scrolling_bounds(terminal, &top, &bottom, &left, &right);
+        if (view->cursor_y >= top && view->cursor_y < bottom && view->cursor_x >= left && view->cursor_x < right) {
+          int length = max(parse_number(&seq[2], 1), 1);
+          terminal_scroll_rect(terminal, view->cursor_y, bottom, left, right, seq[seq_end] == 'M' ? length : -length);
+        }
+      } break;
+      case 'P': {
+        buffer_char_t* row = &view->buffer[terminal->columns * view->cursor_y];
+        int length = min(max(parse_number(&seq[2], 1), 1), terminal->columns - view->cursor_x);
+        cells_move(&row[view->cursor_x], &row[view->cursor_x + length], terminal->columns - (view->cursor_x + length));
+        cells_fill(&row[terminal->columns - length], length, view_blank_cell(view));
+      } break;
+      case 'X': {
+        int length = min(max(parse_number(&seq[2], 1), 1), terminal->columns - view->cursor_x);
+        cells_fill(&view->buffer[view->cursor_y * terminal->columns + view->cursor_x], length, view_blank_cell(view));
+      } break;
+      case 'S': terminal_scroll_lines(terminal, max(parse_number(&seq[2], 1), 1)); break;
+      case 'T': {
+        // With more than one parameter, this is xterm's highlight mouse tracking, which we don't support.
+        if (!strchr(seq, ';'))
+          terminal_scroll_lines(terminal, -max(parse_number(&seq[2], 1), 1));
+        else
+          unhandled = 1;
+      } break;
+      case 's': {
+        int margins[2];
+        if (view->margins_enabled && seq[2] != '?') {
+          parse_numbers(&seq[2], margins, 2, 0);
+          int left = max(margins[0], 1) - 1, right = margins[1] ? min(margins[1], terminal->columns) : terminal->columns;
+          if (right - left >= 2) {
+            view->margin_left = left;
+            view->margin_right = right;
+            if (left == 0 && right == terminal->columns)
+              view->margin_left = view->margin_right = -1;
+            view->cursor_x = 0;
+            view->cursor_y = 0;
+          }
+        } else
+          unhandled = 1;
+      } break;
+      case 'v':
+      case 'x':
+      case 'z': {
+        // DECCRA, DECFRA and DECERA. Coordinates are 1-based and inclusive, and we only have the one page.
+        int numbers[8], top, left, bottom, right;
+        if (seq_end < 3 || seq[seq_end-1] != '$') {
+          unhandled = 1;
+          break;
+        }
+        int* rect = seq[seq_end] == 'x' ? &numbers[1] : numbers;
+        parse_numbers(&seq[2], numbers, 8, 0);
+        top = max(rect[0], 1) - 1;
+        left = max(rect[1], 1) - 1;
+        bottom = rect[2] ? min(rect[2], terminal->lines) : terminal->lines;
+        right = rect[3] ? min(rect[3], terminal->columns) : terminal->columns;
+        if (top >= bottom || left >= right)
+          break;
+        if (seq[seq_end] == 'v') {
+          int dst_top = max(numbers[5], 1) - 1, dst_left = max(numbers[6], 1) - 1;
+          if (dst_top < terminal->lines && dst_left < terminal->columns)
+            view_copy_rect(view, terminal->columns, left, top, dst_left, dst_top, min(right - left, terminal->columns - dst_left), min(bottom - top, terminal->lines - dst_top));
+        } else if (seq[seq_end] == 'x') {
+          if ((numbers[0] >= 32 && numbers[0] <= 126) || numbers[0] >= 160)
+            view_fill_rect(view, terminal->columns, left, top, right - left, bottom - top, (buffer_char_t){ view->cursor_styling, numbers[0] });
+        } else
+          view_fill_rect(view, terminal->columns, left, top, right - left, bottom - top, (buffer_char_t){ view->cursor_styling, ' ' });
+      } break;
+      case 'b': {
+        if (view->last_graphical_character) {
+          int length = min(max(parse_number(&seq[2], 1), 1), terminal->columns - view->cursor_x);
+          cells_fill(&view->buffer[view->cursor_y * terminal->columns + view->cursor_x], length, (buffer_char_t){ view->cursor_styling, view->last_graphical_character });
+        }
+      } break;
+      case 'c': {
+        // VT220, with ANSI color. Rectangular editing (28) implies left and right margins, which only scrolling honors so far, so
+        // isn't advertised.
+        terminal_reply(terminal, "\e[?62;22c", 9);
+      } break;
+      case 'd': view->cursor_y = min(max(max(parse_number(&seq[2], 1), 1) - 1, 0), terminal->lines - 1); break;
+      case 'h': {
+        if (seq[2] == '?') {
+          const char* next = &seq[3];
+          while (next) {
+            switch (parse_number(next, 0)) {
+              case 1: view->cursor_keys_mode = KEYS_MODE_APPLICATION; break;
+              case 9: view->mouse_tracking_mode = MOUSE_TRACKING_X10; break;
+              case 12: view->cursor_mode = CURSOR_BLINKING; break;
+              case 25: view->cursor_mode = CURSOR_SOLID; break;
+              case 1000: view->mouse_tracking_mode = MOUSE_TRACKING_NORMAL; break;
+              case 1002: view->mouse_tracking_mode = MOUSE_TRACKING_BUTTON; break;
+              case 1003: view->mouse_tracking_mode = MOUSE_TRACKING_ANY; break;
+              case 1006: view->mouse_sgr = 1; break;
+              case 1004: terminal->reporting_focus = 1; break;
+              case 1047: terminal_switch_buffer(terminal, VIEW_ALTERNATE_BUFFER); break;
+              case 1049: terminal_switch_buffer(terminal, VIEW_ALTERNATE_BUFFER); break;
+              case 2004: terminal->paste_mode = PASTE_BRACKETED; break;
+              case 69: view->margins_enabled = 1; break;
+              case 2026: terminal_begin_synchronized(terminal); break;
+              default: unhandled = 1; break;
+            }
+            if ((next = strstr(next, ";")))
+              next++;
+          }
+        }
+      } break;
+      case 'l': {
+        if (seq[2] == '?') {
+          const char* next = &seq[3];
+          while (next) {
+            switch (parse_number(next, 0)) {
+              case 1: view->cursor_keys_mode = KEYS_MODE_NORMAL; break;
+              case 9: view->mouse_tracking_mode = MOUSE_TRACKING_NONE; break;
+              case 12: view->cursor_mode = CURSOR_SOLID; break;
+              case 25: view->cursor_mode = CURSOR_HIDDEN; break;
+              case 1000:
+              case 1002:
+              case 1003: view->mouse_tracking_mode = MOUSE_TRACKING_NONE; break;
+              case 1006: view->mouse_sgr = 0; break;
+              case 1004: terminal->reporting_focus = 0; break;
+              case 1047: terminal_switch_buffer(terminal, VIEW_NORMAL_BUFFER); break;
+              case 1049: terminal_switch_buffer(terminal, VIEW_NORMAL_BUFFER); break;
+              case 2004: terminal->paste_mode = PASTE_NORMAL; break;
+              case 69: view->margins_enabled = 0; view->margin_left = view->margin_right = -1; break;
+              case 2026: terminal_end_synchronized(terminal); break;
+              default: unhandled = 1; break;
+            }
+            if (next = strstr(next, ";"))
+              next++;
+          }
+        }
+      } break;
+      case 'm':
+        view_apply_sgr(view, seq);
+        return 0;
+      case 'n': {
+        if (parse_number(&seq[2], 0) == 6) {
+          char buffer[32];
+          int length = snprintf(buffer, sizeof(buffer), "\x1B[%d;%dR", view->cursor_y + 1, min(view->cursor_x, terminal->columns - 1) + 1);
+          terminal_reply(terminal, buffer, length);
+        } else
+          unhandled = 1;
+      } break;
+      case 'p': {
+        // DECRQM; applications ask about synchronized output before they use it. 1 is set, 2 is reset, 0 is unrecognized.
+        if (seq[2] == '?' && seq[seq_end-1] == '$') {
+          int mode = parse_number(&seq[3], 0), state = 0;
+          switch (mode) {
+            case 1: state = view->cursor_keys_mode == KEYS_MODE_APPLICATION ? 1 : 2; break;
+            case 25: state = view->cursor_mode != CURSOR_HIDDEN ? 1 : 2; break;
+            case 9: state = view->mouse_tracking_mode == MOUSE_TRACKING_X10 ? 1 : 2; break;
+            case 1000: state = view->mouse_tracking_mode == MOUSE_TRACKING_NORMAL ? 1 : 2; break;
+            case 1002: state = view->mouse_tracking_mode == MOUSE_TRACKING_BUTTON ? 1 : 2; break;
+            case 1003: state = view->mouse_tracking_mode == MOUSE_TRACKING_ANY ? 1 : 2; break;
+            case 1006: state = view->mouse_sgr ? 1 : 2; break;
+            case 1004: state = terminal->reporting_focus ? 1 : 2; break;
+            case 1049: state = terminal->current_view == VIEW_ALTERNATE_BUFFER ? 1 : 2; break;
+            // DECLRMM (69) goes unreported: printing, wrapping and line editing don't honor the margins yet, so applications that
+            // probe for them before relying on them shouldn't find them.
+            case 2004: state = terminal->paste_mode == PASTE_BRACKETED ? 1 : 2; break;
+            case 2026: state = terminal_is_synchronized(terminal) ? 1 : 2; break;
           }
+          char buffer[32];
+          int length = snprintf(buffer, sizeof(buffer), "\x1B[?%d;%d$y", mode, state);
+          terminal_reply(terminal, buffer, length);
+        } else
+          unhandled = 1;
+      } break;
+      case 'r': {
+        int semicolon = -1;
+        for (semicolon = 2; semicolon < seq_end && seq[semicolon] != ';'; ++semicolon);
+        view->cursor_x = 0;
+        view->cursor_y = 0;
+        if (seq[semicolon] == ';') {
+          view->scrolling_region_start = min(max(parse_number(&seq[2], 1) - 1, 0), terminal->lines - 1);
+          view->scrolling_region_end = min(max(parse_number(&seq[semicolon+1], 1), 0), terminal->lines);
+        } else
+          view->scrolling_region_start = view->scrolling_region_end = -1;
+      } break;
+      default: unhandled = 1; break;
+    }
+  } else if (type == ESCAPE_TYPE_OS) {
+    switch (seq[2]) {
+      case '0':
+        if (strlen(seq) >= 5 && seq[3] == ';')
+          snprintf(terminal->name, sizeof(terminal->name), "%s", &seq[4]);
+      break;
+      case '1':
+        if (strncmp(&seq[2], "133;", 4) == 0 && seq[6])
+          terminal_mark_command(terminal, seq[6], &seq[7]);
+        else
+          unhandled = 1;
+      break;
+      case '4': {
+        int idx, r,g,b;
+        if (sscanf(&seq[3], ";%d;rgb:%x/%x/%x", &idx, &r, &g, &b) == 4) {
+          view->palette[idx] = rgb_color(r, g, b);
+        } else
+          unhandled = 1;
+      } break;
+      default: unhandled = 1; break;
+    }
+  } else if (type == ESCAPE_TYPE_FIXED_WIDTH) {
+    switch (seq[1]) {
+      case '#': { // Put in, to satisfy vttest.
+        switch (seq[2]) {
+          case '8': cells_fill(view->buffer, terminal->columns * terminal->lines, (buffer_char_t){ view->cursor_styling, 'E' }); ++view->generation; break;
+          default: unhandled = 1; break;
         }
       } break;
-      case 'm': {
-        int offset = 2;
-        enum DisplayState {
-          DISPLAY_STATE_NONE,
-          DISPLAY_STATE_COLOR_MODE,
-          DISPLAY_STATE_COLOR_VALUE_IDX,
-          DISPLAY_STATE_COLOR_VALUE_R,
-          DISPLAY_STATE_COLOR_VALUE_G,
-          DISPLAY_STATE_COLOR_VALUE_B
-        };
-        enum DisplayState state = DISPLAY_STATE_NONE;
-        uint8_t r = 0,g = 0,b = 0;
-        int foreground = 0;
-        while (1) {
-          color_t target_color = UNTARGETED_COLOR;
-          int target_foreground = 0;
-          switch (state) {
-            case DISPLAY_STATE_NONE: {
-              int display_number = parse_number(&seq[offset], 0);
-              switch (display_number) {
-                case 0  : view->cursor_styling = LIBTERMINAL_NO_STYLING; view->cursor_styling_inversed = 0; break;
-                case 1  : view->cursor_styling.foreground.attributes |= ATTRIBUTE_BOLD; break;
-                case 3  : view->cursor_styling.foreground.attributes |= ATTRIBUTE_ITALIC; break;
-                case 4  : view->cursor_styling.foreground.attributes |= ATTRIBUTE_UNDERLINE; break;
-                case 27:
-                case 7  : {
-                  int is_inversed = display_number == 7;
-                  if (is_inversed != view->cursor_styling_inversed) {
-                    view->cursor_styling_inversed = is_inversed;
-                    color_t background = view->cursor_styling.background;
-                    if (view->cursor_styling.foreground.value == UNSET_COLOR.value)
-                      view->cursor_styling.background = INVERSE_COLOR;
-                    else if (view->cursor_styling.foreground.value == INVERSE_COLOR.value)
-                      view->cursor_styling.background = UNSET_COLOR;
-                    else
-                      view->cursor_styling.background = view->cursor_styling.foreground;
-                    if (background.value == UNSET_COLOR.value)
-                      view->cursor_styling.foreground = INVERSE_COLOR;
-                    else if (background.value == INVERSE_COLOR.value)
-                      view->cursor_styling.foreground = UNSET_COLOR;
-                    else
-                      view->cursor_styling.foreground = view->cursor_styling.background;
-                  }
-                } break;
-                case 30 : target_foreground = 1; target_color = view->palette[0]; break;
-                case 31 : target_foreground = 1; target_color = view->palette[1]; break;
-                case 32 : target_foreground = 1; target_color = view->palette[2]; break;
-                case 33 : target_foreground = 1; target_color = view->palette[3]; break;
-                case 34 : target_foreground = 1; target_color = view->palette[4]; break;
-                case 35 : target_foreground = 1; target_color = view->palette[5]; break;
-                case 36 : target_foreground = 1; target_color = view->palette[6]; break;
-                case 37 : target_foreground = 1; target_color = view->palette[7]; break;
-                case 38 : state = DISPLAY_STATE_COLOR_MODE; foreground = 1; break;
-                case 39 : target_foreground = 1; target_color = UNSET_COLOR; break;
-                case 40 : target_foreground = 0; target_color = view->palette[0]; break;
-                case 41 : target_foreground = 0; target_color = view->palette[1]; break;
-                case 42 : target_foreground = 0; target_color = view->palette[2]; break;
-                case 43 : target_foreground = 0; target_color = view->palette[3]; break;
-                case 44 : target_foreground = 0; target_color = view->palette[4]; break;
-                case 45 : target_foreground = 0; target_color = view->palette[5]; break;
-                case 46 : target_foreground = 0; target_color = view->palette[6]; break;
-                case 47 : target_foreground = 0; target_color = view->palette[7]; break;
-                case 48 : state = DISPLAY_STATE_COLOR_MODE; foreground = 0; break;
-                case 49 : target_foreground = 0; target_color = UNSET_COLOR; break;
-                case 90 : target_foreground = 1; target_color = view->palette[8]; break;
-                case 91 : target_foreground = 1; target_color = view->palette[9]; break;
-                case 92 : target_foreground = 1; target_color = view->palette[10]; break;
-                case 93 : target_foreground = 1; target_color = view->palette[11]; break;
-                case 94 : target_foreground = 1; target_color = view->palette[12]; break;
-                case 95 : target_foreground = 1; target_color = view->palette[13]; break;
-                case 96 : target_foreground = 1; target_color = view->palette[14]; break;
-                case 97 : target_foreground = 1; target_color = view->palette[15]; break;
-                case 100: target_foreground = 0; target_color = view->palette[8]; break;
-                case 101: target_foreground = 0; target_color = view->palette[9]; break;
-                case 102: target_foreground = 0; target_color = view->palette[10]; break;
-                case 103: target_foreground = 0; target_color = view->palette[11]; break;
-                case 104: target_foreground = 0; target_color = view->palette[12]; break;
-                case 105: target_foreground = 0; target_color = view->palette[13]; break;
-                case 106: target_foreground = 0; target_color = view->palette[14]; break;
-                case 107: target_foreground = 0; target_color = view->palette[15]; break;
-                default: unhandled = 1; break;
-              }
-            } break;
-            case DISPLAY_STATE_COLOR_MODE: state = parse_number(&seq[offset], 0) != 5 ? DISPLAY_STATE_COLOR_VALUE_R : DISPLAY_STATE_COLOR_VALUE_IDX; break;
-            case DISPLAY_STATE_COLOR_VALUE_IDX:
-              target_foreground = foreground;
-              int idx = (parse_number(&seq[offset], 0) & 0xFF);
-              target_color = view->palette[idx];
-              state = DISPLAY_STATE_NONE;
+      case 'D': view->cursor_y = min(view->cursor_y + 1, terminal->lines - 1); break;
+      case 'E': view->cursor_y = min(view->cursor_y + 1, terminal->lines - 1); view->cursor_x = 0; break;
+      case '(':
+        switch (seq[2]) {
+          case '0': view->charset = CHARSET_DEC; break;
+          case 'B': view->charset = CHARSET_US; break;
+          default: view->charset = CHARSET_OTHER; break;
+        }
+      break;
+      case '=': view->keypad_keys_mode = KEYS_MODE_APPLICATION; break;
+      case '>': view->keypad_keys_mode = KEYS_MODE_NORMAL; break;
+      case 'M':
+        if (view->cursor_y == 0) {
+          terminal_scroll_rect(terminal, 0, terminal->lines, 0, terminal->columns, -1);
+        } else {
+          --view->cursor_y;
+        }
+      break;
+      default: unhandled = 1; break;
+    }
+  }
+
+  if (unhandled) {
+    #ifdef LIBTERMINAL_DEBUG_ESCAPE
+      fprintf(stderr, "UNKNOWN ESCAPE SEQUENCE\n");
+    #endif
+    return -1;
+  }
+  return 0;
+}
+
+
+static terminal_escape_type_e get_terminal_escape_type(char a, int* fixed_width) {
+  switch (a) {
+    case '[': return ESCAPE_TYPE_CSI;
+    case ']': return ESCAPE_TYPE_OS;
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+      return ESCAPE_TYPE_DCS;
+    case 'D':
+    case 'E':
+    case 'H':
+    case 'M':
+    case 'Z':
+    case 'F':
+    case '>':
+    case '=':
+    case '7':
+    case '8':
+    case 'c':
+    case 'l':
+    case 'm':
+    case 'n':
+    case 'o':
+    case '|':
+    case '}':
+    case '~':
+      *fixed_width = 2;
+      return ESCAPE_TYPE_FIXED_WIDTH;
+    case ' ':
+    case '#':
+    case '%':
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+      *fixed_width = 3;
+      return ESCAPE_TYPE_FIXED_WIDTH;
+  }
+  return ESCAPE_TYPE_UNKNOWN;
+}
+
+// Sequences are kept in a buffer that grows as needed, up to a point; past that, we note that it's overflowed, and drop the rest.
+static void terminal_append_sequence(terminal_t* terminal, const char* data, int length) {
+  if (terminal->sequence_overflowed || terminal->sequence_length + length >= LIBTERMINAL_MAX_SEQUENCE_SIZE) {
+    terminal->sequence_overflowed = 1;
+    return;
+  }
+  if (terminal->sequence_length + length >= terminal->sequence_capacity) {
+    int capacity = max(terminal->sequence_capacity, 64);
+    while (capacity <= terminal->sequence_length + length)
+      capacity *= 2;
+    terminal->sequence_capacity = min(capacity, LIBTERMINAL_MAX_SEQUENCE_SIZE);
+    terminal->sequence = realloc(terminal->sequence, terminal->sequence_capacity);
+  }
+  memcpy(&terminal->sequence[terminal->sequence_length], data, length);
+  terminal->sequence_length += length;
+  terminal->sequence[terminal->sequence_length] = 0;
+}
+
+static void terminal_reset_sequence(terminal_t* terminal) {
+  terminal->sequence_length = 0;
+  terminal->sequence_overflowed = 0;
+  terminal->sequence_escaped = 0;
+  terminal->clipboard_streaming = 0;
+  if (terminal->sequence)
+    terminal->sequence[0] = 0;
+}
+
+static int base64_value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+static void terminal_decode_clipboard(terminal_t* terminal, const char* data, int length) {
+  for (int i = 0; i < length; ++i) {
+    int value = base64_value(data[i]);
+    if (value == -1)
+      continue;
+    terminal->clipboard_bits = (terminal->clipboard_bits << 6) | value;
+    terminal->clipboard_bit_count += 6;
+    if (terminal->clipboard_bit_count >= 8) {
+      terminal->clipboard_bit_count -= 8;
+      if (terminal->clipboard_length == LIBTERMINAL_MAX_CLIPBOARD_SIZE) {
+        terminal->clipboard_overflowed = 1;
+        continue;
+      }
+      if (terminal->clipboard_length == terminal->clipboard_capacity) {
+        terminal->clipboard_capacity = min(max(terminal->clipboard_capacity * 2, 256), LIBTERMINAL_MAX_CLIPBOARD_SIZE);
+        terminal->clipboard = realloc(terminal->clipboard, terminal->clipboard_capacity);
+      }
+      terminal->clipboard[terminal->clipboard_length++] = (terminal->clipboard_bits >> terminal->clipboard_bit_count) & 0xFF;
+    }
+  }
+}
+
+// Takes the payload of an OSC or DCS, in whatever pieces it arrives in. OSC 52 can be megabytes of base64; once we've seen which
+// selections it's for, the rest is decoded as it comes in, rather than buffered.
+static void terminal_string_payload(terminal_t* terminal, terminal_escape_type_e type, const char* data, int length) {
+  if (type == ESCAPE_TYPE_DCS)
+    return;
+  if (terminal->clipboard_streaming) {
+    terminal_decode_clipboard(terminal, data, length);
+    return;
+  }
+  int header_length = terminal->sequence_length;
+  terminal_append_sequence(terminal, data, length);
+  if (terminal->sequence_overflowed || terminal->sequence_length <= 5 || strncmp(terminal->sequence, "\x1B]52;", 5) != 0)
+    return;
+  // The selections are at most a few characters, so we only ever look a short way for the end of them.
+  const char* semicolon = memchr(&terminal->sequence[5], ';', min(terminal->sequence_length, 5 + (int)sizeof(terminal->clipboard_target)) - 5);
+  if (!semicolon)
+    return;
+  header_length = semicolon - terminal->sequence + 1;
+  terminal->clipboard_streaming = 1;
+  terminal->clipboard_ready = 0;
+  terminal->clipboard_length = 0;
+  terminal->clipboard_bits = 0;
+  terminal->clipboard_bit_count = 0;
+  terminal->clipboard_overflowed = 0;
+  snprintf(terminal->clipboard_target, sizeof(terminal->clipboard_target), "%.*s", header_length - 6, &terminal->sequence[5]);
+  terminal_decode_clipboard(terminal, &terminal->sequence[header_length], terminal->sequence_length - header_length);
+  terminal->sequence_length = header_length;
+  terminal->sequence[header_length] = 0;
+}
+
+static void terminal_end_string(terminal_t* terminal, terminal_escape_type_e type) {
+  if (type == ESCAPE_TYPE_OS) {
+    if (terminal->clipboard_streaming)
+      terminal->clipboard_ready = !terminal->clipboard_overflowed && terminal->clipboard_length > 0;
+    else if (!terminal->sequence_overflowed)
+      terminal_escape_sequence(terminal, type, terminal->sequence);
+  }
+  terminal_reset_sequence(terminal);
+}
+
+static int translate_charset(charset_e charset, int codepoint) {
+  if (charset == CHARSET_DEC) {
+    switch (codepoint) {
+      case 0x5F: codepoint = ' '; break;
+      case 0x60: codepoint = 0x25C6; break;
+      case 0x61: codepoint = 0x2592; break;
+      case 0x62: codepoint = '\t'; break;
+      case 0x63: codepoint = '\f'; break;
+      case 0x64: codepoint = '\r'; break;
+      case 0x65: codepoint = '\n'; break;
+      case 0x66: codepoint = 0xB0; break;
+      case 0x67: codepoint = 0xB1; break;
+      case 0x68: codepoint = '\n'; break;
+      case 0x69: codepoint = '\v'; break;
+      case 0x6A: codepoint = 0x2518; break;
+      case 0x6B: codepoint = 0x2510; break;
+      case 0x6C: codepoint = 0x250C; break;
+      case 0x6D: codepoint = 0x2514; break;
+      case 0x6E: codepoint = 0x253C; break;
+      case 0x70: codepoint = 0x23BB; break;
+      case 0x71: codepoint = 0x2500; break;
+      case 0x72: codepoint = 0x23BC; break;
+      case 0x73: codepoint = 0x23BD; break;
+      case 0x74: codepoint = 0x251C; break;
+      case 0x75: codepoint = 0x2524; break;
+      case 0x76: codepoint = 0x2534; break;
+      case 0x77: codepoint = 0x252C; break;
+      case 0x78: codepoint = 0x2502; break;
+      case 0x79: codepoint = 0x2264; break;
+      case 0x7A: codepoint = 0x2265; break;
+      case 0x7B: codepoint = 0x03C0; break;
+      case 0x7C: codepoint = 0x2260; break;
+      case 0x7D: codepoint = 0x00A3; break;
+      case 0x7E: codepoint = 0x00B7; break;
+    }
+  }
+  return codepoint;
+}
+
+static int terminal_is_spilling(terminal_t* terminal) {
+  #ifdef _WIN32
+    return 0;
+  #else
+    return terminal->spilling;
+  #endif
+}
+
+// Skipped lines can't be spilled, or matched against triggers, so we don't skip any if we'd need to do either.
+static int terminal_can_fast_forward(terminal_t* terminal) {
+  return terminal->current_view == VIEW_NORMAL_BUFFER && !terminal_is_spilling(terminal) && terminal->trigger_count == 0;
+}
+
+// How many lines a flood has to shift past before terminal_output starts skipping them; everything short of that is rendered.
+static int terminal_fast_forward_threshold(terminal_t* terminal) {
+  return terminal->scrollback_limit + terminal->lines + LIBTERMINAL_BACKBUFFER_PAGE_LINES * 2;
+}
+
+// Stands in for terminal_shift_buffer while fast-forwarding; nothing is written, so there's nothing to move. Once we've run out
+// of shifts to skip, whatever's on the screen is stale, and is blanked out.
+static void terminal_fast_forward(terminal_t* terminal, int remaining_shifts) {
+  terminal->line_id_base++;
+  if (remaining_shifts == 0) {
+    view_t* view = &terminal->views[terminal->current_view];
+    memset(view->buffer, 0, sizeof(buffer_char_t) * terminal->columns * terminal->lines);
+    memset(view->overflows, 0, sizeof(int) * terminal->lines);
+  }
+}
+
+// Counts the newlines in a block of output, and determines whether they're guaranteed to scroll the screen; they're not if there's
+// anything in there that could move the cursor upwards, change buffers or scroll regions. Returns -1 in that case.
+static int terminal_count_flood_lines(const char* str, int len) {
+  int newlines = 0;
+  for (int i = 0; i < len; ++i) {
+    if (str[i] == '\n')
+      ++newlines;
+    else if (str[i] == 0x1B && i < len - 1) {
+      switch (str[++i]) {
+        case '[': {
+          while (i < len - 1 && str[i+1] >= 0x20 && str[i+1] < 0x40)
+            ++i;
+          if (i < len - 1 && strchr("AFHfdrhluSTsv", str[++i]))
+            return -1;
+        } break;
+        case ']':
+        case 'P':
+          while (i < len - 1 && str[i+1] != '\a' && str[i+1] != 0x1B)
+            ++i;
+        break;
+        case 'M':
+        case '8':
+        case 'c':
+          return -1;
+      }
+    }
+  }
+  return newlines;
+}
+
+static int terminal_output(terminal_t* terminal, const char* str, int len) {
+  if (terminal->debug)  {
+    FILE* file = fopen("terminal.log", "ab");
+    if (file) {
+      fwrite(str, sizeof(char), len, file);
+      fclose(file);
+    }
+  }
+  unsigned int codepoint;
+  int total_shifts = 0;
+  int offset = 0;
+  view_t* view = &terminal->views[terminal->current_view];
+  view_t* probed_view = view;
+  unsigned int probed_generation = view->generation;
+  int probed_x = view->cursor_x, probed_y = view->cursor_y;
+  int fixed_width = -1;
+  terminal_escape_type_e escape_type = terminal->escape_type;
+  if (escape_type == ESCAPE_TYPE_FIXED_WIDTH)
+    get_terminal_escape_type(terminal->sequence[1], &fixed_width);
+  // If we're being flooded with more lines than we can possibly hold, there's no point in rendering the lines that'll be evicted
+  // before anyone can see them. We work out how many shifts are guaranteed to happen, and skip writing out anything that'll be
+  // evicted, with a margin for page granularity; we only track the cursor, and process escape sequences, through those.
+  int fast_forward_shifts = 0;
+  if (terminal_can_fast_forward(terminal) && (view->scrolling_region_start == -1 || view->scrolling_region_end == -1) && view->margin_left == -1 && escape_type == ESCAPE_TYPE_NONE) {
+    int newlines = terminal_count_flood_lines(str, len);
+    int guaranteed_shifts = newlines - (terminal->lines - 1 - view->cursor_y);
+    fast_forward_shifts = guaranteed_shifts - terminal_fast_forward_threshold(terminal);
+    if (newlines != -1 && fast_forward_shifts > 0)
+      terminal_clear_scrollback_buffer(terminal);
+    else
+      fast_forward_shifts = 0;
+  }
+  while (offset < len) {
+    if (escape_type == ESCAPE_TYPE_OS || escape_type == ESCAPE_TYPE_DCS) {
+      if (terminal->sequence_escaped) {
+        // Either the string terminator, or the start of another sequence, which ends the string all the same.
+        terminal_end_string(terminal, escape_type);
+        view->last_graphical_character = 0;
+        if (str[offset] == '\\') {
+          escape_type = ESCAPE_TYPE_NONE;
+          ++offset;
+        } else {
+          escape_type = ESCAPE_TYPE_OPEN;
+          terminal_append_sequence(terminal, "\x1B", 1);
+        }
+        continue;
+      }
+      // Strings can be long, so we find the end of each run of payload in one go, rather than going byte by byte.
+      int start = offset;
+      while (offset < len && str[offset] != 0x1B && (str[offset] != '\a' || escape_type != ESCAPE_TYPE_OS))
+        ++offset;
+      terminal_string_payload(terminal, escape_type, &str[start], offset - start);
+      if (offset < len) {
+        if (str[offset] == 0x1B)
+          terminal->sequence_escaped = 1;
+        else {
+          terminal_end_string(terminal, escape_type);
+          view->last_graphical_character = 0;
+          escape_type = ESCAPE_TYPE_NONE;
+        }
+        ++offset;
+      }
+    } else if (escape_type != ESCAPE_TYPE_NONE) {
+      if (str[offset] == 0x1B) {
+        // An escape in the middle of a sequence abandons it, and starts another.
+        terminal_reset_sequence(terminal);
+        terminal_append_sequence(terminal, "\x1B", 1);
+        escape_type = ESCAPE_TYPE_OPEN;
+        ++offset;
+        continue;
+      }
+      terminal_append_sequence(terminal, &str[offset], 1);
+      if (escape_type == ESCAPE_TYPE_OPEN)
+        escape_type = get_terminal_escape_type(str[offset], &fixed_width);
+      if (
+        (escape_type == ESCAPE_TYPE_CSI && (terminal->sequence_length > 2 || terminal->sequence_overflowed) && str[offset] >= 0x40 && str[offset] <= 0x7E) ||
+        (escape_type == ESCAPE_TYPE_FIXED_WIDTH && terminal->sequence_length == fixed_width) ||
+        escape_type == ESCAPE_TYPE_UNKNOWN
+      ) {
+        if (!terminal->sequence_overflowed)
+          terminal_escape_sequence(terminal, escape_type, terminal->sequence);
+        view->last_graphical_character = 0;
+        view = &terminal->views[terminal->current_view];
+        terminal_reset_sequence(terminal);
+        escape_type = ESCAPE_TYPE_NONE;
+      }
+      ++offset;
+    } else {
+      int end = (view->scrolling_region_end == -1 ? terminal->lines : view->scrolling_region_end);
+      offset += utf8_to_codepoint(&str[offset], &codepoint);
+      if (codepoint != '\e')
+        view->last_graphical_character = 0;
+      switch (codepoint) {
+        case 0x00:
+        case 0x01:
+        case 0x02:
+        case 0x03:
+        case 0x04:
+        case 0x05:
+        case 0x06:
+          break;
+        case 0x07:
+          terminal_queue_trigger_event(terminal, 0, terminal->line_id_base + view->cursor_y, NULL);
+        break;
+        case '\b': {
+          if (view->cursor_x)
+            --view->cursor_x;
+        } break;
+        case '\t': {
+          view->cursor_x = (view->cursor_x + view->tab_size) - ((view->cursor_x + view->tab_size) % view->tab_size);
+        } break;
+        case '\n': {
+          if (terminal->current_view == VIEW_NORMAL_BUFFER && fast_forward_shifts == 0)
+            terminal_line_completed(terminal);
+          // So that we can copy text blocks properly.
+          if (view->cursor_y < (end - 1))
+            ++view->cursor_y;
+          else {
+            if (fast_forward_shifts > 0)
+              terminal_fast_forward(terminal, --fast_forward_shifts);
+            else
+              terminal_shift_buffer(terminal);
+            ++total_shifts;
+          }
+        } break;
+        case 0x0B:
+        case 0x0C:
+        break;
+        case '\r': {
+          view->cursor_x = 0;
+        } break;
+        case 0x0E:
+        case 0x0F:
+        case 0x11:
+        case 0x12:
+        case 0x13:
+        case 0x14:
+        case 0x15:
+        case 0x16:
+        case 0x17:
+        case 0x18:
+        case 0x19:
+        case 0x1A:
+          break;
+        case 0x1B: { // escape
+          terminal_reset_sequence(terminal);
+          terminal_append_sequence(terminal, "\x1B", 1);
+          escape_type = ESCAPE_TYPE_OPEN;
+        } break;
+        case 0x1C:
+        case 0x1D:
+        case 0x1E:
+        case 0x1F:
+          break;
+        default: {
+          codepoint = translate_charset(view->charset, codepoint);
+          if (codepoint > 0x10FFFF)
+            codepoint = 0xFFFD;
+          int width = min(codepoint_width(codepoint), terminal->columns);
+          if (width == 0 || terminal_joins_previous(terminal, view)) {
+            if (fast_forward_shifts == 0)
+              terminal_join_codepoint(terminal, view, codepoint);
             break;
-            case DISPLAY_STATE_COLOR_VALUE_R: r = (parse_number(&seq[offset], 0) & 0xFF); state = DISPLAY_STATE_COLOR_VALUE_G; break;
-            case DISPLAY_STATE_COLOR_VALUE_G: g = (parse_number(&seq[offset], 0) & 0xFF); state = DISPLAY_STATE_COLOR_VALUE_B; break;
-            case DISPLAY_STATE_COLOR_VALUE_B: {
-              target_foreground = foreground;
-              b = parse_number(&seq[offset], 0) & 0xFF;
-              target_color = rgb_color(r, g, b);
-              state = DISPLAY_STATE_NONE;
-            } break;
           }
-          if (target_color.value != UNTARGETED_COLOR.value) {
-            if (view->cursor_styling_inversed)
-              target_foreground = !target_foreground;
-            if (target_foreground) {
-              uint8_t attributes = view->cursor_styling.foreground.attributes;
-              view->cursor_styling.foreground = target_color;
-              view->cursor_styling.foreground.attributes |= (attributes & ATTRIBUTE_STYLING_MASK);
-            } else
-              view->cursor_styling.background = target_color;
+          if (view->cursor_x + width > terminal->columns) {
+            // A wide character that doesn't fit on the end of the line goes on the next, leaving a blank behind.
+            if (view->cursor_x < terminal->columns && fast_forward_shifts == 0)
+              view->buffer[view->cursor_y * terminal->columns + view->cursor_x] = view_blank_cell(view);
+            view->overflows[view->cursor_y] = 1;
+            view->cursor_x = 0;
+            if (view->cursor_y < (end - 1))
+              ++view->cursor_y;
+            else {
+              if (fast_forward_shifts > 0)
+                terminal_fast_forward(terminal, --fast_forward_shifts);
+              else
+                terminal_shift_buffer(terminal);
+              ++total_shifts;
+            }
+          }
+          if (fast_forward_shifts == 0) {
+            buffer_char_t* cell = &view->buffer[view->cursor_y * terminal->columns + view->cursor_x];
+            // Overwriting either half of a wide character leaves nothing of it worth showing.
+            if (cell->codepoint == LIBTERMINAL_WIDE_CONTINUATION && view->cursor_x > 0 && cell[-1].codepoint != LIBTERMINAL_WIDE_CONTINUATION)
+              cell[-1].codepoint = ' ';
+            if (view->cursor_x + width < terminal->columns && cell[width].codepoint == LIBTERMINAL_WIDE_CONTINUATION)
+              cell[width].codepoint = ' ';
+            cell[0] = (buffer_char_t){ view->cursor_styling, codepoint };
+            if (width == 2)
+              cell[1] = (buffer_char_t){ view->cursor_styling, LIBTERMINAL_WIDE_CONTINUATION };
+            ++view->generation;
           }
-          char* next = strchr(&seq[offset], ';');
-          if (!next)
-            break;
-          offset = (next - seq) + 1;
+          view->last_graphical_character = codepoint;
+          view->cursor_x += width;
+        } break;
+      }
+    }
+  }
+  terminal->escape_type = escape_type;
+  if (terminal->latency_input && (view != probed_view || view->generation != probed_generation || view->cursor_x != probed_x || view->cursor_y != probed_y))
+    terminal_probe_echo(terminal);
+  return total_shifts;
+}
+
+#ifdef _WIN32
+  static DWORD windows_nonblocking_thread_callback(void* data) {
+    terminal_t* terminal = (terminal_t*)data;
+    char chunk_buffer[LIBTERMINAL_CHUNK_SIZE];
+    while (1) {
+      DWORD bytes_read;
+      if (sizeof(chunk_buffer) - terminal->nonblocking_buffer_length > 0 || terminal->closing) {
+        if (terminal->closing) {
+          while (1) {
+            if (!ReadFile(terminal->frompty, chunk_buffer, sizeof(chunk_buffer), &bytes_read, NULL) || bytes_read == 0)
+              break;
+          }
+          return 0;
         }
-        return 0;
-      } break;
-      case 'n': {
-        if (parse_number(&seq[2], 0) == 6) {
-          char buffer[8];
-          int length = snprintf(buffer, sizeof(buffer), "\x1B[%d;%d", view->cursor_y, view->cursor_x);
-          terminal_input(terminal, buffer, length);
-        } else
-          unhandled = 1;
-      } break;
-      case 'r': {
-        int semicolon = -1;
-        for (semicolon = 2; semicolon < seq_end && seq[semicolon] != ';'; ++semicolon);
-        view->cursor_x = 0;
-        view->cursor_y = 0;
-        if (seq[semicolon] == ';') {
-          view->scrolling_region_start = min(max(parse_number(&seq[2], 1) - 1, 0), terminal->lines - 1);
-          view->scrolling_region_end = min(max(parse_number(&seq[semicolon+1], 1), 0), terminal->lines);
+        if (!ReadFile(terminal->frompty, chunk_buffer, sizeof(chunk_buffer) - terminal->nonblocking_buffer_length, &bytes_read, NULL))
+          break;
+        if (bytes_read > 0) {
+          WaitForSingleObject(terminal->nonblocking_buffer_mutex, INFINITE);
+          memcpy(&terminal->nonblocking_buffer[terminal->nonblocking_buffer_length], chunk_buffer, bytes_read);
+          terminal->nonblocking_buffer_length += bytes_read;
+          ReleaseMutex(terminal->nonblocking_buffer_mutex);
         }
-      } break;
-      default: unhandled = 1; break;
+      }
+      Sleep(1);
+    }
+    return 0;
+  }
+#endif
+
+#ifndef _WIN32
+  typedef struct {
+    pid_t pid;
+    int pidfd;
+    double deadline;                                   // When we stop asking nicely.
+  } orphan_t;
+
+  static int sigchld_pipe[2] = { -1, -1 };           // Self-pipe written to on SIGCHLD; only set up if pidfds aren't available.
+  static struct sigaction sigchld_previous_action;
+  static orphan_t* orphans;                          // Shells of closed terminals that hadn't exited yet.
+  static int orphan_count, orphan_capacity;
+
+  static void sigchld_handler(int signal, siginfo_t* info, void* context) {
+    int saved_errno = errno;
+    if (write(sigchld_pipe[1], "", 1)) {}
+    errno = saved_errno;
+    if (sigchld_previous_action.sa_flags & SA_SIGINFO) {
+      if (sigchld_previous_action.sa_sigaction)
+        sigchld_previous_action.sa_sigaction(signal, info, context);
+    } else if (sigchld_previous_action.sa_handler != SIG_DFL && sigchld_previous_action.sa_handler != SIG_IGN)
+      sigchld_previous_action.sa_handler(signal);
+  }
+
+  // Gets a descriptor that becomes readable when the process exits. Where that isn't supported, we fall back to a SIGCHLD
+  // self-pipe, shared by all terminals, which is set up the first time it's needed.
+  static int terminal_open_pidfd(pid_t pid) {
+    #ifdef SYS_pidfd_open
+      int pidfd = syscall(SYS_pidfd_open, pid, 0);
+      if (pidfd != -1)
+        return pidfd;
+    #endif
+    if (sigchld_pipe[0] == -1 && pipe(sigchld_pipe) == 0) {
+      for (int i = 0; i < 2; ++i) {
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(sigchld_pipe[i], F_SETFL, fcntl(sigchld_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+      }
+      struct sigaction action = {0};
+      action.sa_sigaction = sigchld_handler;
+      action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGCHLD, &action, &sigchld_previous_action);
+    }
+    return -1;
+  }
+
+  // Reaps the shell if it has exited, caching its status. Returns true if it has.
+  static int terminal_reap(terminal_t* terminal) {
+    if (!terminal->exited && terminal->pid && waitpid(terminal->pid, &terminal->exit_status, WNOHANG) > 0) {
+      terminal->exited = 1;
+      terminal->pid = 0;
+      if (terminal->pidfd != -1) {
+        close(terminal->pidfd);
+        terminal->pidfd = -1;
+      }
+    }
+    return terminal->exited;
+  }
+
+  // Reaps whatever orphans have exited, and kills the ones that have outstayed their welcome. Returns how many are left.
+  static int terminal_reap_orphans() {
+    double now = terminal_get_time();
+    for (int i = 0; i < orphan_count; ++i) {
+      int status;
+      if (waitpid(orphans[i].pid, &status, WNOHANG) != 0) {
+        if (orphans[i].pidfd != -1)
+          close(orphans[i].pidfd);
+        orphans[i--] = orphans[--orphan_count];
+      } else if (orphans[i].deadline && now >= orphans[i].deadline) {
+        kill(orphans[i].pid, SIGKILL);
+        orphans[i].deadline = 0;
+      }
+    }
+    return orphan_count;
+  }
+
+  // Whatever's still around when we exit doesn't get the rest of its grace period.
+  static void terminal_kill_orphans() {
+    for (int i = 0; i < orphan_count; ++i)
+      kill(orphans[i].pid, SIGKILL);
+  }
+
+  static void terminal_orphan(terminal_t* terminal) {
+    if (!orphans)
+      atexit(terminal_kill_orphans);
+    if (orphan_count == orphan_capacity) {
+      orphan_capacity = orphan_capacity ? orphan_capacity * 2 : 8;
+      orphans = realloc(orphans, sizeof(orphan_t) * orphan_capacity);
+    }
+    orphans[orphan_count++] = (orphan_t){ terminal->pid, terminal->pidfd, terminal_get_time() + LIBTERMINAL_ORPHAN_GRACE };
+    terminal->pid = 0;
+    terminal->pidfd = -1;
+  }
+#endif
+
+// Informs the pty of our current size. This causes the shell (or whatever is running) to get a SIGWINCH, and generally redraw everything,
+// so we only want to do this once things have settled.
+static void terminal_send_size(terminal_t* terminal) {
+  terminal->resize_pending = 0;
+  if (terminal->mode == MODE_REMOTE) {
+    int32_t size[2] = { terminal->columns, terminal->lines };
+    terminal_queue_remote_frame(terminal, REMOTE_FRAME_RESIZE, size, sizeof(size));
+    terminal_flush_input(terminal);
+  } else if (terminal->mode == MODE_PTY) {
+    #ifdef _WIN32
+      COORD size = { terminal->columns, terminal->lines };
+      ResizePseudoConsole(terminal->hpcon, size);
+    #else
+      struct winsize size = { .ws_row = terminal->lines, .ws_col = terminal->columns, .ws_xpixel = 0, .ws_ypixel = 0 };
+      ioctl(terminal->master, TIOCSWINSZ, &size);
+    #endif
+  }
+}
+
+static int terminal_update_remote(terminal_t* terminal, void (*callback)(char*, int, void*), void* data, int* total_shifts);
+static int terminal_update(terminal_t* terminal, void (*callback)(char*, int, void*), void* data, int* total_shifts) {
+  if (terminal->mode == MODE_DUMMY)
+    return 0;
+  #ifndef _WIN32
+    if (terminal->mode == MODE_FILE)
+      return terminal_update_file(terminal);
+  #endif
+  if (terminal->resize_pending && terminal_get_time() >= terminal->resize_deadline)
+    terminal_send_size(terminal);
+  terminal_queue_mouse_motion(terminal);
+  if (terminal->input_queue_length > 0)
+    terminal_flush_input(terminal);
+  #ifndef _WIN32
+    if (terminal->mode == MODE_REMOTE)
+      return terminal_update_remote(terminal, callback, data, total_shifts);
+  #endif
+  int len;
+  #ifdef _WIN32
+    int at_least_one = 0;
+    WaitForSingleObject(terminal->nonblocking_buffer_mutex, INFINITE);
+    if (terminal->nonblocking_buffer_length > 0) {
+      *total_shifts += terminal_output(terminal, terminal->nonblocking_buffer, terminal->nonblocking_buffer_length);
+      if (callback)
+        callback(terminal->nonblocking_buffer, terminal->nonblocking_buffer_length, data);
+      at_least_one = 1;
+    }
+    terminal->nonblocking_buffer_length = 0;
+    ReleaseMutex(terminal->nonblocking_buffer_mutex);
+    return at_least_one;
+  #else
+    // The pty and the shell's exit are watched together; if neither has anything for us, there's nothing to do.
+    struct pollfd fds[2] = { { terminal->master, POLLIN, 0 }, { terminal->pidfd != -1 ? terminal->pidfd : sigchld_pipe[0], POLLIN, 0 } };
+    int exit_watched = !terminal->exited && fds[1].fd != -1;
+    if (poll(fds, exit_watched ? 2 : 1, 0) > 0 && exit_watched && fds[1].revents) {
+      if (terminal->pidfd == -1) {
+        // SIGCHLD doesn't say whose child exited, so everyone gets a look.
+        char discard[64];
+        while (read(sigchld_pipe[0], discard, sizeof(discard)) > 0);
+        for (terminal_t* other = terminals; other; other = other->next)
+          terminal_reap(other);
+      }
+      terminal_reap(terminal);
+    }
+    if (orphan_count > 0)
+      terminal_reap_orphans();
+    if (!fds[0].revents)
+      return 0;
+    // We read everything available up to our budget, so that terminal_output sees it all at once. If we're being flooded with
+    // more lines than we'd keep, we keep going; terminal_output fast-forwards through anything that'd be evicted immediately, so
+    // it's cheap. Anything else would be parsed in full, so stays within the budget.
+    char drain[LIBTERMINAL_CHUNK_SIZE * LIBTERMINAL_MAX_CHUNKS_PROCESSED];
+    char* buffer = drain;
+    int length = 0, capacity = sizeof(drain), status = 0, newlines = 0;
+    while (1) {
+      len = read(terminal->master, &buffer[length], capacity - length);
+      if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+          status = -1;
+        break;
+      }
+      if (newlines != -1) {
+        int chunk_newlines = terminal_count_flood_lines(&buffer[length], len);
+        newlines = chunk_newlines == -1 ? -1 : newlines + chunk_newlines;
+      }
+      length += len;
+      if (length == capacity) {
+        if (newlines <= terminal_fast_forward_threshold(terminal) || capacity >= LIBTERMINAL_MAX_FLOOD_SIZE || !terminal_can_fast_forward(terminal))
+          break;
+        capacity *= 2;
+        if (buffer == drain) {
+          buffer = malloc(capacity);
+          memcpy(buffer, drain, length);
+        } else
+          buffer = realloc(buffer, capacity);
+      }
+    }
+    if (length > 0) {
+      *total_shifts += terminal_output(terminal, buffer, length);
+      if (callback)
+        callback(buffer, length, data);
+    }
+    if (buffer != drain)
+      free(buffer);
+    return status ? status : length > 0;
+  #endif
+}
+
+static int terminal_close(terminal_t* terminal) {
+  terminal_clear_scrollback_buffer(terminal);
+  free(terminal->input_queue);
+  terminal->input_queue = NULL;
+  free(terminal->commands);
+  terminal->commands = NULL;
+  terminal->command_count = terminal->command_capacity = 0;
+  free(terminal->links);
+  terminal->links = NULL;
+  terminal->link_count = terminal->link_capacity = 0;
+  for (int i = 0; i < terminal->trigger_count; ++i)
+    free(terminal->triggers[i].pattern);
+  free(terminal->triggers);
+  terminal->triggers = NULL;
+  terminal->trigger_count = 0;
+  for (int i = 0; i < terminal->trigger_event_count; ++i)
+    free(terminal->trigger_events[i].text);
+  free(terminal->trigger_events);
+  terminal->trigger_events = NULL;
+  terminal->trigger_event_count = 0;
+  free(terminal->frame);
+  free(terminal->frame_overflows);
+  terminal->frame = NULL;
+  terminal->frame_overflows = NULL;
+  terminal->synchronized_deadline = 0;
+  free(terminal->sequence);
+  free(terminal->clipboard);
+  terminal->sequence = NULL;
+  terminal->clipboard = NULL;
+  terminal->sequence_length = terminal->sequence_capacity = terminal->clipboard_length = terminal->clipboard_capacity = 0;
+  free(terminal->clusters);
+  free(terminal->cluster_table);
+  terminal->clusters = NULL;
+  terminal->cluster_table = NULL;
+  terminal->cluster_count = terminal->cluster_capacity = terminal->cluster_table_capacity = 0;
+  terminal->input_queue_offset = terminal->input_queue_length = terminal->input_queue_capacity = 0;
+  terminal->mouse_x = terminal->mouse_y = -1;
+  for (int i = 0; i < VIEW_MAX; ++i)
+    terminal_free_view(&terminal->views[i]);
+  #ifndef _WIN32
+    if (terminal->spilling) {
+      close(terminal->spill_fd);
+      terminal->spilling = 0;
+    }
+  #endif
+  if (terminal->mode == MODE_PTY) {
+    #if _WIN32
+      // This has to be first, because if we don't drain the buffer in our nonblocking_thread,
+      // this call can hang. (SIGH).
+      terminal->closing = 1;
+      if (terminal->hpcon) {
+        ClosePseudoConsole(terminal->hpcon);
+        terminal->hpcon = NULL;
+      }
+      if (terminal->nonblocking_thread) {
+        TerminateThread(terminal->nonblocking_thread, 0);
+        terminal->nonblocking_thread = NULL;
+      }
+      if (terminal->topty) {
+        CloseHandle(terminal->topty);
+        terminal->topty = NULL;
+      }
+      if (terminal->frompty) {
+        CloseHandle(terminal->frompty);
+        terminal->frompty = NULL;
+      }
+      if (terminal->nonblocking_buffer_mutex) {
+        CloseHandle(terminal->nonblocking_buffer_mutex);
+        terminal->nonblocking_buffer_mutex = NULL;
+      }
+      if (terminal->process_information.hProcess) {
+        TerminateProcess(terminal->process_information.hProcess, 1);
+        terminal->process_information.hProcess = NULL;
+      }
+    #else
+      if (terminal->master) {
+        close(terminal->master);
+        terminal->master = 0;
+        if (terminal->pid)
+          kill(terminal->pid, SIGHUP);
+      }
+      // If the shell doesn't exit right away, we keep an eye on it, and make sure it goes eventually.
+      if (terminal->pid && !terminal_reap(terminal))
+        terminal_orphan(terminal);
+      if (terminal->pidfd != -1) {
+        close(terminal->pidfd);
+        terminal->pidfd = -1;
+      }
+    #endif
+  }
+  #ifndef _WIN32
+    // The session carries on in the daemon without us.
+    if (terminal->mode == MODE_REMOTE && terminal->master) {
+      close(terminal->master);
+      terminal->master = 0;
+    }
+    free(terminal->remote_buffer);
+    terminal->remote_buffer = NULL;
+    terminal->remote_length = terminal->remote_capacity = 0;
+    if (terminal->file)
+      terminal_close_file(terminal);
+  #endif
+  return 0;
+}
+
+static void terminal_free(terminal_t* terminal) {
+  terminal_close(terminal);
+  if (terminal->prev)
+    terminal->prev->next = terminal->next;
+  else if (terminals == terminal)
+    terminals = terminal->next;
+  if (terminal->next)
+    terminal->next->prev = terminal->prev;
+  free(terminal);
+}
+
+// Lays out the existing buffer for a view in place, if we have the capacity for it. Rows are moved forwards when shrinking columns,
+// and backwards when growing, so that we never overwrite a row we haven't moved yet.
+static void terminal_relayout_view(view_t* view, int old_columns, int old_lines, int columns, int lines) {
+  int kept_lines = min(old_lines, lines);
+  if (columns <= old_columns) {
+    for (int y = 0; y < kept_lines; ++y)
+      memmove(&view->buffer[y*columns], &view->buffer[y*old_columns], columns*sizeof(buffer_char_t));
+  } else {
+    for (int y = kept_lines - 1; y >= 0; --y) {
+      memmove(&view->buffer[y*columns], &view->buffer[y*old_columns], old_columns*sizeof(buffer_char_t));
+      memset(&view->buffer[y*columns + old_columns], 0, (columns - old_columns)*sizeof(buffer_char_t));
+    }
+  }
+  memset(&view->buffer[kept_lines*columns], 0, (lines - kept_lines)*columns*sizeof(buffer_char_t));
+  memset(&view->overflows[kept_lines], 0, (lines - kept_lines)*sizeof(int));
+}
+
+static void terminal_resize(terminal_t* terminal, int columns, int lines) {
+  if (terminal->columns == columns && terminal->lines == lines)
+    return;
+  for (int i = 0; i < VIEW_MAX; ++i) {
+    view_t* view = &terminal->views[i];
+    if (i == VIEW_ALTERNATE_BUFFER && !view->buffer)
+      continue;
+    if (view->buffer && lines < terminal->lines && i == VIEW_NORMAL_BUFFER) {
+      for (int j = 0; j < max(0, (view->cursor_y+1) - lines); ++j)
+        terminal_shift_buffer(terminal);
+    }
+    if (view->buffer && columns * lines <= view->buffer_capacity && lines <= view->overflows_capacity) {
+      terminal_relayout_view(view, terminal->columns, terminal->lines, columns, lines);
+    } else {
+      buffer_char_t* buffer = calloc(sizeof(buffer_char_t), columns * lines);
+      int* overflows = calloc(sizeof(int), lines);
+      if (view->buffer) {
+        int max_lines = min(terminal->lines, lines);
+        for (int y = 0; y < max_lines; ++y)
+          memcpy(&buffer[y*columns], &view->buffer[y*terminal->columns], min(terminal->columns, columns)*sizeof(buffer_char_t));
+        memcpy(overflows, view->overflows, max_lines*sizeof(int));
+        free(view->buffer);
+        free(view->overflows);
+      }
+      view->buffer = buffer;
+      view->overflows = overflows;
+      view->buffer_capacity = columns * lines;
+      view->overflows_capacity = lines;
+    }
+    view->cursor_x = min(view->cursor_x, columns - 1);
+    view->cursor_y = min(view->cursor_y, lines - 1);
+    if (view->scrolling_region_end != -1 || view->scrolling_region_end != -1) {
+      view->scrolling_region_start = min(view->scrolling_region_start, lines - 1);
+      view->scrolling_region_end = min(view->scrolling_region_end, lines);
+    }
+    if (view->margin_left != -1) {
+      view->margin_left = min(view->margin_left, columns - 1);
+      view->margin_right = min(view->margin_right, columns);
+    }
+  }
+  int initial = terminal->columns == 0;
+  terminal->columns = columns;
+  terminal->lines = lines;
+  // Rather than sending a resize to the pty for every step of a drag, we wait until it's settled; terminal_update will send it along.
+  terminal->resize_pending = 1;
+  terminal->resize_deadline = terminal_get_time() + LIBTERMINAL_RESIZE_DEBOUNCE;
+  if (initial)
+    terminal_send_size(terminal);
+  // The frame we were holding onto no longer fits; the application will redraw for the new size anyway.
+  terminal_end_synchronized(terminal);
+  #ifndef _WIN32
+    if (terminal->file) {
+      terminal_layout_file(terminal);
+      terminal_draw_file(terminal);
+    }
+  #endif
+}
+
+// Sizes the terminal to the smallest size any of its viewports is asking for, so that every view can show the whole screen.
+// Viewports that don't mind, like a collapsed drawer, are left out; if none mind, we stay as we are.
+static void terminal_fit_viewports(terminal_t* terminal) {
+  int columns = 0, lines = 0;
+  for (viewport_t* viewport = terminal->viewports; viewport; viewport = viewport->next) {
+    if (viewport->columns > 0 && viewport->lines > 0) {
+      columns = columns > 0 ? min(columns, viewport->columns) : viewport->columns;
+      lines = lines > 0 ? min(lines, viewport->lines) : viewport->lines;
+    }
+  }
+  if (columns > 0 && lines > 0)
+    terminal_resize(terminal, columns, lines);
+}
+
+static viewport_t* terminal_attach(terminal_t* terminal, int columns, int lines) {
+  viewport_t* viewport = calloc(1, sizeof(viewport_t));
+  if (!viewport)
+    return NULL;
+  viewport->columns = columns;
+  viewport->lines = lines;
+  viewport->next = terminal->viewports;
+  terminal->viewports = viewport;
+  terminal_fit_viewports(terminal);
+  return viewport;
+}
+
+static void terminal_detach(terminal_t* terminal, viewport_t* viewport) {
+  for (viewport_t** link = &terminal->viewports; *link; link = &(*link)->next) {
+    if (*link == viewport) {
+      *link = viewport->next;
+      free(viewport);
+      break;
+    }
+  }
+  terminal_fit_viewports(terminal);
+}
+
+// Gives back any memory we're holding onto that we don't strictly need; called on terminals that haven't been looked at in a while.
+// Buffers that have grown from resizing are shrunk back down, and the partially filled scrollback page is cut down to what it holds.
+// Returns the amount of bytes freed.
+static size_t terminal_trim(terminal_t* terminal) {
+  size_t freed = 0;
+  for (int i = 0; i < VIEW_MAX; ++i) {
+    view_t* view = &terminal->views[i];
+    if (view->buffer && (view->buffer_capacity > terminal->columns * terminal->lines || view->overflows_capacity > terminal->lines)) {
+      freed += (view->buffer_capacity - terminal->columns * terminal->lines) * sizeof(buffer_char_t) + (view->overflows_capacity - terminal->lines) * sizeof(int);
+      view->buffer = realloc(view->buffer, sizeof(buffer_char_t) * terminal->columns * terminal->lines);
+      view->overflows = realloc(view->overflows, sizeof(int) * terminal->lines);
+      view->buffer_capacity = terminal->columns * terminal->lines;
+      view->overflows_capacity = terminal->lines;
+    }
+  }
+  if (terminal->frame && !terminal_is_synchronized(terminal)) {
+    freed += (sizeof(buffer_char_t) * terminal->columns + sizeof(int)) * terminal->lines;
+    free(terminal->frame);
+    free(terminal->frame_overflows);
+    terminal->frame = NULL;
+    terminal->frame_overflows = NULL;
+  }
+  backbuffer_page_t* page = terminal->scrollback_buffer_start;
+  if (page && page->line < page->lines) {
+    if (page->line == 0) {
+      terminal->scrollback_buffer_start = page->prev;
+      if (page->prev)
+        page->prev->next = NULL;
+      else
+        terminal->scrollback_buffer_end = NULL;
+      if (terminal->scrollback_resident_end == page)
+        terminal->scrollback_resident_end = NULL;
+      terminal_forget_scrollback_page(terminal, page);
+      freed += backbuffer_page_size(page->columns, page->lines);
+      terminal_account_scrollback(terminal, -(long long)backbuffer_page_size(page->columns, page->lines));
+      free(page);
+    } else {
+      memmove(&page->buffer[page->line * page->columns], backbuffer_page_overflows(page), page->line * sizeof(int));
+      size_t trimmed_bytes = backbuffer_page_size(page->columns, page->lines) - backbuffer_page_size(page->columns, page->line);
+      freed += trimmed_bytes;
+      terminal_account_scrollback(terminal, -(long long)trimmed_bytes);
+      page->lines = page->line;
+      backbuffer_page_t* trimmed = malloc(backbuffer_page_size(page->columns, page->lines));
+      memcpy(trimmed, page, backbuffer_page_size(page->columns, page->lines));
+      trimmed->buffer = (buffer_char_t*)(trimmed + 1);
+      terminal_relink_scrollback_page(terminal, page, trimmed);
+      free(page);
+    }
+  }
+  return freed;
+}
+
+static char error_step[64];
+static int set_error_step(const char* step) { strncpy(error_step, step, sizeof(error_step)); return 1; }
+#if _WIN32
+  long long last_error_code;
+  static const char* terminal_get_last_error() {
+    static char error_buffer[2048];
+    strcpy(error_buffer, error_step);
+    int len = strlen(error_buffer);
+    error_buffer[len++] = ':';
+    error_buffer[len++] = ' ';
+    FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, last_error_code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&error_buffer[len], sizeof(error_buffer) - (len + 1), NULL);
+    return error_buffer;
+  }
+#else
+  // TODO, non-windows error handling, but less important because windows will be failing lots more, 'cause it's shit.
+  static const char* terminal_get_last_error() { return error_step; }
+#endif
+
+#ifndef _WIN32
+  static int environment_key_matches(const char* variable, const char* key) {
+    size_t length = strlen(key);
+    return strncmp(variable, key, length) == 0 && variable[length] == '=';
+  }
+
+  // Builds the environment for a shell in a single allocation, in the parent; ours, with TERM and then the requested variables
+  // taking precedence, in that order.
+  static char** terminal_build_environment(const char* term_env, const char** environment) {
+    const char* overrides[258] = { "TERM", term_env };
+    int override_count = 2;
+    for (int i = 0; i < 256 && environment[i]; i += 2) {
+      overrides[override_count++] = environment[i];
+      overrides[override_count++] = environment[i+1];
     }
-  } else if (type == ESCAPE_TYPE_OS) {
-    switch (seq[2]) {
-      case '0':
-        if (strlen(seq) >= 5 && seq[3] == ';')
-          strncpy(terminal->name, &seq[4], min(sizeof(terminal->name) - 1, strlen(seq) - 4));
-      break;
-      case '4': {
-        int idx, r,g,b;
-        if (sscanf(&seq[3], ";%d;rgb:%x/%x/%x", &idx, &r, &g, &b) == 4) {
-          view->palette[idx] = rgb_color(r, g, b);
-        } else
-          unhandled = 1;
-      } break;
-      default: unhandled = 1; break;
+    // Only the last override of any given variable counts.
+    for (int i = 0; i < override_count; i += 2) {
+      for (int j = i + 2; j < override_count && overrides[i]; j += 2) {
+        if (strcmp(overrides[i], overrides[j]) == 0)
+          overrides[i] = NULL;
+      }
     }
-  } else if (type == ESCAPE_TYPE_FIXED_WIDTH) {
-    switch (seq[1]) {
-      case '#': { // Put in, to satisfy vttest.
-        switch (seq[2]) {
-          case '8':
-            for (int y = 0; y < terminal->lines; ++y) {
-              for (int x = 0; x < terminal->columns; ++x)
-                view->buffer[y * terminal->columns + x] = (buffer_char_t){ view->cursor_styling, 'E' };
-            }
-          break;
-          default: unhandled = 1; break;
+    int count = 0;
+    size_t size = 0;
+    for (char** variable = environ; *variable; ++variable) {
+      int overridden = 0;
+      for (int i = 0; i < override_count && !overridden; i += 2)
+        overridden = overrides[i] && environment_key_matches(*variable, overrides[i]);
+      if (!overridden) {
+        ++count;
+        size += strlen(*variable) + 1;
+      }
+    }
+    for (int i = 0; i < override_count; i += 2) {
+      if (overrides[i]) {
+        ++count;
+        size += strlen(overrides[i]) + strlen(overrides[i+1]) + 2;
+      }
+    }
+    char** envp = malloc(sizeof(char*) * (count + 1) + size);
+    char* strings = (char*)&envp[count + 1];
+    count = 0;
+    for (char** variable = environ; *variable; ++variable) {
+      int overridden = 0;
+      for (int i = 0; i < override_count && !overridden; i += 2)
+        overridden = overrides[i] && environment_key_matches(*variable, overrides[i]);
+      if (!overridden) {
+        envp[count++] = strcpy(strings, *variable);
+        strings += strlen(strings) + 1;
+      }
+    }
+    for (int i = 0; i < override_count; i += 2) {
+      if (overrides[i]) {
+        envp[count++] = strings;
+        strings += sprintf(strings, "%s=%s", overrides[i], overrides[i+1]) + 1;
+      }
+    }
+    envp[count] = NULL;
+    return envp;
+  }
+#endif
+
+static terminal_t* terminal_new(int columns, int lines, int scrollback_limit, const char* term_env, const char* pathname, const char** argv, const char** environment) {
+  terminal_t* terminal = calloc(sizeof(terminal_t), 1);
+  for (int i = 0; i < VIEW_MAX; ++i) {
+    for (int j = 0; j < 256; ++j)
+      terminal->views[i].palette[j] = indexed_color(j);
+    terminal->views[i].scrolling_region_end = -1;
+    terminal->views[i].scrolling_region_start = -1;
+    terminal->views[i].margin_left = -1;
+    terminal->views[i].margin_right = -1;
+    terminal->views[i].cursor_styling = LIBTERMINAL_NO_STYLING;
+    terminal->views[i].tab_size = LIBTERMINAL_DEFAULT_TAB_SIZE;
+  }
+  terminal->scrollback_limit = scrollback_limit;
+  #ifndef _WIN32
+    terminal->pidfd = -1;
+  #endif
+  terminal->mode = pathname && strcmp(pathname, "DUMMY") != 0 ? MODE_PTY : MODE_DUMMY;
+  if (terminal->mode == MODE_PTY) {
+    #ifdef _WIN32
+      last_error_code = 0;
+      HRESULT result = S_OK;
+      SECURITY_ATTRIBUTES no_sec = { .nLength = sizeof(SECURITY_ATTRIBUTES), .bInheritHandle = TRUE, .lpSecurityDescriptor = NULL };
+      HANDLE out_pipe_pseudo_console_side, in_pipe_pseudo_console_side;
+      COORD size = { columns, lines };
+      if ((!CreatePipe(&in_pipe_pseudo_console_side, &terminal->topty, &no_sec, 0) || !CreatePipe(&terminal->frompty, &out_pipe_pseudo_console_side, &no_sec, 0)) && set_error_step("create pipes"))
+        goto error;
+      result = CreatePseudoConsole(size, in_pipe_pseudo_console_side, out_pipe_pseudo_console_side, 0, &terminal->hpcon);
+      if (FAILED(result) && set_error_step("create pseudoconsole"))
+        goto error;
+      terminal->nonblocking_buffer_mutex = CreateMutex(NULL, FALSE, NULL);
+      if (!terminal->nonblocking_buffer_mutex && set_error_step("create mutex"))
+        goto error;
+
+      HANDLE handles_to_inherit[] = { in_pipe_pseudo_console_side, out_pipe_pseudo_console_side };
+      STARTUPINFOEXW si_ex = {0};
+      si_ex.StartupInfo.cb = sizeof(STARTUPINFOEXW);
+      si_ex.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+      si_ex.StartupInfo.hStdInput = NULL;
+      si_ex.StartupInfo.hStdOutput = NULL;
+      si_ex.StartupInfo.hStdError = NULL;
+      size_t list_size;
+      // Create the appropriately sized thread attribute list
+      InitializeProcThreadAttributeList(NULL, 2, 0, &list_size);
+      si_ex.lpAttributeList = (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(list_size);
+      BOOL success = InitializeProcThreadAttributeList(si_ex.lpAttributeList, 2, 0, (PSIZE_T)&list_size) &&
+        UpdateProcThreadAttribute(si_ex.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE, terminal->hpcon, sizeof(HPCON), NULL, NULL);
+        UpdateProcThreadAttribute(si_ex.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, handles_to_inherit, sizeof(handles_to_inherit), NULL, NULL);
+      if (!success && set_error_step("update proc attribute list")) {
+        DeleteProcThreadAttributeList(si_ex.lpAttributeList);
+        free(si_ex.lpAttributeList);
+        goto error;
+      }
+
+      int len = MultiByteToWideChar(CP_UTF8, 0, pathname, -1, NULL, 0);
+      wchar_t* commandline = malloc(sizeof(wchar_t)*(len+1));
+      len = MultiByteToWideChar(CP_UTF8, 0, pathname, -1, commandline, len);
+      success = CreateProcessW(NULL, commandline, NULL, NULL, TRUE, EXTENDED_STARTUPINFO_PRESENT | CREATE_UNICODE_ENVIRONMENT, (void*)environment[0], NULL, &si_ex.StartupInfo, &terminal->process_information);
+      DeleteProcThreadAttributeList(si_ex.lpAttributeList);
+      free(si_ex.lpAttributeList);
+      free(commandline);
+      if (!success && set_error_step("create process"))
+        goto error;
+      terminal->nonblocking_thread = CreateThread(NULL, 0, windows_nonblocking_thread_callback, terminal, 0, NULL);
+      if (!terminal->nonblocking_thread && set_error_step("create thread"))
+        goto error;
+      error:
+      if (!terminal->nonblocking_thread) {
+        last_error_code = FAILED(result) ? HRESULT_CODE(result) : GetLastError();
+        terminal_close(terminal);
+        free(terminal);
+        return NULL;
+      }
+    #else
+      struct termios term = {0};
+      term.c_cc[VINTR] = 3;
+      term.c_cc[VSTART] = '\x13';
+      term.c_cc[VSTOP] = '\x11';
+      term.c_cc[VSUSP] = 26;
+      term.c_cc[VERASE] = '\x7F';
+      term.c_cc[VEOL] = 0;
+      term.c_cc[VEOF] = 4;
+      term.c_lflag |= ISIG | ECHO | ICANON | IEXTEN | ECHOE | ECHOK | ECHOCTL | ECHOKE;
+      term.c_cflag |= CS8 | CREAD;
+      term.c_iflag |= IUTF8 | ICRNL | IXON;
+      term.c_oflag |= OPOST | ONLCR | NL0 | CR0 | TAB0 | BS0 | VT0 | FF0;
+      struct winsize size = { .ws_row = lines, .ws_col = columns, .ws_xpixel = 0, .ws_ypixel = 0 };
+      char** envp = terminal_build_environment(term_env, environment);
+      #ifdef LIBTERMINAL_POSIX_SPAWN
+        int slave;
+        char slave_name[256];
+        if (openpty(&terminal->master, &slave, NULL, &term, &size) == -1 && set_error_step("openpty")) {
+          free(envp);
+          free(terminal);
+          return NULL;
         }
-      } break;
-      case 'D': view->cursor_y = min(view->cursor_y + 1, terminal->lines - 1); break;
-      case 'E': view->cursor_y = min(view->cursor_y + 1, terminal->lines - 1); view->cursor_x = 0; break;
-      case '(':
-        switch (seq[2]) {
-          case '0': view->charset = CHARSET_DEC; break;
-          case 'B': view->charset = CHARSET_US; break;
-          default: view->charset = CHARSET_OTHER; break;
+        fcntl(terminal->master, F_SETFD, FD_CLOEXEC);
+        fcntl(slave, F_SETFD, FD_CLOEXEC);
+        int error = ttyname_r(slave, slave_name, sizeof(slave_name));
+        if (!error) {
+          // The slave has to be opened, rather than duplicated, in the child, for it to become the controlling terminal.
+          posix_spawn_file_actions_t actions;
+          posix_spawnattr_t attributes;
+          sigset_t signals;
+          posix_spawn_file_actions_init(&actions);
+          posix_spawn_file_actions_addopen(&actions, 0, slave_name, O_RDWR, 0);
+          posix_spawn_file_actions_adddup2(&actions, 0, 1);
+          posix_spawn_file_actions_adddup2(&actions, 0, 2);
+          posix_spawnattr_init(&attributes);
+          posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+          sigemptyset(&signals);
+          posix_spawnattr_setsigmask(&attributes, &signals);
+          int defaulted_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGPIPE, SIGALRM, SIGTERM, SIGCHLD, SIGTSTP, SIGTTIN, SIGTTOU, SIGUSR1, SIGUSR2 };
+          for (size_t i = 0; i < sizeof(defaulted_signals) / sizeof(int); ++i)
+            sigaddset(&signals, defaulted_signals[i]);
+          posix_spawnattr_setsigdefault(&attributes, &signals);
+          error = posix_spawnp(&terminal->pid, pathname, &actions, &attributes, (char* const*)argv, envp);
+          posix_spawnattr_destroy(&attributes);
+          posix_spawn_file_actions_destroy(&actions);
         }
-      break;
-      case '=': view->keypad_keys_mode = KEYS_MODE_APPLICATION; break;
-      case '>': view->keypad_keys_mode = KEYS_MODE_NORMAL; break;
-      case 'M':
-        if (view->cursor_y == 0) {
-          memmove(&view->buffer[terminal->columns], &view->buffer[0], sizeof(buffer_char_t)*terminal->columns*(terminal->lines-1));
-          memset(&view->buffer[0], 0, sizeof(buffer_char_t)*terminal->columns);
-        } else {
-          --view->cursor_y;
+        close(slave);
+        free(envp);
+        if (error && set_error_step("posix_spawn")) {
+          close(terminal->master);
+          free(terminal);
+          return NULL;
         }
-      break;
-      default: unhandled = 1; break;
+      #else
+        terminal->pid = forkpty(&terminal->master, NULL, &term, &size);
+        if (terminal->pid == -1 && set_error_step("forkpty")) {
+          free(envp);
+          free(terminal);
+          return NULL;
+        }
+        if (!terminal->pid) {
+          environ = envp;
+          execvp(pathname,  (char** const)argv);
+          exit(-1);
+          return NULL;
+        }
+        free(envp);
+      #endif
+      terminal->pidfd = terminal_open_pidfd(terminal->pid);
+      if (orphan_count > 0)
+        terminal_reap_orphans();
+      int flags = fcntl(terminal->master, F_GETFL, 0);
+      fcntl(terminal->master, F_SETFL, flags | O_NONBLOCK);
+    #endif
+  }
+  terminal_resize(terminal, columns, lines);
+  return terminal;
+}
+
+static void terminal_register(terminal_t* terminal) {
+  terminal->prev = NULL;
+  terminal->next = terminals;
+  if (terminals)
+    terminals->prev = terminal;
+  terminals = terminal;
+}
+
+static int terminal_is_alive(terminal_t* terminal) {
+  #ifdef _WIN32
+    return WaitForSingleObject(terminal->process_information.hProcess, 0) == WAIT_TIMEOUT;
+  #else
+    return !terminal_reap(terminal);
+  #endif
+}
+
+static int terminal_pool_count(uint64_t spawn_key) {
+  int count = 0;
+  for (terminal_t* terminal = terminal_pool; terminal; terminal = terminal->next) {
+    if (terminal->spawn_key == spawn_key)
+      ++count;
+  }
+  return count;
+}
+
+static void terminal_pool_add(terminal_t* terminal, uint64_t spawn_key) {
+  terminal->spawn_key = spawn_key;
+  terminal->prev = NULL;
+  terminal->next = terminal_pool;
+  if (terminal_pool)
+    terminal_pool->prev = terminal;
+  terminal_pool = terminal;
+}
+
+static void terminal_pool_remove(terminal_t* terminal) {
+  if (terminal->prev)
+    terminal->prev->next = terminal->next;
+  else
+    terminal_pool = terminal->next;
+  if (terminal->next)
+    terminal->next->prev = terminal->prev;
+  terminal->prev = terminal->next = NULL;
+}
+
+// Closes pooled terminals that weren't spawned the way we're now asking for, as after switching projects, or changing shells;
+// nothing would ever take them.
+static void terminal_pool_discard(uint64_t spawn_key) {
+  terminal_t* terminal = terminal_pool;
+  while (terminal) {
+    terminal_t* next = terminal->next;
+    if (terminal->spawn_key != spawn_key) {
+      terminal_pool_remove(terminal);
+      terminal_free(terminal);
     }
+    terminal = next;
   }
+}
 
-  if (unhandled) {
-    #ifdef LIBTERMINAL_DEBUG_ESCAPE
-      fprintf(stderr, "UNKNOWN ESCAPE SEQUENCE\n");
-    #endif
-    return -1;
+// Hands out a pooled terminal that was spawned the same way, if one is still running, sized as requested. Any that have exited
+// in the meantime are discarded.
+static terminal_t* terminal_pool_take(uint64_t spawn_key, int columns, int lines, int scrollback_limit) {
+  terminal_t* terminal = terminal_pool;
+  while (terminal) {
+    terminal_t* next = terminal->next;
+    if (terminal->spawn_key == spawn_key) {
+      terminal_pool_remove(terminal);
+      if (terminal_is_alive(terminal)) {
+        terminal->scrollback_limit = scrollback_limit;
+        terminal_resize(terminal, columns, lines);
+        if (terminal->resize_pending)
+          terminal_send_size(terminal);
+        return terminal;
+      }
+      terminal_free(terminal);
+    }
+    terminal = next;
   }
+  return NULL;
+}
+
+
+// Everything about a terminal that isn't cells, at the start of a snapshot. Everything is written as fixed width, native endian
+// integers, and anything that changes the layout bumps LIBTERMINAL_SNAPSHOT_VERSION; cells themselves go in as they are in memory,
+// so that restoring is a copy, and their size is checked on the way back in.
+typedef struct snapshot_header_t {
+  char magic[4];                       // "LTSS".
+  uint32_t version;                    // LIBTERMINAL_SNAPSHOT_VERSION.
+  uint32_t cell_size, cluster_size;
+  int32_t columns, lines;
+  int32_t current_view;
+  int32_t alternate;                   // If true, the alternate buffer was allocated, and its state and cells follow the normal buffer's.
+  int32_t paste_mode, reporting_focus;
+  int64_t line_id_base;
+  int32_t scrollback_lines, scrollback_limit, cluster_count;
+  int32_t escape_type, sequence_length, sequence_escaped, sequence_overflowed;
+  char name[LIBTERMINAL_NAME_MAX];
+} snapshot_header_t;
+
+// The parts of a view_t that aren't its cells. Followed by palette_count entries of the palette that differ from the default, as
+// an int32 index then a color.
+typedef struct snapshot_view_t {
+  uint64_t cursor_styling;
+  int32_t cursor_x, cursor_y, cursor_styling_inversed, cursor_mode;
+  int32_t cursor_keys_mode, keypad_keys_mode, mouse_tracking_mode, mouse_sgr, charset;
+  int32_t last_graphical_character, tab_size;
+  int32_t scrolling_region_start, scrolling_region_end;
+  int32_t margins_enabled, margin_left, margin_right;
+  int32_t palette_count;
+} snapshot_view_t;
+
+static void snapshot_write(char* target, size_t* offset, const void* data, size_t length) {
+  if (target && length > 0)
+    memcpy(&target[*offset], data, length);
+  *offset += length;
+}
+
+static int snapshot_read(const char* data, size_t length, size_t* offset, void* target, size_t size) {
+  if (size > length - *offset)
+    return -1;
+  memcpy(target, &data[*offset], size);
+  *offset += size;
   return 0;
 }
 
+// Lines, whether on screen or in the scrollback, are their width, whether they overflow, and how many cells are written out; the
+// run of identical empty cells at the end is left out, and the cell it's made of is written once, in its place.
+static void snapshot_write_line(char* target, size_t* offset, buffer_char_t* cells, int columns, int overflows) {
+  int32_t line[3] = { columns, overflows, columns };
+  buffer_char_t fill = cells[columns - 1];
+  if (fill.codepoint == 0) {
+    while (line[2] > 0 && memcmp(&cells[line[2] - 1], &fill, sizeof(buffer_char_t)) == 0)
+      --line[2];
+  }
+  snapshot_write(target, offset, line, sizeof(line));
+  snapshot_write(target, offset, cells, sizeof(buffer_char_t) * line[2]);
+  if (line[2] < columns)
+    snapshot_write(target, offset, &fill, sizeof(buffer_char_t));
+}
 
-static terminal_escape_type_e get_terminal_escape_type(char a, int* fixed_width) {
-  switch (a) {
-    case '[': return ESCAPE_TYPE_CSI;
-    case ']': return ESCAPE_TYPE_OS;
-    case 'D':
-    case 'E':
-    case 'H':
-    case 'M':
-    case 'Z':
-    case 'F':
-    case '>':
-    case '=':
-    case '7':
-    case '8':
-    case 'c':
-    case 'l':
-    case 'm':
-    case 'n':
-    case 'o':
-    case '|':
-    case '}':
-    case '~':
-      *fixed_width = 2;
-      return ESCAPE_TYPE_FIXED_WIDTH;
-    case ' ':
-    case '#':
-    case '%':
-    case '(':
-    case ')':
-    case '*':
-    case '+':
-      *fixed_width = 3;
-      return ESCAPE_TYPE_FIXED_WIDTH;
+// Reads a line into cells, which must have room for the line; if columns isn't 0, the line must be that wide. Returns the line's
+// width, or -1 if it's damaged. Cells pointing at clusters that don't exist would have us reading off the end of the table, so
+// they become replacement characters.
+static int snapshot_read_line(terminal_t* terminal, const char* data, size_t length, size_t* offset, buffer_char_t* cells, int columns, int* overflows) {
+  int32_t line[3];
+  if (snapshot_read(data, length, offset, line, sizeof(line)) || line[0] <= 0 || line[0] > 0xFFFF || (columns && line[0] != columns) || line[2] < 0 || line[2] > line[0])
+    return -1;
+  if (!cells)
+    cells = (buffer_char_t*)scratch_reserve(sizeof(buffer_char_t) * line[0]);
+  if (snapshot_read(data, length, offset, cells, sizeof(buffer_char_t) * line[2]))
+    return -1;
+  if (line[2] < line[0]) {
+    if (snapshot_read(data, length, offset, &cells[line[2]], sizeof(buffer_char_t)))
+      return -1;
+    cells_fill(&cells[line[2]], line[0] - line[2], cells[line[2]]);
+  }
+  for (int i = 0; i < line[0]; ++i) {
+    if ((cells[i].codepoint & LIBTERMINAL_CLUSTER_FLAG) && (int)(cells[i].codepoint & ~LIBTERMINAL_CLUSTER_FLAG) >= terminal->cluster_count)
+      cells[i].codepoint = 0xFFFD;
+  }
+  *overflows = line[1];
+  return line[0];
+}
+
+// Writes out everything we'd need to carry on from where we are: the screens, with their modes, the scrollback, oldest first, and
+// any sequence we're partway through. Returns the length, and only writes if target isn't NULL; the idea being that callers size
+// a buffer with one call, and then fill it, front to back, with another.
+static size_t terminal_write_snapshot(terminal_t* terminal, char* target) {
+  size_t offset = 0;
+  snapshot_header_t header = {
+    { 'L', 'T', 'S', 'S' }, LIBTERMINAL_SNAPSHOT_VERSION, sizeof(buffer_char_t), sizeof(cluster_t), terminal->columns, terminal->lines,
+    terminal->current_view, terminal->views[VIEW_ALTERNATE_BUFFER].buffer != NULL, terminal->paste_mode, terminal->reporting_focus,
+    terminal->line_id_base, terminal->scrollback_total_lines, terminal->scrollback_limit, terminal->cluster_count,
+    terminal->escape_type, terminal->sequence_length, terminal->sequence_escaped, terminal->sequence_overflowed
+  };
+  memcpy(header.name, terminal->name, sizeof(header.name));
+  snapshot_write(target, &offset, &header, sizeof(header));
+  snapshot_write(target, &offset, terminal->clusters, sizeof(cluster_t) * terminal->cluster_count);
+  snapshot_write(target, &offset, terminal->sequence, terminal->sequence_length);
+  for (int i = 0; i < VIEW_MAX; ++i) {
+    view_t* view = &terminal->views[i];
+    if (!view->buffer)
+      continue;
+    snapshot_view_t state = {
+      view->cursor_styling.value, view->cursor_x, view->cursor_y, view->cursor_styling_inversed, view->cursor_mode,
+      view->cursor_keys_mode, view->keypad_keys_mode, view->mouse_tracking_mode, view->mouse_sgr, view->charset,
+      view->last_graphical_character, view->tab_size, view->scrolling_region_start, view->scrolling_region_end,
+      view->margins_enabled, view->margin_left, view->margin_right, 0
+    };
+    for (int j = 0; j < 256; ++j)
+      state.palette_count += view->palette[j].value != indexed_color(j).value;
+    snapshot_write(target, &offset, &state, sizeof(state));
+    for (int j = 0; j < 256; ++j) {
+      if (view->palette[j].value != indexed_color(j).value) {
+        int32_t index = j;
+        snapshot_write(target, &offset, &index, sizeof(index));
+        snapshot_write(target, &offset, &view->palette[j], sizeof(color_t));
+      }
+    }
+    for (int y = 0; y < terminal->lines; ++y)
+      snapshot_write_line(target, &offset, &view->buffer[y * terminal->columns], terminal->columns, view->overflows[y]);
+  }
+  for (backbuffer_page_t* page = terminal->scrollback_buffer_end; page; page = page->next) {
+    int* overflows = backbuffer_page_overflows(page);
+    for (int y = 0; y < page->line; ++y)
+      snapshot_write_line(target, &offset, &page->buffer[y * page->columns], page->columns, overflows[y]);
+  }
+  return offset;
+}
+
+// Restores a snapshot into a terminal that's just been created. Returns 0 on success, or -1 if the snapshot is truncated, damaged,
+// or from a different version; the terminal should be thrown away if so. Nothing is kept pointing into data, so it can be unmapped
+// as soon as we return.
+static int terminal_read_snapshot(terminal_t* terminal, const char* data, size_t length) {
+  size_t offset = 0;
+  snapshot_header_t header;
+  if (
+    snapshot_read(data, length, &offset, &header, sizeof(header)) || memcmp(header.magic, "LTSS", 4) != 0 ||
+    header.version != LIBTERMINAL_SNAPSHOT_VERSION || header.cell_size != sizeof(buffer_char_t) || header.cluster_size != sizeof(cluster_t) ||
+    header.columns <= 0 || header.lines <= 0 || header.columns > 0xFFFF || header.lines > 0xFFFF ||
+    header.current_view < 0 || header.current_view >= VIEW_MAX || (header.current_view == VIEW_ALTERNATE_BUFFER && !header.alternate) ||
+    header.cluster_count < 0 || header.cluster_count > LIBTERMINAL_MAX_CLUSTERS || header.scrollback_lines < 0 ||
+    header.escape_type < ESCAPE_TYPE_NONE || header.escape_type > ESCAPE_TYPE_UNKNOWN ||
+    header.sequence_length < 0 || header.sequence_length >= LIBTERMINAL_MAX_SEQUENCE_SIZE
+  )
+    return -1;
+  terminal_resize(terminal, header.columns, header.lines);
+  for (int i = 0; i < header.cluster_count; ++i) {
+    cluster_t cluster;
+    if (snapshot_read(data, length, &offset, &cluster, sizeof(cluster)) || terminal_intern_cluster(terminal, &cluster) != i)
+      return -1;
+  }
+  if ((size_t)header.sequence_length > length - offset)
+    return -1;
+  terminal_reset_sequence(terminal);
+  terminal_append_sequence(terminal, &data[offset], header.sequence_length);
+  offset += header.sequence_length;
+  terminal->escape_type = header.escape_type;
+  terminal->sequence_escaped = header.sequence_escaped;
+  terminal->sequence_overflowed = header.sequence_overflowed;
+  for (int i = 0; i < VIEW_MAX; ++i) {
+    view_t* view = &terminal->views[i];
+    snapshot_view_t state;
+    if (i == VIEW_ALTERNATE_BUFFER) {
+      if (!header.alternate)
+        continue;
+      terminal_switch_buffer(terminal, VIEW_ALTERNATE_BUFFER);
+    }
+    if (snapshot_read(data, length, &offset, &state, sizeof(state)) || state.palette_count < 0 || state.palette_count > 256)
+      return -1;
+    for (int j = 0; j < 256; ++j)
+      view->palette[j] = indexed_color(j);
+    for (int j = 0; j < state.palette_count; ++j) {
+      int32_t index;
+      color_t color;
+      if (snapshot_read(data, length, &offset, &index, sizeof(index)) || snapshot_read(data, length, &offset, &color, sizeof(color)) || index < 0 || index > 255)
+        return -1;
+      view->palette[index] = color;
+    }
+    for (int y = 0; y < header.lines; ++y) {
+      if (snapshot_read_line(terminal, data, length, &offset, &view->buffer[y * header.columns], header.columns, &view->overflows[y]) == -1)
+        return -1;
+    }
+    // Anything that indexes the grid is clamped to it, so a damaged snapshot can't have us writing outside of it. The cursor can
+    // sit one past the last column, as it does after printing there, with the wrap still to come.
+    view->cursor_styling.value = state.cursor_styling;
+    view->cursor_x = min(max(state.cursor_x, 0), header.columns);
+    view->cursor_y = min(max(state.cursor_y, 0), header.lines - 1);
+    view->cursor_styling_inversed = state.cursor_styling_inversed;
+    view->cursor_mode = state.cursor_mode;
+    view->cursor_keys_mode = state.cursor_keys_mode == KEYS_MODE_APPLICATION ? KEYS_MODE_APPLICATION : KEYS_MODE_NORMAL;
+    view->keypad_keys_mode = state.keypad_keys_mode == KEYS_MODE_APPLICATION ? KEYS_MODE_APPLICATION : KEYS_MODE_NORMAL;
+    view->mouse_tracking_mode = state.mouse_tracking_mode >= MOUSE_TRACKING_NONE && state.mouse_tracking_mode <= MOUSE_TRACKING_ANY ? state.mouse_tracking_mode : MOUSE_TRACKING_NONE;
+    view->mouse_sgr = state.mouse_sgr != 0;
+    view->charset = state.charset >= CHARSET_US && state.charset <= CHARSET_OTHER ? state.charset : CHARSET_US;
+    view->last_graphical_character = state.last_graphical_character;
+    view->tab_size = max(state.tab_size, 1);
+    view->scrolling_region_start = view->scrolling_region_end = -1;
+    if (state.scrolling_region_start != -1 || state.scrolling_region_end != -1) {
+      view->scrolling_region_start = min(max(state.scrolling_region_start, 0), header.lines - 1);
+      view->scrolling_region_end = min(max(state.scrolling_region_end, view->scrolling_region_start + 1), header.lines);
+    }
+    view->margins_enabled = state.margins_enabled;
+    view->margin_left = view->margin_right = -1;
+    if (state.margin_left != -1 || state.margin_right != -1) {
+      view->margin_left = min(max(state.margin_left, 0), header.columns - 1);
+      view->margin_right = min(max(state.margin_right, view->margin_left + 1), header.columns);
+    }
+  }
+  terminal->current_view = header.current_view;
+  for (int i = 0; i < header.scrollback_lines; ++i) {
+    int overflows, columns = snapshot_read_line(terminal, data, length, &offset, NULL, 0, &overflows);
+    if (columns == -1)
+      return -1;
+    terminal_push_scrollback_line(terminal, (buffer_char_t*)scratch_buffer, columns, overflows);
+  }
+  terminal->line_id_base = header.line_id_base;
+  terminal->paste_mode = header.paste_mode == PASTE_BRACKETED ? PASTE_BRACKETED : PASTE_NORMAL;
+  terminal->reporting_focus = header.reporting_focus;
+  memcpy(terminal->name, header.name, sizeof(terminal->name));
+  terminal->name[sizeof(terminal->name) - 1] = 0;
+  return offset == length ? 0 : -1;
+}
+
+// Creates a dummy terminal at the size the snapshot was taken at, with room for all of its scrollback, and restores it.
+static terminal_t* terminal_restore(const char* data, size_t length) {
+  size_t offset = 0;
+  snapshot_header_t header;
+  if (snapshot_read(data, length, &offset, &header, sizeof(header)) || header.columns <= 0 || header.lines <= 0 || header.columns > 0xFFFF || header.lines > 0xFFFF) {
+    set_error_step("read snapshot");
+    return NULL;
+  }
+  const char* dummy_arguments[] = { "DUMMY", NULL };
+  terminal_t* terminal = terminal_new(header.columns, header.lines, max(header.scrollback_limit, header.scrollback_lines), "DUMMY", "DUMMY", dummy_arguments, NULL);
+  if (!terminal)
+    return NULL;
+  if (terminal_read_snapshot(terminal, data, length)) {
+    set_error_step("read snapshot");
+    terminal_free(terminal);
+    return NULL;
   }
-  return ESCAPE_TYPE_UNKNOWN;
+  return terminal;
 }
 
-static terminal_escape_type_e parse_partial_sequence(const char* seq, int len, int* fixed_width) {
-  if (len == 0)
-    return ESCAPE_TYPE_NONE;
-  if (len == 1)
-    return ESCAPE_TYPE_OPEN;
-  return get_terminal_escape_type(seq[1], fixed_width);
+// Snapshots are laid out in memory first, so that the file gets them in one write.
+static int terminal_save_snapshot(terminal_t* terminal, const char* path) {
+  size_t length = terminal_write_snapshot(terminal, NULL);
+  char* snapshot = malloc(length);
+  if (!snapshot && set_error_step("allocate snapshot"))
+    return -1;
+  terminal_write_snapshot(terminal, snapshot);
+  FILE* file = fopen(path, "wb");
+  int written = file && fwrite(snapshot, 1, length, file) == length;
+  if (file && fclose(file))
+    written = 0;
+  free(snapshot);
+  if (!written && set_error_step("write snapshot"))
+    return -1;
+  return 0;
 }
 
-static int translate_charset(charset_e charset, int codepoint) {
-  if (charset == CHARSET_DEC) {
-    switch (codepoint) {
-      case 0x5F: codepoint = ' '; break;
-      case 0x60: codepoint = 0x25C6; break;
-      case 0x61: codepoint = 0x2592; break;
-      case 0x62: codepoint = '\t'; break;
-      case 0x63: codepoint = '\f'; break;
-      case 0x64: codepoint = '\r'; break;
-      case 0x65: codepoint = '\n'; break;
-      case 0x66: codepoint = 0xB0; break;
-      case 0x67: codepoint = 0xB1; break;
-      case 0x68: codepoint = '\n'; break;
-      case 0x69: codepoint = '\v'; break;
-      case 0x6A: codepoint = 0x2518; break;
-      case 0x6B: codepoint = 0x2510; break;
-      case 0x6C: codepoint = 0x250C; break;
-      case 0x6D: codepoint = 0x2514; break;
-      case 0x6E: codepoint = 0x253C; break;
-      case 0x70: codepoint = 0x23BB; break;
-      case 0x71: codepoint = 0x2500; break;
-      case 0x72: codepoint = 0x23BC; break;
-      case 0x73: codepoint = 0x23BD; break;
-      case 0x74: codepoint = 0x251C; break;
-      case 0x75: codepoint = 0x2524; break;
-      case 0x76: codepoint = 0x2534; break;
-      case 0x77: codepoint = 0x252C; break;
-      case 0x78: codepoint = 0x2502; break;
-      case 0x79: codepoint = 0x2264; break;
-      case 0x7A: codepoint = 0x2265; break;
-      case 0x7B: codepoint = 0x03C0; break;
-      case 0x7C: codepoint = 0x2260; break;
-      case 0x7D: codepoint = 0x00A3; break;
-      case 0x7E: codepoint = 0x00B7; break;
-    }
-  }
-  return codepoint;
+// Where we can, the file's mapped rather than read, so restoring a large snapshot only ever has it in memory once, as the terminal.
+static terminal_t* terminal_restore_file(const char* path) {
+  terminal_t* terminal = NULL;
+  #if _WIN32
+    FILE* file = fopen(path, "rb");
+    if (!file && set_error_step("open snapshot"))
+      return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* snapshot = length > 0 ? malloc(length) : NULL;
+    if (snapshot && fread(snapshot, 1, length, file) == (size_t)length)
+      terminal = terminal_restore(snapshot, length);
+    else
+      set_error_step("read snapshot");
+    free(snapshot);
+    fclose(file);
+  #else
+    struct stat status;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 && set_error_step("open snapshot"))
+      return NULL;
+    void* snapshot = fstat(fd, &status) == 0 && status.st_size > 0 ? mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (snapshot == MAP_FAILED && set_error_step("map snapshot"))
+      return NULL;
+    terminal = terminal_restore(snapshot, status.st_size);
+    munmap(snapshot, status.st_size);
+  #endif
+  return terminal;
 }
 
-static int terminal_output(terminal_t* terminal, const char* str, int len) {
-  if (terminal->debug)  {
-    FILE* file = fopen("terminal.log", "ab");
-    if (file) {
-      fwrite(str, sizeof(char), len, file);
-      fclose(file);
-    }
+#ifndef _WIN32
+  // The socket may well be somewhere anyone can create files, like /tmp; so whichever end we are, we only talk to ourselves.
+  static int remote_peer_is_us(int fd) {
+    #ifdef SO_PEERCRED
+      struct ucred credentials;
+      socklen_t length = sizeof(credentials);
+      return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+    #else
+      uid_t uid;
+      gid_t gid;
+      return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+    #endif
   }
-  unsigned int codepoint;
-  int total_shifts = 0;
-  int offset = 0;
-  int buffered_sequence_index = strlen(terminal->buffered_sequence);
-  view_t* view = &terminal->views[terminal->current_view];
-  int fixed_width = -1;
-  terminal_escape_type_e escape_type = parse_partial_sequence(terminal->buffered_sequence, buffered_sequence_index, &fixed_width);
-  while (offset < len) {
-    if (escape_type != ESCAPE_TYPE_NONE) {
-      terminal->buffered_sequence[buffered_sequence_index++] = str[offset];
-      escape_type = parse_partial_sequence(terminal->buffered_sequence, buffered_sequence_index, &fixed_width);
-      if (
-        (escape_type == ESCAPE_TYPE_CSI && buffered_sequence_index > 2 && str[offset] >= 0x40 && str[offset] <= 0x7E) ||
-        (escape_type == ESCAPE_TYPE_OS && ((offset < len - 1 && (str[offset+1] == '\a') || (offset < len - 2 && str[offset+1] == 0x1B && str[offset+2] == 0x5C)))) ||
-        (escape_type == ESCAPE_TYPE_UNKNOWN && str[offset] == 0x1B) ||
-        (escape_type == ESCAPE_TYPE_FIXED_WIDTH && buffered_sequence_index == fixed_width || str[offset] == 0x1B)
-      ) {
-        terminal->buffered_sequence[buffered_sequence_index++] = 0;
-        terminal_escape_sequence(terminal, escape_type, terminal->buffered_sequence);
-        view->last_graphical_character = 0;
-        view = &terminal->views[terminal->current_view];
-        buffered_sequence_index = 0;
-        terminal->buffered_sequence[0] = 0;
-        if (escape_type == ESCAPE_TYPE_OS) {
-          escape_type = ESCAPE_TYPE_NONE;
-          offset += str[offset+1] == 0x1B ? 2 : 1;
-        } else if (str[offset] == 0x1B && (escape_type == ESCAPE_TYPE_UNKNOWN || escape_type == ESCAPE_TYPE_FIXED_WIDTH)) {
-          escape_type = ESCAPE_TYPE_OPEN;
-          terminal->buffered_sequence[buffered_sequence_index++] = str[offset];
-        } else {
-          escape_type = ESCAPE_TYPE_NONE;
-        }
-      }
-      ++offset;
-    } else {
-      int end = (view->scrolling_region_end == -1 ? terminal->lines : view->scrolling_region_end);
-      offset += utf8_to_codepoint(&str[offset], &codepoint);
-      if (codepoint != '\e')
-        view->last_graphical_character = 0;
-      switch (codepoint) {
-        case 0x00:
-        case 0x01:
-        case 0x02:
-        case 0x03:
-        case 0x04:
-        case 0x05:
-        case 0x06:
-        case 0x07:
-        break;
-        case '\b': {
-          if (view->cursor_x)
-            --view->cursor_x;
-        } break;
-        case '\t': {
-          view->cursor_x = (view->cursor_x + view->tab_size) - ((view->cursor_x + view->tab_size) % view->tab_size);
-        } break;
-        case '\n': {
-          // So that we can copy text blocks properly.
-          if (view->cursor_y < (end - 1))
-            ++view->cursor_y;
-          else {
-            terminal_shift_buffer(terminal);
-            ++total_shifts;
-          }
-        } break;
-        case 0x0B:
-        case 0x0C:
-        break;
-        case '\r': {
-          view->cursor_x = 0;
-        } break;
-        case 0x0E:
-        case 0x0F:
-        case 0x11:
-        case 0x12:
-        case 0x13:
-        case 0x14:
-        case 0x15:
-        case 0x16:
-        case 0x17:
-        case 0x18:
-        case 0x19:
-        case 0x1A:
-          break;
-        case 0x1B: { // escape
-          terminal->buffered_sequence[0] = 0x1B;
-          escape_type = ESCAPE_TYPE_OPEN;
-          buffered_sequence_index = 1;
-        } break;
-        case 0x1C:
-        case 0x1D:
-        case 0x1E:
-        case 0x1F:
-          break;
-        default:
-          if (view->cursor_x >= terminal->columns) {
-            view->overflows[view->cursor_y] = 1;
-            view->cursor_x = 0;
-            if (view->cursor_y < (end - 1))
-              ++view->cursor_y;
-            else {
-              terminal_shift_buffer(terminal);
-              ++total_shifts;
-            }
-          }
-          codepoint = translate_charset(view->charset, codepoint);
-          view->buffer[view->cursor_y * terminal->columns + view->cursor_x] = (buffer_char_t){ view->cursor_styling, codepoint };
-          view->last_graphical_character = codepoint;
-          view->cursor_x++;
-        break;
-      }
+
+  static int remote_connect(const char* socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+      return -1;
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1 || !remote_peer_is_us(fd)) {
+      close(fd);
+      return -1;
     }
+    return fd;
   }
-  terminal->buffered_sequence[buffered_sequence_index] = 0;
-  return total_shifts;
-}
 
-#ifdef _WIN32
-  static DWORD windows_nonblocking_thread_callback(void* data) {
-    terminal_t* terminal = (terminal_t*)data;
-    char chunk_buffer[LIBTERMINAL_CHUNK_SIZE];
-    while (1) {
-      DWORD bytes_read;
-      if (sizeof(chunk_buffer) - terminal->nonblocking_buffer_length > 0 || terminal->closing) {
-        if (terminal->closing) {
-          while (1) {
-            if (!ReadFile(terminal->frompty, chunk_buffer, sizeof(chunk_buffer), &bytes_read, NULL) || bytes_read == 0)
-              break;
-          }
-          return 0;
-        }
-        if (!ReadFile(terminal->frompty, chunk_buffer, sizeof(chunk_buffer) - terminal->nonblocking_buffer_length, &bytes_read, NULL))
-          break;
-        if (bytes_read > 0) {
-          WaitForSingleObject(terminal->nonblocking_buffer_mutex, INFINITE);
-          memcpy(&terminal->nonblocking_buffer[terminal->nonblocking_buffer_length], chunk_buffer, bytes_read);
-          terminal->nonblocking_buffer_length += bytes_read;
-          ReleaseMutex(terminal->nonblocking_buffer_mutex);
-        }
-      }
-      Sleep(1);
+  // Reads or writes the whole of a buffer, giving up if the daemon goes quiet for longer than LIBTERMINAL_REMOTE_TIMEOUT.
+  static int remote_transfer(int fd, char* buffer, size_t length, int writing) {
+    size_t done = 0;
+    while (done < length) {
+      struct pollfd descriptor = { fd, writing ? POLLOUT : POLLIN, 0 };
+      int ready = poll(&descriptor, 1, LIBTERMINAL_REMOTE_TIMEOUT);
+      if (ready == -1 && errno == EINTR)
+        continue;
+      if (ready <= 0)
+        return -1;
+      ssize_t transferred = writing ? write(fd, &buffer[done], length - done) : read(fd, &buffer[done], length - done);
+      if (transferred == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        continue;
+      if (transferred <= 0)
+        return -1;
+      done += transferred;
     }
     return 0;
   }
-#endif
 
-static int terminal_update(terminal_t* terminal, void (*callback)(char*, int, void*), void* data, int* total_shifts) {
-  if (terminal->mode == MODE_DUMMY)
-    return 0;
-  char chunk[LIBTERMINAL_CHUNK_SIZE];
-  int len, at_least_one = 0;
-  #ifdef _WIN32
-    WaitForSingleObject(terminal->nonblocking_buffer_mutex, INFINITE);
-    if (terminal->nonblocking_buffer_length > 0) {
-      *total_shifts += terminal_output(terminal, terminal->nonblocking_buffer, terminal->nonblocking_buffer_length);
-      if (callback)
-        callback(chunk, terminal->nonblocking_buffer_length, data);
-      at_least_one = 1;
+  static int remote_send_frame(int fd, char type, const void* payload, uint32_t length) {
+    char header[LIBTERMINAL_REMOTE_FRAME_HEADER] = { type };
+    memcpy(&header[1], &length, sizeof(length));
+    return remote_transfer(fd, header, sizeof(header), 1) || remote_transfer(fd, (char*)payload, length, 1) ? -1 : 0;
+  }
+
+  // Reads a whole frame. Returns its payload, zero-terminated, which the caller frees, or NULL if the connection failed.
+  static char* remote_receive_frame(int fd, char* type, uint32_t* length) {
+    char header[LIBTERMINAL_REMOTE_FRAME_HEADER];
+    if (remote_transfer(fd, header, sizeof(header), 0))
+      return NULL;
+    *type = header[0];
+    memcpy(length, &header[1], sizeof(*length));
+    char* payload = malloc((size_t)*length + 1);
+    if (!payload)
+      return NULL;
+    if (remote_transfer(fd, payload, *length, 0)) {
+      free(payload);
+      return NULL;
     }
-    terminal->nonblocking_buffer_length = 0;
-    ReleaseMutex(terminal->nonblocking_buffer_mutex);
-    return at_least_one;
-  #else
-    int chunks_processed = 0;
-    do {
-      len = read(terminal->master, chunk, sizeof(chunk));
-      if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-        return at_least_one;
-      *total_shifts += terminal_output(terminal, chunk, len);
-      if (callback)
-        callback(chunk, len, data);
-      at_least_one = 1;
-    } while (len > 0 && chunks_processed++ < LIBTERMINAL_MAX_CHUNKS_PROCESSED);
-  #endif
-  return -1;
-}
+    payload[*length] = 0;
+    return payload;
+  }
 
-static int terminal_close(terminal_t* terminal) {
-  terminal_clear_scrollback_buffer(terminal);
-  for (int i = 0; i < VIEW_MAX; ++i) {
-    if (terminal->views[i].buffer) {
-      free(terminal->views[i].buffer);
-      free(terminal->views[i].overflows);
+  // The daemon only returns once it's listening, having left a copy of itself running in the background.
+  static void remote_start_daemon(const char* daemon_path, const char* socket_path) {
+    pid_t pid;
+    char* arguments[] = { (char*)daemon_path, (char*)socket_path, NULL };
+    if (posix_spawn(&pid, daemon_path, NULL, NULL, arguments, environ) == 0) {
+      while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
     }
-    terminal->views[i].buffer = NULL;
-    terminal->views[i].overflows = NULL;
   }
-  if (terminal->mode == MODE_PTY) {
-    #if _WIN32
-      // This has to be first, because if we don't drain the buffer in our nonblocking_thread,
-      // this call can hang. (SIGH).
-      terminal->closing = 1;
-      if (terminal->hpcon) {
-        ClosePseudoConsole(terminal->hpcon);
-        terminal->hpcon = NULL;
-      }
-      if (terminal->nonblocking_thread) {
-        TerminateThread(terminal->nonblocking_thread, 0);
-        terminal->nonblocking_thread = NULL;
-      }
-      if (terminal->topty) {
-        CloseHandle(terminal->topty);
-        terminal->topty = NULL;
+
+  static void remote_write_strings(char* target, size_t* offset, const char** strings) {
+    int32_t count = 0;
+    while (strings[count])
+      ++count;
+    snapshot_write(target, offset, &count, sizeof(count));
+    for (int i = 0; i < count; ++i)
+      snapshot_write(target, offset, strings[i], strlen(strings[i]) + 1);
+  }
+
+  // Connects to the daemon, starting it first if it isn't running and we know where it is. Then either has it spawn a new session,
+  // or if session isn't 0, attaches to that one, and picks up from its snapshot. The terminal we return mirrors the daemon's from
+  // then on; output comes in as the daemon reads it, and input, and resizes, go out to it.
+  static terminal_t* terminal_remote_new(const char* socket_path, const char* daemon_path, int session, int columns, int lines, int scrollback_limit, const char* term_env, const char* pathname, const char** argv, const char** environment) {
+    int fd = remote_connect(socket_path);
+    if (fd == -1 && daemon_path) {
+      remote_start_daemon(daemon_path, socket_path);
+      fd = remote_connect(socket_path);
+    }
+    if (fd == -1 && set_error_step("connect to daemon"))
+      return NULL;
+    char* request = NULL;
+    size_t request_length = 0;
+    if (session) {
+      int32_t id = session;
+      request_length = sizeof(id);
+      request = malloc(request_length);
+      memcpy(request, &id, sizeof(id));
+    } else {
+      int32_t numbers[3] = { columns, lines, scrollback_limit };
+      // Measured first, then written, in the same way as snapshots.
+      for (int pass = 0; pass < 2; ++pass) {
+        char* target = pass ? request : NULL;
+        request_length = 0;
+        snapshot_write(target, &request_length, numbers, sizeof(numbers));
+        snapshot_write(target, &request_length, term_env, strlen(term_env) + 1);
+        snapshot_write(target, &request_length, pathname, strlen(pathname) + 1);
+        remote_write_strings(target, &request_length, argv);
+        remote_write_strings(target, &request_length, environment);
+        if (!pass)
+          request = malloc(request_length);
       }
-      if (terminal->frompty) {
-        CloseHandle(terminal->frompty);
-        terminal->frompty = NULL;
+    }
+    int failed = remote_send_frame(fd, session ? REMOTE_FRAME_ATTACH : REMOTE_FRAME_SPAWN, request, request_length);
+    free(request);
+    char type;
+    uint32_t length;
+    char* response = failed ? NULL : remote_receive_frame(fd, &type, &length);
+    if (!response || type != REMOTE_FRAME_SESSION || length != sizeof(int32_t)) {
+      if (response && type == REMOTE_FRAME_ERROR)
+        set_error_step(response);
+      else
+        set_error_step("talk to daemon");
+      free(response);
+      close(fd);
+      return NULL;
+    }
+    const char* dummy_arguments[] = { "DUMMY", NULL };
+    terminal_t* terminal = terminal_new(columns, lines, scrollback_limit, term_env, "DUMMY", dummy_arguments, NULL);
+    memcpy(&terminal->session, response, sizeof(int32_t));
+    free(response);
+    if (session) {
+      char* snapshot = remote_receive_frame(fd, &type, &length);
+      if (!snapshot || type != REMOTE_FRAME_SNAPSHOT || terminal_read_snapshot(terminal, snapshot, length)) {
+        set_error_step("restore snapshot");
+        free(snapshot);
+        close(fd);
+        terminal_free(terminal);
+        return NULL;
       }
-      if (terminal->nonblocking_buffer_mutex) {
-        CloseHandle(terminal->nonblocking_buffer_mutex);
-        terminal->nonblocking_buffer_mutex = NULL;
+      free(snapshot);
+    }
+    terminal->mode = MODE_REMOTE;
+    terminal->master = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    // The snapshot's at the size the daemon was; make sure it's at ours.
+    if (terminal->columns != columns || terminal->lines != lines)
+      terminal_resize(terminal, columns, lines);
+    else
+      terminal_send_size(terminal);
+    return terminal;
+  }
+
+  // Reads what the daemon has for us, and goes through the whole frames of it; anything partial waits for the next update. As with
+  // a pty, we read and parse about as much as we would from one in a frame, and leave the rest for the next.
+  static int terminal_update_remote(terminal_t* terminal, void (*callback)(char*, int, void*), void* data, int* total_shifts) {
+    int status = 0, received = 0, budget = LIBTERMINAL_CHUNK_SIZE * LIBTERMINAL_MAX_CHUNKS_PROCESSED;
+    while (received < budget) {
+      if (terminal->remote_capacity - terminal->remote_length < LIBTERMINAL_CHUNK_SIZE) {
+        terminal->remote_capacity = max(terminal->remote_capacity * 2, LIBTERMINAL_CHUNK_SIZE * LIBTERMINAL_MAX_CHUNKS_PROCESSED);
+        terminal->remote_buffer = realloc(terminal->remote_buffer, terminal->remote_capacity);
       }
-      if (terminal->process_information.hProcess) {
-        TerminateProcess(terminal->process_information.hProcess, 1);
-        terminal->process_information.hProcess = NULL;
+      ssize_t len = read(terminal->master, &terminal->remote_buffer[terminal->remote_length], terminal->remote_capacity - terminal->remote_length);
+      if (len == -1 && errno == EINTR)
+        continue;
+      if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+          status = -1;
+        break;
       }
-    #else
-      if (terminal->pid) {
-        if (terminal->master) {
-          close(terminal->master);
-          terminal->master = 0;
-          kill(terminal->pid, SIGHUP);
+      terminal->remote_length += len;
+      received += len;
+    }
+    int offset = 0, output = 0, parsed = 0;
+    while (terminal->remote_length - offset >= LIBTERMINAL_REMOTE_FRAME_HEADER && parsed < budget) {
+      char* frame = &terminal->remote_buffer[offset];
+      uint32_t length;
+      memcpy(&length, &frame[1], sizeof(length));
+      if (length > (uint32_t)(terminal->remote_length - offset - LIBTERMINAL_REMOTE_FRAME_HEADER)) {
+        // Make sure there'll be room for the rest of it.
+        if ((size_t)length + LIBTERMINAL_REMOTE_FRAME_HEADER > (size_t)terminal->remote_capacity) {
+          terminal->remote_capacity = length + LIBTERMINAL_REMOTE_FRAME_HEADER;
+          terminal->remote_buffer = realloc(terminal->remote_buffer, terminal->remote_capacity);
         }
-        int status;
-        if (waitpid(terminal->pid, &status, WNOHANG))
-          terminal->pid = 0;
-        else
-          return -1;
+        break;
       }
-    #endif
+      char* payload = &frame[LIBTERMINAL_REMOTE_FRAME_HEADER];
+      if (frame[0] == REMOTE_FRAME_OUTPUT && length > 0) {
+        *total_shifts += terminal_output(terminal, payload, length);
+        if (callback)
+          callback(payload, length, data);
+        output = 1;
+        parsed += length;
+      } else if (frame[0] == REMOTE_FRAME_EXIT && length == sizeof(int32_t)) {
+        int32_t exit_status;
+        memcpy(&exit_status, payload, sizeof(exit_status));
+        terminal->exit_status = exit_status;
+        terminal->exited = 1;
+      }
+      offset += LIBTERMINAL_REMOTE_FRAME_HEADER + length;
+    }
+    memmove(terminal->remote_buffer, &terminal->remote_buffer[offset], terminal->remote_length - offset);
+    terminal->remote_length -= offset;
+    // If the daemon's gone, so is the shell.
+    if (status == -1)
+      terminal->exited = 1;
+    return status ? status : output;
+  }
+
+  // Lists the detached sessions in the daemon, as the payload of a list frame, or NULL if there's no daemon running.
+  static char* terminal_remote_sessions(const char* socket_path, uint32_t* length) {
+    int fd = remote_connect(socket_path);
+    if (fd == -1)
+      return NULL;
+    char type;
+    char* response = remote_send_frame(fd, REMOTE_FRAME_LIST, "", 0) ? NULL : remote_receive_frame(fd, &type, length);
+    close(fd);
+    if (response && type != REMOTE_FRAME_LIST) {
+      free(response);
+      return NULL;
+    }
+    return response;
+  }
+#endif
+
+#ifndef _WIN32
+// A log, or anything else too large to feed through the parser whole, shown read-only from a memory mapping. A thread goes
+// through it in the background, noting where every LIBTERMINAL_FILE_CHECKPOINT_LINES'th line starts, and what the styling is
+// there; only the lines on screen are ever parsed, starting from the checkpoint before them. Lines are shown as they are in the
+// file, clipped to the width of the terminal, rather than wrapped, and escape sequences other than SGR are skipped; so is any
+// sequence that spans lines.
+//
+// The file can shrink under us, as logs rotated with copytruncate do; touching a page of the mapping past its new end raises
+// SIGBUS. Each update checks the size, and stops at the new end, and everything that reads the mapping does so with
+// file_fault_jump set, so that a fault that gets in first is a jump back out rather than a crash. Growth after opening isn't followed.
+typedef struct file_checkpoint_t {
+  size_t offset;                       // Where the line starts in the file.
+  buffer_styling_t styling;            // What characters are being emitted as at the start of the line.
+  int styling_inversed;
+} file_checkpoint_t;
+
+typedef struct file_view_t {
+  const char* data;                    // The mapping, and how much of it is still backed by the file; never more than mapped_length.
+  size_t length, mapped_length;
+  int fd;                              // Kept open, to notice the file shrinking.
+  int64_t top;                         // The line at the top of the screen.
+  int64_t laid_out_line_count;         // How many lines there were when we last looked; only touched outside the thread.
+  pthread_t thread;
+  int joinable;                        // False if the thread couldn't be started again after the file shrank.
+  pthread_mutex_t mutex;               // Guards everything below, which the thread writes to as it goes.
+  file_checkpoint_t* checkpoints;
+  int64_t checkpoint_count, checkpoint_capacity;
+  int64_t line_count;                  // Amount of lines the thread has been through.
+  int indexed;                         // If true, the thread has been through the whole file.
+  int cancelled;                       // If true, the thread should stop where it is.
+} file_view_t;
+
+static __thread sigjmp_buf* file_fault_jump;      // Where to go if this thread faults on a mapping; NULL if it isn't reading one.
+static struct sigaction sigbus_previous_action;
+static int sigbus_installed;
+
+// A fault outside of a guarded read isn't ours; putting back whatever was there before and returning has it fault again into that.
+static void sigbus_handler(int signal, siginfo_t* info, void* context) {
+  if (file_fault_jump)
+    siglongjmp(*file_fault_jump, 1);
+  sigaction(SIGBUS, &sigbus_previous_action, NULL);
+}
+
+static void file_install_guard() {
+  if (sigbus_installed)
+    return;
+  struct sigaction action = {0};
+  action.sa_sigaction = sigbus_handler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, &sigbus_previous_action);
+  sigbus_installed = 1;
+}
+
+// Skips past an escape sequence, applying it to the view if it's SGR. Anything after end is assumed not to be part of it.
+static const char* file_scan_escape(view_t* view, const char* p, const char* end) {
+  if (p + 1 >= end)
+    return end;
+  if (p[1] == '[') {
+    const char* final = p + 2;
+    while (final < end && (*final < 0x40 || *final > 0x7E))
+      ++final;
+    if (final == end)
+      return end;
+    char seq[128];
+    if (*final == 'm' && final - p + 2 <= (ptrdiff_t)sizeof(seq)) {
+      memcpy(seq, p, final - p + 1);
+      seq[final - p + 1] = 0;
+      view_apply_sgr(view, seq);
+    }
+    return final + 1;
   }
-  return 0;
+  if (p[1] == ']' || p[1] == 'P' || p[1] == '_' || p[1] == '^' || p[1] == 'X') {
+    for (p += 2; p < end; ++p) {
+      if (*p == 0x07)
+        return p + 1;
+      if (*p == 0x1B && p + 1 < end && p[1] == '\\')
+        return p + 2;
+    }
+    return end;
+  }
+  return p + 2;
 }
 
-static void terminal_free(terminal_t* terminal) {
-  terminal_close(terminal);
-  #ifdef _WIN32
-  #else
-    if (terminal->pid)
-      kill(terminal->pid, SIGKILL);
-  #endif
-  free(terminal);
+// Goes through a line without drawing it, only keeping track of styling. Returns the start of the next.
+static const char* file_scan_line(view_t* view, const char* p, const char* end) {
+  const char* eol = memchr(p, '\n', end - p);
+  if (!eol)
+    eol = end;
+  for (p = memchr(p, 0x1B, eol - p); p; p = memchr(p, 0x1B, eol - p))
+    p = file_scan_escape(view, p, eol);
+  return eol == end ? end : eol + 1;
 }
 
-static void terminal_resize(terminal_t* terminal, int columns, int lines) {
-  if (terminal->columns == columns && terminal->lines == lines)
-    return;
-  if (terminal->mode == MODE_PTY) {
-    #ifdef _WIN32
-      COORD size = { columns, lines };
-      ResizePseudoConsole(terminal->hpcon, size);
-    #else
-      struct winsize size = { .ws_row = lines, .ws_col = columns, .ws_xpixel = 0, .ws_ypixel = 0 };
-      ioctl(terminal->master, TIOCSWINSZ, &size);
-    #endif
+static void* file_index_thread(void* data) {
+  file_view_t* file = data;
+  view_t* state = calloc(1, sizeof(view_t));
+  for (int i = 0; i < 256; ++i)
+    state->palette[i] = indexed_color(i);
+  // If the file's shrunk, we pick up again from the last checkpoint that's still in it.
+  pthread_mutex_lock(&file->mutex);
+  file_checkpoint_t start = file->checkpoint_count > 0 ? file->checkpoints[--file->checkpoint_count] : (file_checkpoint_t){ 0, LIBTERMINAL_NO_STYLING, 0 };
+  state->cursor_styling = start.styling;
+  state->cursor_styling_inversed = start.styling_inversed;
+  volatile int64_t line = file->checkpoint_count * LIBTERMINAL_FILE_CHECKPOINT_LINES;
+  const char *p = &file->data[start.offset], *end = file->data + file->length;
+  pthread_mutex_unlock(&file->mutex);
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 1)) {
+    // The file shrank as we went through it; the next update notices, if it hasn't already, and starts us again.
+    file_fault_jump = NULL;
+    pthread_mutex_lock(&file->mutex);
+    file->line_count = line;
+    file->indexed = 1;
+    pthread_mutex_unlock(&file->mutex);
+    free(state);
+    return NULL;
   }
-  for (int i = 0; i < VIEW_MAX; ++i) {
-    buffer_char_t* buffer = malloc(sizeof(buffer_char_t) * columns * lines);
-    memset(buffer, 0, sizeof(buffer_char_t) * columns * lines);
-    if (terminal->views[i].buffer) {
-      if (lines < terminal->lines && i == VIEW_NORMAL_BUFFER) {
-        for (int j = 0; j < max(0, (terminal->views[i].cursor_y+1) - lines); ++j)
-          terminal_shift_buffer(terminal);
+  file_fault_jump = &jump;
+  while (p < end) {
+    if (line % LIBTERMINAL_FILE_CHECKPOINT_LINES == 0) {
+      pthread_mutex_lock(&file->mutex);
+      if (file->checkpoint_count == file->checkpoint_capacity) {
+        file->checkpoint_capacity = file->checkpoint_capacity ? file->checkpoint_capacity * 2 : 1024;
+        file->checkpoints = realloc(file->checkpoints, sizeof(file_checkpoint_t) * file->checkpoint_capacity);
+      }
+      file->checkpoints[file->checkpoint_count++] = (file_checkpoint_t){ p - file->data, state->cursor_styling, state->cursor_styling_inversed };
+      file->line_count = line;
+      int cancelled = file->cancelled;
+      pthread_mutex_unlock(&file->mutex);
+      if (cancelled)
+        break;
+    }
+    p = file_scan_line(state, p, end);
+    ++line;
+  }
+  file_fault_jump = NULL;
+  pthread_mutex_lock(&file->mutex);
+  file->line_count = line;
+  file->indexed = 1;
+  pthread_mutex_unlock(&file->mutex);
+  free(state);
+  return NULL;
+}
+
+// Checks whether the file has shrunk, and if so, drops the checkpoints past its new end, and has the thread count the lines
+// again from the last one left. Returns true if it has.
+static int file_check_length(file_view_t* file) {
+  struct stat status;
+  if (fstat(file->fd, &status) != 0 || (size_t)status.st_size >= file->length)
+    return 0;
+  pthread_mutex_lock(&file->mutex);
+  file->length = status.st_size;
+  file->cancelled = 1;
+  pthread_mutex_unlock(&file->mutex);
+  if (file->joinable)
+    pthread_join(file->thread, NULL);
+  while (file->checkpoint_count > 0 && file->checkpoints[file->checkpoint_count - 1].offset > file->length)
+    --file->checkpoint_count;
+  file->line_count = file->checkpoint_count > 0 ? (file->checkpoint_count - 1) * LIBTERMINAL_FILE_CHECKPOINT_LINES : 0;
+  file->cancelled = file->indexed = 0;
+  file->joinable = pthread_create(&file->thread, NULL, file_index_thread, file) == 0;
+  if (!file->joinable)
+    file_index_thread(file);
+  return 1;
+}
+
+// Draws a line of the file onto a row of the screen, carrying on with the styling the view has.
+static void terminal_draw_file_line(terminal_t* terminal, view_t* view, int y, const char* p, const char* eol) {
+  buffer_char_t* row = &view->buffer[y * terminal->columns];
+  cells_fill(row, terminal->columns, (buffer_char_t){ LIBTERMINAL_NO_STYLING, 0 });
+  view->overflows[y] = 0;
+  view->cursor_x = 0;
+  view->cursor_y = y;
+  while (p < eol) {
+    unsigned char c = *p;
+    if (c == 0x1B) {
+      p = file_scan_escape(view, p, eol);
+      continue;
+    }
+    ++p;
+    if (c == '\t') {
+      int next = min((view->cursor_x / view->tab_size + 1) * view->tab_size, terminal->columns);
+      cells_fill(&row[min(view->cursor_x, terminal->columns)], next - view->cursor_x, view_blank_cell(view));
+      view->cursor_x = max(next, view->cursor_x);
+      continue;
+    }
+    if (c == '\r') {
+      view->cursor_x = 0;
+      continue;
+    }
+    if (c < 0x20 || c == 0x7F)
+      continue;
+    unsigned int codepoint = c;
+    if (c >= 0x80) {
+      int length = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+      // The mapping ends with the file; a sequence cut short mustn't have us reading past it.
+      if (length == 1 || eol - (p - 1) < length) {
+        codepoint = 0xFFFD;
+      } else {
+        p += utf8_to_codepoint(p - 1, &codepoint) - 1;
+        if (codepoint > 0x10FFFF)
+          codepoint = 0xFFFD;
       }
-      int max_lines = min(terminal->lines, lines);
-      for (int y = 0; y < max_lines; ++y)
-        memcpy(&buffer[y*columns], &terminal->views[i].buffer[y*terminal->columns], min(terminal->columns, columns)*sizeof(buffer_char_t));
-      free(terminal->views[i].buffer);
     }
-    terminal->views[i].buffer = buffer;
-    terminal->views[i].cursor_x = min(terminal->views[i].cursor_x, columns - 1);
-    terminal->views[i].cursor_y = min(terminal->views[i].cursor_y, lines - 1);
-    if (terminal->views[i].scrolling_region_end != -1 || terminal->views[i].scrolling_region_end != -1) {
-      terminal->views[i].scrolling_region_start = min(terminal->views[i].scrolling_region_start, lines - 1);
-      terminal->views[i].scrolling_region_end = min(terminal->views[i].scrolling_region_end, lines);
+    int width = min(codepoint_width(codepoint), terminal->columns);
+    if (view->overflows[y])
+      continue;
+    if (width == 0 || terminal_joins_previous(terminal, view)) {
+      terminal_join_codepoint(terminal, view, codepoint);
+      continue;
     }
-    terminal->views[i].overflows = calloc(lines * sizeof(int), 1);
+    if (view->cursor_x + width > terminal->columns) {
+      // Past the edge, we only keep going for the styling.
+      view->overflows[y] = 1;
+      continue;
+    }
+    row[view->cursor_x] = (buffer_char_t){ view->cursor_styling, codepoint };
+    if (width == 2)
+      row[view->cursor_x + 1] = (buffer_char_t){ view->cursor_styling, LIBTERMINAL_WIDE_CONTINUATION };
+    view->cursor_x += width;
   }
-  terminal->columns = columns;
-  terminal->lines = lines;
 }
 
-static char error_step[64];
-static int set_error_step(const char* step) { strncpy(error_step, step, sizeof(error_step)); return 1; }
-#if _WIN32
-  long long last_error_code;
-  static const char* terminal_get_last_error() {
-    static char error_buffer[2048];
-    strcpy(error_buffer, error_step);
-    int len = strlen(error_buffer);
-    error_buffer[len++] = ':';
-    error_buffer[len++] = ' ';
-    FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, last_error_code, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&error_buffer[len], sizeof(error_buffer) - (len + 1), NULL);
-    return error_buffer;
+// Redraws the screen from the file, starting at the top line; anything the thread hasn't got to yet is left blank for now.
+static void terminal_draw_file(terminal_t* terminal) {
+  file_view_t* file = terminal->file;
+  view_t* view = &terminal->views[VIEW_NORMAL_BUFFER];
+  pthread_mutex_lock(&file->mutex);
+  int64_t checkpoint_index = min(file->top / LIBTERMINAL_FILE_CHECKPOINT_LINES, file->checkpoint_count - 1);
+  file_checkpoint_t checkpoint = checkpoint_index >= 0 ? file->checkpoints[checkpoint_index] : (file_checkpoint_t){ 0, LIBTERMINAL_NO_STYLING, 0 };
+  int64_t line_count = file->line_count;
+  const char *p = &file->data[checkpoint.offset], *end = file->data + file->length;
+  pthread_mutex_unlock(&file->mutex);
+  view->cursor_styling = checkpoint.styling;
+  view->cursor_styling_inversed = checkpoint.styling_inversed;
+  // Nothing that changes after sigsetjmp is read again after a jump back to it, other than how far down the screen we'd got.
+  volatile int y = 0;
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 1)) {
+    // The file shrank before we noticed; whatever's past its new end is left blank, and the next update picks up the rest.
+    file_fault_jump = NULL;
+    file_check_length(file);
+    for (int blank = y; blank < terminal->lines; ++blank) {
+      cells_fill(&view->buffer[blank * terminal->columns], terminal->columns, (buffer_char_t){ LIBTERMINAL_NO_STYLING, 0 });
+      view->overflows[blank] = 0;
+    }
+  } else {
+    file_fault_jump = &jump;
+    int64_t line = max(checkpoint_index, 0) * LIBTERMINAL_FILE_CHECKPOINT_LINES;
+    for (; line < file->top && line < line_count; ++line)
+      p = file_scan_line(view, p, end);
+    for (; y < terminal->lines; ++y, ++line) {
+      if (line < file->top || line >= line_count) {
+        cells_fill(&view->buffer[y * terminal->columns], terminal->columns, (buffer_char_t){ LIBTERMINAL_NO_STYLING, 0 });
+        view->overflows[y] = 0;
+        continue;
+      }
+      const char* eol = memchr(p, '\n', end - p);
+      if (!eol)
+        eol = end;
+      terminal_draw_file_line(terminal, view, y, p, eol);
+      p = eol == end ? end : eol + 1;
+    }
+    file_fault_jump = NULL;
   }
-#else
-  // TODO, non-windows error handling, but less important because windows will be failing lots more, 'cause it's shit.
-  static const char* terminal_get_last_error() { return error_step; }
-#endif
+  // Line ids are lines of the file, so selections stay with the text as we scroll through it.
+  terminal->line_id_base = file->top;
+  view->cursor_x = view->cursor_y = 0;
+  view->cursor_mode = CURSOR_HIDDEN;
+}
 
-static terminal_t* terminal_new(int columns, int lines, int scrollback_limit, const char* term_env, const char* pathname, const char** argv, const char** environment) {
-  terminal_t* terminal = calloc(sizeof(terminal_t), 1);
-  for (int i = 0; i < VIEW_MAX; ++i) {
-    for (int j = 0; j < 256; ++j)
-      terminal->views[i].palette[j] = indexed_color(j);
-    terminal->views[i].scrolling_region_end = -1;
-    terminal->views[i].scrolling_region_start = -1;
-    terminal->views[i].cursor_styling = LIBTERMINAL_NO_STYLING;
-    terminal->views[i].tab_size = LIBTERMINAL_DEFAULT_TAB_SIZE;
+// Works out how far back views are scrolled from the top line, which is what we hold steady as lines come in, or as we're resized.
+static void terminal_layout_file(terminal_t* terminal) {
+  file_view_t* file = terminal->file;
+  int total = (int)min(max(file->laid_out_line_count - terminal->lines, 0), INT_MAX);
+  file->top = min(file->top, total);
+  terminal->scrollback_total_lines = total;
+  for (viewport_t* viewport = terminal->viewports; viewport; viewport = viewport->next)
+    viewport->scrollback_position = total - file->top;
+}
+
+// Picks up on how far the thread has got. Returns true if there's anything new, even if it's only the extent of the scrollbar.
+static int terminal_update_file(terminal_t* terminal) {
+  file_view_t* file = terminal->file;
+  int shrunk = file_check_length(file);
+  pthread_mutex_lock(&file->mutex);
+  int64_t line_count = file->line_count;
+  pthread_mutex_unlock(&file->mutex);
+  if (!shrunk && line_count == file->laid_out_line_count)
+    return 0;
+  // If the file's shrunk, what's on screen may have gone, and we may have been moved up to what's left.
+  int on_screen = shrunk || line_count < file->laid_out_line_count || file->laid_out_line_count < file->top + terminal->lines;
+  file->laid_out_line_count = line_count;
+  terminal_layout_file(terminal);
+  if (on_screen)
+    terminal_draw_file(terminal);
+  return 1;
+}
+
+static int terminal_scroll_file(terminal_t* terminal, viewport_t* viewport, int target) {
+  viewport->scrollback_position = min(max(target, 0), terminal->scrollback_total_lines);
+  int64_t top = terminal->scrollback_total_lines - viewport->scrollback_position;
+  if (top != terminal->file->top) {
+    terminal->file->top = top;
+    terminal_draw_file(terminal);
   }
-  terminal->scrollback_limit = scrollback_limit;
-  terminal->mode = pathname && strcmp(pathname, "DUMMY") != 0 ? MODE_PTY : MODE_DUMMY;
-  if (terminal->mode == MODE_PTY) {
-    #ifdef _WIN32
-      last_error_code = 0;
-      HRESULT result = S_OK;
-      SECURITY_ATTRIBUTES no_sec = { .nLength = sizeof(SECURITY_ATTRIBUTES), .bInheritHandle = TRUE, .lpSecurityDescriptor = NULL };
-      HANDLE out_pipe_pseudo_console_side, in_pipe_pseudo_console_side;
-      COORD size = { columns, lines };
-      if ((!CreatePipe(&in_pipe_pseudo_console_side, &terminal->topty, &no_sec, 0) || !CreatePipe(&terminal->frompty, &out_pipe_pseudo_console_side, &no_sec, 0)) && set_error_step("create pipes"))
-        goto error;
-      result = CreatePseudoConsole(size, in_pipe_pseudo_console_side, out_pipe_pseudo_console_side, 0, &terminal->hpcon);
-      if (FAILED(result) && set_error_step("create pseudoconsole"))
-        goto error;
-      terminal->nonblocking_buffer_mutex = CreateMutex(NULL, FALSE, NULL);
-      if (!terminal->nonblocking_buffer_mutex && set_error_step("create mutex"))
-        goto error;
+  return viewport->scrollback_position;
+}
 
-      HANDLE handles_to_inherit[] = { in_pipe_pseudo_console_side, out_pipe_pseudo_console_side };
-      STARTUPINFOEXW si_ex = {0};
-      si_ex.StartupInfo.cb = sizeof(STARTUPINFOEXW);
-      si_ex.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
-      si_ex.StartupInfo.hStdInput = NULL;
-      si_ex.StartupInfo.hStdOutput = NULL;
-      si_ex.StartupInfo.hStdError = NULL;
-      size_t list_size;
-      // Create the appropriately sized thread attribute list
-      InitializeProcThreadAttributeList(NULL, 2, 0, &list_size);
-      si_ex.lpAttributeList = (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(list_size);
-      BOOL success = InitializeProcThreadAttributeList(si_ex.lpAttributeList, 2, 0, (PSIZE_T)&list_size) &&
-        UpdateProcThreadAttribute(si_ex.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE, terminal->hpcon, sizeof(HPCON), NULL, NULL);
-        UpdateProcThreadAttribute(si_ex.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, handles_to_inherit, sizeof(handles_to_inherit), NULL, NULL);
-      if (!success && set_error_step("update proc attribute list")) {
-        DeleteProcThreadAttributeList(si_ex.lpAttributeList);
-        free(si_ex.lpAttributeList);
-        goto error;
-      }
+static void terminal_close_file(terminal_t* terminal) {
+  file_view_t* file = terminal->file;
+  pthread_mutex_lock(&file->mutex);
+  file->cancelled = 1;
+  pthread_mutex_unlock(&file->mutex);
+  if (file->joinable)
+    pthread_join(file->thread, NULL);
+  pthread_mutex_destroy(&file->mutex);
+  munmap((void*)file->data, file->mapped_length);
+  close(file->fd);
+  free(file->checkpoints);
+  free(file);
+  terminal->file = NULL;
+}
 
-      int len = MultiByteToWideChar(CP_UTF8, 0, pathname, -1, NULL, 0);
-      wchar_t* commandline = malloc(sizeof(wchar_t)*(len+1));
-      len = MultiByteToWideChar(CP_UTF8, 0, pathname, -1, commandline, len);
-      success = CreateProcessW(NULL, commandline, NULL, NULL, TRUE, EXTENDED_STARTUPINFO_PRESENT | CREATE_UNICODE_ENVIRONMENT, (void*)environment[0], NULL, &si_ex.StartupInfo, &terminal->process_information);
-      DeleteProcThreadAttributeList(si_ex.lpAttributeList);
-      free(si_ex.lpAttributeList);
-      free(commandline);
-      if (!success && set_error_step("create process"))
-        goto error;
-      terminal->nonblocking_thread = CreateThread(NULL, 0, windows_nonblocking_thread_callback, terminal, 0, NULL);
-      if (!terminal->nonblocking_thread && set_error_step("create thread"))
-        goto error;
-      error:
-      if (!terminal->nonblocking_thread) {
-        last_error_code = FAILED(result) ? HRESULT_CODE(result) : GetLastError();
-        terminal_close(terminal);
-        free(terminal);
-        return NULL;
-      }
-    #else
-      struct termios term = {0};
-      term.c_cc[VINTR] = 3;
-      term.c_cc[VSTART] = '\x13';
-      term.c_cc[VSTOP] = '\x11';
-      term.c_cc[VSUSP] = 26;
-      term.c_cc[VERASE] = '\x7F';
-      term.c_cc[VEOL] = 0;
-      term.c_cc[VEOF] = 4;
-      term.c_lflag |= ISIG | ECHO | ICANON | IEXTEN | ECHOE | ECHOK | ECHOCTL | ECHOKE;
-      term.c_cflag |= CS8 | CREAD;
-      term.c_iflag |= IUTF8 | ICRNL | IXON;
-      term.c_oflag |= OPOST | ONLCR | NL0 | CR0 | TAB0 | BS0 | VT0 | FF0;
-      terminal->pid = forkpty(&terminal->master, NULL, &term, NULL);
-      if (terminal->pid == -1 && set_error_step("forkpty")) {
-        free(terminal);
-        return NULL;
-      }
-      if (!terminal->pid) {
-        setenv("TERM", term_env, 1);
-        for (int i = 0; i < 256 && environment[i]; i += 2)
-          setenv(environment[i], environment[i+1], 1);
-        execvp(pathname,  (char** const)argv);
-        exit(-1);
-        return NULL;
-      }
-      int flags = fcntl(terminal->master, F_GETFD, 0);
-      fcntl(terminal->master, F_SETFL, flags | O_NONBLOCK);
-    #endif
+// Opens a file read-only, as a terminal. Returns straight away; the file's gone through in the background.
+static terminal_t* terminal_open_file(const char* path, int columns, int lines) {
+  struct stat status;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1 && set_error_step("open file"))
+    return NULL;
+  void* data = fstat(fd, &status) == 0 && status.st_size > 0 ? mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (data == MAP_FAILED) {
+    close(fd);
+    set_error_step(status.st_size == 0 ? "empty file" : "map file");
+    return NULL;
   }
-  terminal_resize(terminal, columns, lines);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  file_install_guard();
+  #ifdef MADV_SEQUENTIAL
+    madvise(data, status.st_size, MADV_SEQUENTIAL);
+  #endif
+  file_view_t* file = calloc(1, sizeof(file_view_t));
+  file->data = data;
+  file->length = file->mapped_length = status.st_size;
+  file->fd = fd;
+  file->joinable = 1;
+  pthread_mutex_init(&file->mutex, NULL);
+  if (pthread_create(&file->thread, NULL, file_index_thread, file)) {
+    pthread_mutex_destroy(&file->mutex);
+    munmap(data, status.st_size);
+    close(fd);
+    free(file);
+    set_error_step("create thread");
+    return NULL;
+  }
+  const char* dummy_arguments[] = { "DUMMY", NULL };
+  terminal_t* terminal = terminal_new(columns, lines, 0, "DUMMY", "DUMMY", dummy_arguments, NULL);
+  terminal->mode = MODE_FILE;
+  terminal->file = file;
+  const char* name = strrchr(path, '/');
+  snprintf(terminal->name, sizeof(terminal->name), "%s", name ? name + 1 : path);
+  terminal_draw_file(terminal);
   return terminal;
 }
+#endif
 
+// Wide characters and clusters are handed to lua as groups of their own, flagged, so that lua doesn't have to work out how many
+// columns a group of text spans.
+static int output_cell_class(buffer_char_t* cell, buffer_char_t* end) {
+  return ((cell->codepoint & LIBTERMINAL_CLUSTER_FLAG) ? ATTRIBUTE_CLUSTER : 0) |
+    (cell->codepoint != LIBTERMINAL_WIDE_CONTINUATION && cell + 1 < end && cell[1].codepoint == LIBTERMINAL_WIDE_CONTINUATION ? ATTRIBUTE_WIDE : 0);
+}
 
-static void output_line(lua_State* L, buffer_char_t* start, buffer_char_t* end, int overflows) {
+static void output_line(lua_State* L, terminal_t* terminal, buffer_char_t* start, buffer_char_t* end, int overflows) {
   lua_newtable(L);
-  int block_size = 0;
+  int block_size = 0, block_cells = 0, block_class = 0;
   int last_nonzero_codepoint = 0;
   int group = 0;
-  char text_buffer[LIBTERMINAL_MAX_LINE_WIDTH] = {0};
+  // Each cell comes out as, at most, a whole cluster of four byte codepoints.
+  char* text_buffer = scratch_reserve((size_t)(end - start) * LIBTERMINAL_MAX_CLUSTER_LENGTH * 4);
   buffer_styling_t style = start->styling;
   while (1) {
-    if (start >= end || start->styling.value != style.value) {
+    int cell_class = start < end ? output_cell_class(start, end) : 0;
+    if (start >= end || (block_cells > 0 && (start->styling.value != style.value || cell_class || block_class))) {
       uint64_t packed = (
-        ((uint64_t)style.foreground.attributes << 56) |
+        ((uint64_t)(style.foreground.attributes | block_class) << 56) |
         ((uint64_t)style.foreground.r << 48) |
         ((uint64_t)style.foreground.g << 40) |
         ((uint64_t)style.foreground.b << 32) |
@@ -1268,15 +4451,22 @@ static void output_line(lua_State* L, buffer_char_t* start, buffer_char_t* end,
       }
       lua_rawseti(L, -2, ++group);
       block_size = 0;
+      block_cells = 0;
       last_nonzero_codepoint = 0;
       if (start >= end)
         break;
       style = start->styling;
     }
-    block_size += codepoint_to_utf8(start->codepoint != 0 ? start->codepoint : ' ', &text_buffer[block_size]);
+    block_class = cell_class;
+    // The right half of a wide character whose left half has been overwritten stands in as a space.
+    if (start->codepoint == LIBTERMINAL_WIDE_CONTINUATION)
+      block_size += codepoint_to_utf8(' ', &text_buffer[block_size]);
+    else
+      block_size += cell_to_utf8(terminal, start->codepoint, &text_buffer[block_size]);
     if (start->codepoint != 0)
       last_nonzero_codepoint = block_size;
-    ++start;
+    ++block_cells;
+    start += (cell_class & ATTRIBUTE_WIDE) ? 2 : 1;
   }
 }
 
@@ -1288,9 +4478,29 @@ static terminal_t* lua_toterminal(lua_State* L, int index) {
   return terminal;
 }
 
+static viewport_t* lua_toviewport(lua_State* L, int index) {
+  lua_getfield(L, index, "__viewport");
+  viewport_t* viewport = (viewport_t*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (!viewport)
+    luaL_error(L, "terminal has been closed");
+  return viewport;
+}
+
+static void lua_pushterminal(lua_State* L, terminal_t* terminal, viewport_t* viewport) {
+  lua_newtable(L);
+  lua_pushlightuserdata(L, terminal);
+  lua_setfield(L, -2, "__terminal");
+  lua_pushlightuserdata(L, viewport);
+  lua_setfield(L, -2, "__viewport");
+  luaL_setmetatable(L, "libterminal");
+  ++terminal->references;
+}
+
 static int f_terminal_lines(lua_State* L) {
   terminal_t* terminal = lua_toterminal(L, 1);
-  int start = -terminal->scrollback_position;
+  viewport_t* viewport = lua_toviewport(L, 1);
+  int start = -viewport->scrollback_position;
   if (lua_gettop(L) >= 2)
     start = luaL_checkinteger(L, 2);
   int end = start + terminal->lines;
@@ -1302,27 +4512,31 @@ static int f_terminal_lines(lua_State* L) {
   int remaining_lines = end - start;
   view_t* view = &terminal->views[terminal->current_view];
   if (terminal->current_view == VIEW_NORMAL_BUFFER && start < 0) {
-    int top_offset = terminal->scrollback_target_top_offset;
+    int top_offset = viewport->scrollback_target_top_offset;
     int offset = -start;
-    backbuffer_page_t* current_backbuffer = terminal_find_scrollback_page(terminal, terminal->scrollback_target, &offset, &top_offset);
+    backbuffer_page_t* current_backbuffer = terminal_find_scrollback_page(terminal, viewport->scrollback_target, &offset, &top_offset);
     int lines_into_buffer = top_offset - offset;
-    while (current_backbuffer) {
-      int* backbuffer_overflows = (int*)&current_backbuffer->buffer[LIBTERMINAL_BACKBUFFER_PAGE_LINES*current_backbuffer->columns];
-      for (int y = lines_into_buffer; y < current_backbuffer->line; ++y) {
-        output_line(L, &current_backbuffer->buffer[y * current_backbuffer->columns], &current_backbuffer->buffer[(y+1) * current_backbuffer->columns], backbuffer_overflows[y]);
+    while (current_backbuffer && remaining_lines > 0) {
+      int* backbuffer_overflows = backbuffer_page_overflows(current_backbuffer);
+      for (int y = lines_into_buffer; y < current_backbuffer->line && remaining_lines > 0; ++y, --remaining_lines) {
+        output_line(L, terminal, &current_backbuffer->buffer[y * current_backbuffer->columns], &current_backbuffer->buffer[(y+1) * current_backbuffer->columns], backbuffer_overflows[y]);
         lua_rawseti(L, -2, ++total_lines);
-        if (remaining_lines == 0)
-          break;
       }
       current_backbuffer = current_backbuffer->next;
       lines_into_buffer = 0;
     }
     start = 0;
+  } else if (start < 0) {
+    // There's no scrollback to the alternate buffer.
+    remaining_lines += start;
+    start = 0;
   }
-  if (remaining_lines > 0) {
-    remaining_lines = min(remaining_lines, terminal->lines);
+  if (remaining_lines > 0 && start < terminal->lines) {
+    remaining_lines = min(remaining_lines, terminal->lines - start);
+    buffer_char_t* buffer = terminal_is_synchronized(terminal) ? terminal->frame : view->buffer;
+    int* overflows = terminal_is_synchronized(terminal) ? terminal->frame_overflows : view->overflows;
     for (int y = 0; y < remaining_lines; ++y) {
-      output_line(L, &view->buffer[(y + start) * terminal->columns], &view->buffer[(y + start + 1) * terminal->columns], view->overflows[y + start]);
+      output_line(L, terminal, &buffer[(y + start) * terminal->columns], &buffer[(y + start + 1) * terminal->columns], overflows[y + start]);
       lua_rawseti(L, -2, ++total_lines);
     }
   }
@@ -1368,22 +4582,28 @@ static const char* lua_toutf8(lua_State* L, LPCWSTR str) {
 }
 #endif
 
-static int f_terminal_new(lua_State* L) {
-  int x = luaL_checkinteger(L, 1);
-  int y = luaL_checkinteger(L, 2);
-  int scrollback_limit = luaL_checkinteger(L, 3);
+static uint64_t hash_string(uint64_t hash, const char* str, size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ (unsigned char)str[i]) * 1099511628211ULL;
+  return hash;
+}
+
+// Reads the shell, arguments and environment common to new and prespawn, and returns a hash of everything that determines what
+// gets spawned. On windows, environment[0] is the UTF-16 block; otherwise, it's alternating keys and values.
+static uint64_t lua_toterminalspawn(lua_State* L, char** arguments, char** environment) {
   const char* term_env = luaL_checkstring(L, 4);
   const char* path = luaL_checkstring(L, 5);
-  char* arguments[256] = {0};
-  char* environment[256] = {0};
+  uint64_t hash = hash_string(14695981039346656037ULL, term_env, strlen(term_env) + 1);
+  hash = hash_string(hash, path, strlen(path) + 1);
   arguments[0] = (char*)path;
   arguments[1] = NULL;
   if (lua_type(L, 6) == LUA_TTABLE) {
-    for (int i = 0; i < 255; ++i) {
+    for (int i = 0; i < 254; ++i) {
       lua_rawgeti(L, 6, i+1);
       if (!lua_isnil(L, -1)) {
         const char* str = luaL_checkstring(L, -1);
         arguments[i+1] = strdup(str);
+        hash = hash_string(hash, str, strlen(str) + 1);
         lua_pop(L, 1);
       } else {
         lua_pop(L, 1);
@@ -1395,6 +4615,7 @@ static int f_terminal_new(lua_State* L) {
   #if _WIN32
     size_t envlen;
     const char* env = luaL_checklstring(L, 7, &envlen);
+    hash = hash_string(hash, env, envlen);
     if (lua_tolutf16(L, env, envlen)) {
       size_t utf16len;
       const char* utf16 = lua_tolstring(L, -1, &utf16len);
@@ -1406,26 +4627,233 @@ static int f_terminal_new(lua_State* L) {
     luaL_checktype(L, 7, LUA_TTABLE);
     lua_pushnil(L); 
     int i = 0;
-    while (lua_next(L, 7) != 0 && i < 255) {
-      environment[i] = strdup(lua_tostring(L, -2));
-      environment[i+1] = strdup(lua_tostring(L, -1));
+    // Table order isn't stable, so each pair is hashed on its own, and combined in a way that doesn't depend on order.
+    uint64_t environment_hash = 0;
+    while (i < 254 && lua_next(L, 7) != 0) {
+      // Numbers are converted to strings in place, which would confuse lua_next if done to the key, and leave the string only
+      // as long as the stack slot; so keys are converted as a copy, and both are duplicated.
+      lua_pushvalue(L, -2);
+      environment[i] = strdup(luaL_checkstring(L, -1));
+      environment[i+1] = strdup(luaL_checkstring(L, -2));
+      lua_pop(L, 1);
+      environment_hash += hash_string(hash_string(14695981039346656037ULL, environment[i], strlen(environment[i]) + 1), environment[i+1], strlen(environment[i+1]));
       i = i + 2;
       lua_pop(L, 1);
     }
+    hash ^= environment_hash;
   #endif
-  int debug = lua_toboolean(L, 7);
-  terminal_t* terminal = terminal_new(x, y, scrollback_limit, term_env, path, (const char**)arguments, (const char**)environment);
-  for (int i = 1; i < 256 && arguments[i]; ++i)
+  return hash;
+}
+
+static void free_terminal_spawn(char** arguments, char** environment) {
+  for (int i = 1; arguments[i]; ++i)
     free(arguments[i]);
-  for (int i = 1; i < 256 && environment[i]; ++i)
+  for (int i = 0; environment[i]; ++i)
     free(environment[i]);
+}
+
+static int f_terminal_new(lua_State* L) {
+  int x = luaL_checkinteger(L, 1);
+  int y = luaL_checkinteger(L, 2);
+  int scrollback_limit = luaL_checkinteger(L, 3);
+  const char* term_env = luaL_checkstring(L, 4);
+  const char* path = luaL_checkstring(L, 5);
+  char* arguments[256] = {0};
+  char* environment[256] = {0};
+  uint64_t spawn_key = lua_toterminalspawn(L, arguments, environment);
+  int debug = lua_toboolean(L, 8);
+  terminal_t* terminal = terminal_pool_take(spawn_key, x, y, scrollback_limit);
+  if (!terminal)
+    terminal = terminal_new(x, y, scrollback_limit, term_env, path, (const char**)arguments, (const char**)environment);
+  free_terminal_spawn(arguments, environment);
   if (!terminal)
     return luaL_error(L, "error creating terminal: %s", terminal_get_last_error());
+  terminal_register(terminal);
+  terminal->debug = debug;
+  viewport_t* viewport = terminal_attach(terminal, x, y);
+  if (!viewport) {
+    terminal_free(terminal);
+    return luaL_error(L, "error creating terminal: out of memory");
+  }
+  lua_pushterminal(L, terminal, viewport);
+  return 1;
+}
+
+#ifndef _WIN32
+// Takes the same arguments as new, followed by the daemon's socket, the session to attach to, or nil to spawn a new one, and the
+// path to the daemon, to start it if it isn't running.
+static int f_terminal_connect(lua_State* L) {
+  int x = luaL_checkinteger(L, 1);
+  int y = luaL_checkinteger(L, 2);
+  int scrollback_limit = luaL_checkinteger(L, 3);
+  const char* term_env = luaL_checkstring(L, 4);
+  const char* path = luaL_checkstring(L, 5);
+  char* arguments[256] = {0};
+  char* environment[256] = {0};
+  lua_toterminalspawn(L, arguments, environment);
+  int debug = lua_toboolean(L, 8);
+  const char* socket_path = luaL_checkstring(L, 9);
+  int session = luaL_optinteger(L, 10, 0);
+  const char* daemon_path = luaL_optstring(L, 11, NULL);
+  terminal_t* terminal = terminal_remote_new(socket_path, daemon_path, session, x, y, scrollback_limit, term_env, path, (const char**)arguments, (const char**)environment);
+  free_terminal_spawn(arguments, environment);
+  if (!terminal) {
+    lua_pushnil(L);
+    lua_pushstring(L, terminal_get_last_error());
+    return 2;
+  }
+  terminal_register(terminal);
   terminal->debug = debug;
+  viewport_t* viewport = terminal_attach(terminal, x, y);
+  if (!viewport) {
+    terminal_free(terminal);
+    return luaL_error(L, "error creating terminal: out of memory");
+  }
+  lua_pushterminal(L, terminal, viewport);
+  return 1;
+}
+
+// Returns the sessions left running in the daemon with nothing attached, as { id, name, exited }, or nil if it isn't running.
+static int f_terminal_sessions(lua_State* L) {
+  uint32_t length;
+  char* sessions = terminal_remote_sessions(luaL_checkstring(L, 1), &length);
+  if (!sessions)
+    return 0;
   lua_newtable(L);
-  lua_pushlightuserdata(L, terminal);
-  lua_setfield(L, -2, "__terminal");
-  luaL_setmetatable(L, "libterminal");
+  int count = 0;
+  for (uint32_t offset = 0; length - offset > sizeof(int32_t) * 2; ) {
+    int32_t numbers[2];
+    memcpy(numbers, &sessions[offset], sizeof(numbers));
+    offset += sizeof(numbers);
+    const char* name = &sessions[offset];
+    offset += strlen(name) + 1;
+    lua_newtable(L);
+    lua_pushinteger(L, numbers[0]);
+    lua_setfield(L, -2, "id");
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "name");
+    lua_pushboolean(L, numbers[1]);
+    lua_setfield(L, -2, "exited");
+    lua_rawseti(L, -2, ++count);
+  }
+  free(sessions);
+  return 1;
+}
+
+static int f_terminal_session(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (terminal->mode != MODE_REMOTE)
+    return 0;
+  lua_pushinteger(L, terminal->session);
+  return 1;
+}
+#endif
+
+// Returns a snapshot of the terminal, as a string, or if given a path, writes it there, and returns true, or nil and an error.
+static int f_terminal_snapshot(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    if (terminal_save_snapshot(terminal, lua_tostring(L, 2))) {
+      lua_pushnil(L);
+      lua_pushstring(L, terminal_get_last_error());
+      return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  luaL_Buffer b;
+  size_t length = terminal_write_snapshot(terminal, NULL);
+  char* target = luaL_buffinitsize(L, &b, length);
+  terminal_write_snapshot(terminal, target);
+  luaL_pushresultsize(&b, length);
+  return 1;
+}
+
+// Restores a snapshot, as returned by snapshot, or from a file, if the second argument is true, into a new dummy terminal, sized
+// as the original was. Returns nil and an error if the snapshot can't be read.
+static int f_terminal_restore(lua_State* L) {
+  size_t length;
+  const char* data = luaL_checklstring(L, 1, &length);
+  terminal_t* terminal = lua_toboolean(L, 2) ? terminal_restore_file(data) : terminal_restore(data, length);
+  if (!terminal) {
+    lua_pushnil(L);
+    lua_pushstring(L, terminal_get_last_error());
+    return 2;
+  }
+  terminal_register(terminal);
+  viewport_t* viewport = terminal_attach(terminal, terminal->columns, terminal->lines);
+  if (!viewport) {
+    terminal_free(terminal);
+    return luaL_error(L, "error creating terminal: out of memory");
+  }
+  lua_pushterminal(L, terminal, viewport);
+  return 1;
+}
+
+// Opens a file, such as a log, read-only, in a terminal of the given size. Returns nil and an error if it can't be read.
+static int f_terminal_open(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  #if _WIN32
+    lua_pushnil(L);
+    lua_pushliteral(L, "not supported on windows");
+    return 2;
+  #else
+    terminal_t* terminal = terminal_open_file(path, x, y);
+    if (!terminal) {
+      lua_pushnil(L);
+      lua_pushstring(L, terminal_get_last_error());
+      return 2;
+    }
+    terminal_register(terminal);
+    viewport_t* viewport = terminal_attach(terminal, x, y);
+    if (!viewport) {
+      terminal_free(terminal);
+      return luaL_error(L, "error creating terminal: out of memory");
+    }
+    lua_pushterminal(L, terminal, viewport);
+    return 1;
+  #endif
+}
+
+// Returns another handle on the same terminal, with a viewport of its own; it scrolls and selects independently, and asks for a
+// size of its own, but shares everything else. The shell is only closed once every handle on it has been.
+static int f_terminal_attach(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (!terminal->viewports)
+    return luaL_error(L, "terminal has been closed");
+  viewport_t* viewport = terminal_attach(terminal, luaL_optinteger(L, 2, 0), luaL_optinteger(L, 3, 0));
+  if (!viewport)
+    return luaL_error(L, "error attaching to terminal: out of memory");
+  lua_pushterminal(L, terminal, viewport);
+  return 1;
+}
+
+// Takes the same arguments as new, followed by the amount of matching terminals we'd like in the pool. Spawns at most one, so
+// that the caller can spread the cost out, and returns how many are now waiting. Any that don't match are closed.
+static int f_terminal_prespawn(lua_State* L) {
+  int x = luaL_checkinteger(L, 1);
+  int y = luaL_checkinteger(L, 2);
+  int scrollback_limit = luaL_checkinteger(L, 3);
+  const char* term_env = luaL_checkstring(L, 4);
+  const char* path = luaL_checkstring(L, 5);
+  char* arguments[256] = {0};
+  char* environment[256] = {0};
+  uint64_t spawn_key = lua_toterminalspawn(L, arguments, environment);
+  int target = luaL_optinteger(L, 8, 1);
+  terminal_pool_discard(spawn_key);
+  int count = terminal_pool_count(spawn_key);
+  if (count < target) {
+    terminal_t* terminal = terminal_new(x, y, scrollback_limit, term_env, path, (const char**)arguments, (const char**)environment);
+    free_terminal_spawn(arguments, environment);
+    if (!terminal)
+      return luaL_error(L, "error creating terminal: %s", terminal_get_last_error());
+    terminal_pool_add(terminal, spawn_key);
+    ++count;
+  } else
+    free_terminal_spawn(arguments, environment);
+  lua_pushinteger(L, count);
   return 1;
 }
 
@@ -1452,12 +4880,42 @@ static int f_terminal_getenv(lua_State* L) {
 
 
 static int f_terminal_gc(lua_State* L) {
-  terminal_free(lua_toterminal(L, 1));
+  terminal_t* terminal = lua_toterminal(L, 1);
+  lua_getfield(L, 1, "__viewport");
+  viewport_t* viewport = (viewport_t*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (viewport)
+    terminal_detach(terminal, viewport);
+  if (--terminal->references == 0)
+    terminal_free(terminal);
   return 0;
 }
 
+// Closes this handle's viewport; the shell itself is only closed along with the last one. Closing a remote terminal ends its
+// session in the daemon; one that's only collected, as when the editor quits, is left running there, detached.
 static int f_terminal_close(lua_State* L) {
-  lua_pushinteger(L, terminal_close(lua_toterminal(L, 1)));
+  terminal_t* terminal = lua_toterminal(L, 1);
+  terminal_detach(terminal, lua_toviewport(L, 1));
+  lua_pushnil(L);
+  lua_setfield(L, 1, "__viewport");
+  #ifndef _WIN32
+    if (!terminal->viewports && terminal->mode == MODE_REMOTE && terminal->master) {
+      terminal_queue_remote_frame(terminal, REMOTE_FRAME_KILL, "", 0);
+      terminal_flush_input(terminal);
+    }
+  #endif
+  lua_pushinteger(L, terminal->viewports ? 0 : terminal_close(terminal));
+  return 1;
+}
+
+// Reaps the shells of closed terminals as they exit, and kills the ones that ignore SIGHUP for too long; returns how many are left.
+// Updating any terminal does this as well, so it's only needed when there are none left to update.
+static int f_terminal_reap(lua_State* L) {
+  #ifndef _WIN32
+    lua_pushinteger(L, orphan_count > 0 ? terminal_reap_orphans() : 0);
+  #else
+    lua_pushinteger(L, 0);
+  #endif
   return 1;
 }
 
@@ -1472,25 +4930,56 @@ static int f_terminal_update(lua_State* L){
     status = terminal_update(lua_toterminal(L, 1), chunk_update, L, &total_shifts);
   else
     status = terminal_update(lua_toterminal(L, 1), NULL, NULL, &total_shifts);
+  // Nothing we read while output is synchronized is drawn until the frame is complete, so there's nothing to redraw until then.
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (terminal_is_synchronized(terminal)) {
+    terminal->synchronized_damage |= status != 0;
+    status = 0;
+  } else if (terminal->synchronized_damage) {
+    terminal->synchronized_damage = 0;
+    status = 1;
+  }
   if (status != 0)
     lua_pushinteger(L, total_shifts);
   else
     lua_pushboolean(L, 0);
+  #ifndef _WIN32
+    // The update that notices the shell exiting reports it, the same way as exited.
+    if (terminal->exited && !terminal->exit_reported) {
+      terminal->exit_reported = 1;
+      lua_pushinteger(L, WIFEXITED(terminal->exit_status) ? WEXITSTATUS(terminal->exit_status) : -1);
+      lua_pushinteger(L, WIFSIGNALED(terminal->exit_status) ? WTERMSIG(terminal->exit_status) : -1);
+      return 3;
+    }
+  #endif
   return 1;
 }
 
+// Keystrokes start the latency probe; focus reports, replies and flushing what's pending with an empty string don't.
 static int f_terminal_input(lua_State* L) {
   size_t len;
+  terminal_t* terminal = lua_toterminal(L, 1);
   const char* str = luaL_checklstring(L, 2, &len);
-  terminal_input(lua_toterminal(L, 1), str, (int)len);
-  return 0;
+  if (len > 0 && !terminal->latency_input && (terminal->mode == MODE_PTY || terminal->mode == MODE_REMOTE))
+    terminal->latency_input = terminal_get_monotonic_time();
+  lua_pushinteger(L, terminal_input(terminal, str, (int)len));
+  return 1;
+}
+
+static int f_terminal_paste(lua_State* L) {
+  size_t len;
+  const char* str = luaL_checklstring(L, 2, &len);
+  lua_pushinteger(L, terminal_paste(lua_toterminal(L, 1), str, (int)len));
+  return 1;
 }
 
 static int f_terminal_size(lua_State* L) {
   terminal_t* terminal = lua_toterminal(L, 1);
   if (lua_gettop(L) > 1) {
-    int x = luaL_checkinteger(L, 2), y = luaL_checkinteger(L, 3);
-    terminal_resize(terminal, x, y);
+    viewport_t* viewport = lua_toviewport(L, 1);
+    viewport->columns = luaL_checkinteger(L, 2);
+    viewport->lines = luaL_checkinteger(L, 3);
+    terminal_fit_viewports(terminal);
   }
   lua_pushinteger(L, terminal->columns);
   lua_pushinteger(L, terminal->lines);
@@ -1507,10 +4996,9 @@ static int f_terminal_exited(lua_State* L) {
     } else
       lua_pushboolean(L, 0);
   #else
-    int status;
-    if (waitpid(terminal->pid, &status, WNOHANG) > 0) {
-      lua_pushinteger(L, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
-      lua_pushinteger(L, WIFSIGNALED(status) ? WTERMSIG(status) : -1);
+    if ((terminal->mode == MODE_PTY && terminal_reap(terminal)) || (terminal->mode == MODE_REMOTE && terminal->exited)) {
+      lua_pushinteger(L, WIFEXITED(terminal->exit_status) ? WEXITSTATUS(terminal->exit_status) : -1);
+      lua_pushinteger(L, WIFSIGNALED(terminal->exit_status) ? WTERMSIG(terminal->exit_status) : -1);
       return 2;
     } else
       lua_pushboolean(L, 0);
@@ -1520,9 +5008,11 @@ static int f_terminal_exited(lua_State* L) {
 
 static int f_terminal_cursor(lua_State* L) {
   terminal_t* terminal = lua_toterminal(L, 1);
-  lua_pushinteger(L, terminal->views[terminal->current_view].cursor_x);
-  lua_pushinteger(L, terminal->views[terminal->current_view].cursor_y);
-  switch (terminal->views[terminal->current_view].cursor_mode) {
+  view_t* view = &terminal->views[terminal->current_view];
+  int synchronized = terminal_is_synchronized(terminal);
+  lua_pushinteger(L, synchronized ? terminal->frame_cursor_x : view->cursor_x);
+  lua_pushinteger(L, synchronized ? terminal->frame_cursor_y : view->cursor_y);
+  switch (synchronized ? terminal->frame_cursor_mode : view->cursor_mode) {
     case CURSOR_SOLID: lua_pushliteral(L, "solid"); break;
     case CURSOR_HIDDEN: lua_pushliteral(L, "hidden"); break;
     case CURSOR_BLINKING: lua_pushliteral(L, "blinking"); break;
@@ -1550,10 +5040,11 @@ static int f_terminal_keypad_keys_mode(lua_State* L) {
 
 static int f_terminal_scrollback(lua_State* L) {
   terminal_t* terminal = lua_toterminal(L, 1);
+  viewport_t* viewport = lua_toviewport(L, 1);
   if (terminal->current_view == VIEW_NORMAL_BUFFER) {
     if (lua_gettop(L) >= 2)
-      terminal_scrollback(terminal, luaL_checkinteger(L, 2));
-    lua_pushinteger(L, terminal->scrollback_position);
+      terminal_scrollback(terminal, viewport, luaL_checkinteger(L, 2));
+    lua_pushinteger(L, viewport->scrollback_position);
     lua_pushinteger(L, terminal->scrollback_total_lines);
   } else {
     lua_pushinteger(L, 0);
@@ -1569,6 +5060,209 @@ static int f_terminal_focused(lua_State* L) {
   return 0;
 }
 
+static int f_terminal_select(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (lua_isnoneornil(L, 2))
+    terminal_select(terminal, lua_toviewport(L, 1), 0, 0, SELECTION_NONE);
+  else {
+    static const char* modes[] = { "character", "word", "line", NULL };
+    int line = luaL_checkinteger(L, 2), column = luaL_checkinteger(L, 3);
+    terminal_select(terminal, lua_toviewport(L, 1), line, column, SELECTION_CHARACTER + luaL_checkoption(L, 4, "character", modes));
+  }
+  return 0;
+}
+
+static int f_terminal_extend(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  terminal_extend_selection(terminal, lua_toviewport(L, 1), luaL_checkinteger(L, 2), luaL_checkinteger(L, 3));
+  return 0;
+}
+
+// Returns the selection as start column, start line, end column and end line, in the coordinates `lines` uses, or nil.
+static int f_terminal_selection(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  viewport_t* viewport = lua_toviewport(L, 1);
+  if (!terminal_has_selection(terminal, viewport))
+    return 0;
+  lua_pushinteger(L, viewport->selection[0].column);
+  lua_pushinteger(L, viewport->selection[0].line - terminal->line_id_base);
+  lua_pushinteger(L, viewport->selection[1].column);
+  lua_pushinteger(L, viewport->selection[1].line - terminal->line_id_base);
+  return 4;
+}
+
+static int f_terminal_selection_text(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  viewport_t* viewport = lua_toviewport(L, 1);
+  if (!terminal_has_selection(terminal, viewport))
+    return 0;
+  luaL_Buffer b;
+  size_t length = terminal_range_text(terminal, viewport->selection[0], viewport->selection[1], NULL);
+  char* target = luaL_buffinitsize(L, &b, length);
+  terminal_range_text(terminal, viewport->selection[0], viewport->selection[1], target);
+  luaL_pushresultsize(&b, length);
+  return 1;
+}
+
+static void lua_pushcommandpoint(lua_State* L, terminal_t* terminal, selection_point_t point, const char* name) {
+  if (point.line != -1) {
+    lua_pushinteger(L, point.line - terminal->line_id_base);
+    lua_setfield(L, -2, name);
+  }
+}
+
+// Returns the commands we know of, oldest first, as tables with the lines of their prompt, input, output and end, relative to
+// the top of the screen, and their exit code. Lines that haven't been marked are nil.
+static int f_terminal_commands(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  terminal_prune_commands(terminal);
+  lua_createtable(L, terminal->command_count, 0);
+  for (int i = 0; i < terminal->command_count; ++i) {
+    command_t* command = &terminal->commands[i];
+    lua_createtable(L, 0, 5);
+    lua_pushcommandpoint(L, terminal, command->prompt, "prompt");
+    lua_pushcommandpoint(L, terminal, command->input, "input");
+    lua_pushcommandpoint(L, terminal, command->output, "output");
+    lua_pushcommandpoint(L, terminal, command->end, "finish");
+    if (command->exit_code != -1) {
+      lua_pushinteger(L, command->exit_code);
+      lua_setfield(L, -2, "exit");
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+// Returns the line of the nearest prompt before the given line, or after it if direction is positive, or nil.
+static int f_terminal_prompt(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  int index = terminal_find_command(terminal, terminal->line_id_base + luaL_checkinteger(L, 2), luaL_optinteger(L, 3, -1));
+  if (index == -1)
+    return 0;
+  lua_pushinteger(L, terminal->commands[index].prompt.line - terminal->line_id_base);
+  return 1;
+}
+
+// Returns the output of the last command that's finished, or nil.
+static int f_terminal_command_output(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  terminal_prune_commands(terminal);
+  for (int i = terminal->command_count - 1; i >= 0; --i) {
+    command_t* command = &terminal->commands[i];
+    if (command->output.line != -1 && command->end.line != -1) {
+      luaL_Buffer b;
+      size_t length = terminal_range_text(terminal, command->output, command->end, NULL);
+      char* target = luaL_buffinitsize(L, &b, length);
+      terminal_range_text(terminal, command->output, command->end, target);
+      luaL_pushresultsize(&b, length);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns the links that start between two lines, inclusive, relative to the top of the screen. Each is a table of start column,
+// start line, end column (exclusive), end line, type ("url" or "file"), and text.
+static int f_terminal_links(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  int64_t start_line = terminal->line_id_base + luaL_checkinteger(L, 2);
+  int64_t end_line = terminal->line_id_base + luaL_optinteger(L, 3, luaL_checkinteger(L, 2));
+  terminal_prune_links(terminal);
+  lua_newtable(L);
+  int count = 0;
+  for (int i = terminal_find_link(terminal, start_line); i < terminal->link_count && terminal->links[i].start.line <= end_line; ++i) {
+    link_t* link = &terminal->links[i];
+    lua_createtable(L, 6, 0);
+    lua_pushinteger(L, link->start.column);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, link->start.line - terminal->line_id_base);
+    lua_rawseti(L, -2, 2);
+    lua_pushinteger(L, link->end.column);
+    lua_rawseti(L, -2, 3);
+    lua_pushinteger(L, link->end.line - terminal->line_id_base);
+    lua_rawseti(L, -2, 4);
+    lua_pushstring(L, link->type == LINK_URL ? "url" : "file");
+    lua_rawseti(L, -2, 5);
+    luaL_Buffer b;
+    size_t length = terminal_range_text(terminal, link->start, link->end, NULL);
+    char* target = luaL_buffinitsize(L, &b, length);
+    terminal_range_text(terminal, link->start, link->end, target);
+    luaL_pushresultsize(&b, length);
+    lua_rawseti(L, -2, 6);
+    lua_rawseti(L, -2, ++count);
+  }
+  return 1;
+}
+
+// Adds a pattern to match against completed lines, and returns its id. If literal is true, it's a plain substring.
+static int f_terminal_trigger(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  const char* pattern = luaL_checkstring(L, 2);
+  terminal->triggers = realloc(terminal->triggers, sizeof(trigger_t) * (terminal->trigger_count + 1));
+  terminal->triggers[terminal->trigger_count++] = (trigger_t){ ++terminal->trigger_next_id, lua_toboolean(L, 3), strdup(pattern) };
+  lua_pushinteger(L, terminal->trigger_next_id);
+  return 1;
+}
+
+static int f_terminal_untrigger(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  int id = luaL_checkinteger(L, 2);
+  for (int i = 0; i < terminal->trigger_count; ++i) {
+    if (terminal->triggers[i].id == id) {
+      free(terminal->triggers[i].pattern);
+      terminal->triggers[i] = terminal->triggers[--terminal->trigger_count];
+      break;
+    }
+  }
+  return 0;
+}
+
+// Returns, and clears, the events since the last call, as tables of trigger id (0 for a bell), line relative to the top of the
+// screen, and the text of the line; or nil if there were none.
+static int f_terminal_triggered(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (terminal->trigger_event_count == 0)
+    return 0;
+  lua_createtable(L, terminal->trigger_event_count, 0);
+  for (int i = 0; i < terminal->trigger_event_count; ++i) {
+    trigger_event_t* event = &terminal->trigger_events[i];
+    lua_createtable(L, 3, 0);
+    lua_pushinteger(L, event->id);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, event->line - terminal->line_id_base);
+    lua_rawseti(L, -2, 2);
+    if (event->text) {
+      lua_pushstring(L, event->text);
+      lua_rawseti(L, -2, 3);
+      free(event->text);
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  terminal->trigger_event_count = 0;
+  return 1;
+}
+
+// Returns what an application last put on the clipboard with OSC 52, and which selections it was for, once; or nil.
+static int f_terminal_clipboard(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (!terminal->clipboard_ready)
+    return 0;
+  lua_pushlstring(L, terminal->clipboard, terminal->clipboard_length);
+  lua_pushstring(L, terminal->clipboard_target);
+  terminal->clipboard_ready = 0;
+  free(terminal->clipboard);
+  terminal->clipboard = NULL;
+  terminal->clipboard_length = terminal->clipboard_capacity = 0;
+  return 2;
+}
+
+// Converts a line relative to the top of the screen, as passed to `lines`, into its absolute id.
+static int f_terminal_line_id(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  lua_pushinteger(L, terminal->line_id_base + luaL_optinteger(L, 2, 0));
+  return 1;
+}
+
 static int f_terminal_paste_mode(lua_State* L) {
   terminal_t* terminal = lua_toterminal(L, 1);
   lua_pushstring(L, terminal->paste_mode == PASTE_BRACKETED ? "bracketed" : "normal");
@@ -1594,22 +5288,157 @@ static int f_terminal_clear(lua_State* L) {
   return 0;
 }
 
+static int f_terminal_trim(lua_State* L) {
+  lua_pushinteger(L, terminal_trim(lua_toterminal(L, 1)));
+  return 1;
+}
+
+// Returns the amount of bytes this terminal has resident; both the screen buffers, and the scrollback.
+static int f_terminal_memory(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  size_t bytes = sizeof(terminal_t) + terminal->scrollback_bytes;
+  for (int i = 0; i < VIEW_MAX; ++i)
+    bytes += terminal->views[i].buffer_capacity * sizeof(buffer_char_t) + terminal->views[i].overflows_capacity * sizeof(int);
+  lua_pushinteger(L, bytes);
+  lua_pushinteger(L, terminal->scrollback_bytes);
+  return 2;
+}
+
+// Gets or sets the maximum amount of bytes this terminal's scrollback can take up. 0 for no limit.
+static int f_terminal_memory_limit(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  if (lua_gettop(L) >= 2) {
+    lua_Integer limit = luaL_checkinteger(L, 2);
+    terminal->scrollback_bytes_limit = limit > 0 ? limit : 0;
+    terminal_enforce_scrollback_limits(terminal);
+  }
+  lua_pushinteger(L, terminal->scrollback_bytes_limit);
+  return 1;
+}
+
+// Gets or sets the maximum amount of bytes that the scrollback of all terminals combined can take up. 0 for no limit.
+// Returns the limit, and the amount of bytes currently in use.
+static int f_terminal_global_memory_limit(lua_State* L) {
+  if (lua_gettop(L) >= 1) {
+    lua_Integer limit = luaL_checkinteger(L, 1);
+    scrollback_global_bytes_limit = limit > 0 ? limit : 0;
+    if (terminals)
+      terminal_enforce_scrollback_limits(terminals);
+  }
+  lua_pushinteger(L, scrollback_global_bytes_limit);
+  lua_pushinteger(L, scrollback_global_bytes);
+  return 2;
+}
+
+// Starts writing pages that would otherwise be dropped from the scrollback into a temporary file in the specified directory.
+// Optionally takes the maximum amount of lines to keep on disk. Returns false if spilling isn't possible.
+static int f_terminal_spill(lua_State* L) {
+  terminal_t* terminal = lua_toterminal(L, 1);
+  const char* directory = luaL_checkstring(L, 2);
+  int limit = luaL_optinteger(L, 3, 0);
+  #if _WIN32
+    lua_pushboolean(L, 0);
+  #else
+    lua_pushboolean(L, terminal_spill(terminal, directory, limit));
+  #endif
+  return 1;
+}
+
+// Returns which events the application wants reported, if any, and whether they're encoded as SGR.
 static int f_terminal_mouse_tracking_mode(lua_State* L) {
   terminal_t* terminal = lua_toterminal(L, 1);
-  switch (terminal->views[terminal->current_view].mouse_tracking_mode) {
-    case MOUSE_TRACKING_NONE: lua_pushnil(L); break;
+  view_t* view = &terminal->views[terminal->current_view];
+  switch (view->mouse_tracking_mode) {
+    case MOUSE_TRACKING_NONE: lua_pushnil(L); return 1;
     case MOUSE_TRACKING_X10: lua_pushliteral(L, "x10"); break;
     case MOUSE_TRACKING_NORMAL: lua_pushliteral(L, "normal"); break;
-    case MOUSE_TRACKING_SGR: lua_pushliteral(L, "sgr"); break;
+    case MOUSE_TRACKING_BUTTON: lua_pushliteral(L, "button"); break;
+    case MOUSE_TRACKING_ANY: lua_pushliteral(L, "any"); break;
+  }
+  lua_pushboolean(L, view->mouse_sgr);
+  return 2;
+}
+
+// Reports a mouse event to the application; event is one of press, release, move or wheel, and button one of left, middle, right,
+// or for the wheel, up or down. Modifiers are a table like keymap.modkeys. Returns true if the application took the event.
+static int f_terminal_mouse(lua_State* L) {
+  static const char* events[] = { "press", "release", "move", "wheel", NULL };
+  static const char* buttons[] = { "left", "middle", "right", "up", "down" };
+  terminal_t* terminal = lua_toterminal(L, 1);
+  int event = luaL_checkoption(L, 2, NULL, events);
+  const char* name = luaL_optstring(L, 3, "left");
+  int button = 0;
+  while (button < 5 && strcmp(name, buttons[button]) != 0)
+    ++button;
+  // Buttons applications can't be told about, like back and forward, are left to us.
+  if (button == 5 || (event == 3) != (button >= 3)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  int x = luaL_checkinteger(L, 4), y = luaL_checkinteger(L, 5), modifiers = 0;
+  if (lua_type(L, 6) == LUA_TTABLE) {
+    static const char* keys[] = { "shift", "alt", "ctrl" };
+    for (int i = 0; i < 3; ++i) {
+      lua_getfield(L, 6, keys[i]);
+      if (lua_toboolean(L, -1))
+        modifiers |= 4 << i;
+      lua_pop(L, 1);
+    }
+  }
+  if (event == 3)
+    lua_pushboolean(L, terminal_mouse(terminal, MOUSE_PRESS, button == 4 ? 65 : 64, x, y, modifiers));
+  else
+    lua_pushboolean(L, terminal_mouse(terminal, event == 0 ? MOUSE_PRESS : (event == 1 ? MOUSE_RELEASE : MOUSE_MOTION), button, x, y, modifiers));
+  return 1;
+}
+
+// Marks the terminal as drawn, for the latency probe.
+static int f_terminal_presented(lua_State* L) {
+  terminal_presented(lua_toterminal(L, 1));
+  return 0;
+}
+
+// Returns what the latency probe has measured, as { echo = { count, p50, p99, max }, present = { ... } }, in milliseconds; echo is
+// from a keystroke to the grid changing, and present to that change being drawn. Clears the histograms afterwards if passed true.
+static int f_terminal_latency(lua_State* L) {
+  static const char* stages[] = { "echo", "present" };
+  terminal_t* terminal = lua_toterminal(L, 1);
+  lua_newtable(L);
+  for (int i = 0; i < LATENCY_STAGE_COUNT; ++i) {
+    latency_histogram_t* histogram = &terminal->latency[i];
+    lua_newtable(L);
+    lua_pushinteger(L, histogram->total);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, latency_percentile(histogram, 0.5) * 1000.0);
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, latency_percentile(histogram, 0.99) * 1000.0);
+    lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, histogram->max * 1000.0);
+    lua_setfield(L, -2, "max");
+    lua_setfield(L, -2, stages[i]);
   }
+  if (lua_toboolean(L, 2))
+    memset(terminal->latency, 0, sizeof(terminal->latency));
   return 1;
 }
 
 static const luaL_Reg terminal_api[] = {
   { "__gc",                f_terminal_gc                     },
   { "new",                 f_terminal_new                    },
+  { "prespawn",            f_terminal_prespawn               },
+  { "attach",              f_terminal_attach                 },
+  { "restore",             f_terminal_restore                },
+  { "snapshot",            f_terminal_snapshot               },
+  { "open",                f_terminal_open                   },
+  #ifndef _WIN32
+  { "connect",             f_terminal_connect                },
+  { "sessions",            f_terminal_sessions               },
+  { "session",             f_terminal_session                },
+  #endif
   { "close",               f_terminal_close                  },
+  { "reap",                f_terminal_reap                   },
   { "input",               f_terminal_input                  },
+  { "paste",               f_terminal_paste                  },
   { "clear",               f_terminal_clear                  },
   { "lines",               f_terminal_lines                  },
   { "size",                f_terminal_size                   },
@@ -1621,11 +5450,32 @@ static const luaL_Reg terminal_api[] = {
   { "cursor",              f_terminal_cursor                 },
   { "focused",             f_terminal_focused                },
   { "mouse_tracking_mode", f_terminal_mouse_tracking_mode    },
+  { "mouse",               f_terminal_mouse                  },
+  { "presented",           f_terminal_presented              },
+  { "latency",             f_terminal_latency                },
   { "cursor_keys_mode",    f_terminal_cursor_keys_mode       },
   { "keypad_keys_mode",    f_terminal_keypad_keys_mode       },
   { "paste_mode",          f_terminal_paste_mode             },
+  { "select",              f_terminal_select                 },
+  { "extend",              f_terminal_extend                 },
+  { "selection",           f_terminal_selection              },
+  { "selection_text",      f_terminal_selection_text         },
+  { "line_id",             f_terminal_line_id                },
+  { "commands",            f_terminal_commands               },
+  { "prompt",              f_terminal_prompt                 },
+  { "command_output",      f_terminal_command_output         },
+  { "links",               f_terminal_links                  },
+  { "trigger",             f_terminal_trigger                },
+  { "untrigger",           f_terminal_untrigger              },
+  { "triggered",           f_terminal_triggered              },
+  { "clipboard",           f_terminal_clipboard              },
   { "scrollback",          f_terminal_scrollback             },
   { "name",                f_terminal_name                   },
+  { "trim",                f_terminal_trim                   },
+  { "memory",              f_terminal_memory                 },
+  { "memory_limit",        f_terminal_memory_limit           },
+  { "global_memory_limit", f_terminal_global_memory_limit    },
+  { "spill",               f_terminal_spill                  },
   { NULL,                  NULL                              }
 };
 
@@ -1648,3 +5498,408 @@ int luaopen_libterminal(lua_State* L) {
   lua_setfield(L, -2, "__index");
   return 1;
 }
+
+#ifdef LIBTERMINAL_DAEMON
+// Built with -DLIBTERMINAL_DAEMON, this is `libterminal-daemon <socket>`, which holds terminals on behalf of editors, so that
+// shells, and everything they've output, outlive the editor that started them. Each editor connection is attached to at most one
+// session; it's sent a snapshot as it attaches, and from then on, the output exactly as we parse it. When the connection goes away
+// without killing its session, the session carries on, detached, until another connection attaches to it.
+#define LIBTERMINAL_DAEMON_IDLE_TIMEOUT 10.0 // How long we stick around with no sessions, and nobody connected, in seconds.
+#define LIBTERMINAL_DAEMON_MAX_BACKLOG (32*1024*1024) // Output we'll queue for an editor that isn't reading, before we hang up on it.
+
+typedef struct session_t session_t;
+
+typedef struct connection_t {
+  struct connection_t* next;
+  int fd;
+  session_t* session;                  // The session we're attached to, once we've asked for one.
+  char* incoming;                      // What we've read that isn't yet a whole frame.
+  size_t incoming_length, incoming_capacity;
+  char* outgoing;                      // Frames the editor has yet to take.
+  size_t outgoing_offset, outgoing_length, outgoing_capacity;
+  int closing;                         // If true, we hang up once everything outgoing has been written.
+  int dead;                            // If true, we hang up straight away.
+} connection_t;
+
+struct session_t {
+  struct session_t* next;
+  int id;
+  terminal_t* terminal;
+  connection_t* connection;            // Whoever's attached to us; NULL while detached.
+  int hungup;                          // If true, the pty has closed, and we're only waiting for the shell to be reaped.
+  int exited;                          // If true, the shell's gone; we hold onto its output until an editor has seen how it ended.
+  int killed;                          // If true, an editor has asked for us to go.
+};
+
+static session_t* daemon_sessions;
+static connection_t* daemon_connections;
+static int daemon_next_session_id = 1;
+
+static char* daemon_reserve(connection_t* connection, size_t length) {
+  if (connection->outgoing_offset > 0 && connection->outgoing_length + length > connection->outgoing_capacity) {
+    memmove(connection->outgoing, &connection->outgoing[connection->outgoing_offset], connection->outgoing_length - connection->outgoing_offset);
+    connection->outgoing_length -= connection->outgoing_offset;
+    connection->outgoing_offset = 0;
+  }
+  if (connection->outgoing_length + length > connection->outgoing_capacity) {
+    connection->outgoing_capacity = max(connection->outgoing_length + length, connection->outgoing_capacity * 2);
+    connection->outgoing = realloc(connection->outgoing, connection->outgoing_capacity);
+  }
+  connection->outgoing_length += length;
+  return &connection->outgoing[connection->outgoing_length - length];
+}
+
+static char* daemon_queue_frame(connection_t* connection, char type, const void* payload, uint32_t length) {
+  char* frame = daemon_reserve(connection, LIBTERMINAL_REMOTE_FRAME_HEADER + length);
+  frame[0] = type;
+  memcpy(&frame[1], &length, sizeof(length));
+  if (payload)
+    memcpy(&frame[LIBTERMINAL_REMOTE_FRAME_HEADER], payload, length);
+  if (connection->outgoing_length - connection->outgoing_offset > LIBTERMINAL_DAEMON_MAX_BACKLOG)
+    connection->dead = 1;
+  return &frame[LIBTERMINAL_REMOTE_FRAME_HEADER];
+}
+
+static void daemon_forward(char* buffer, int length, void* data) {
+  session_t* session = data;
+  if (session->connection)
+    daemon_queue_frame(session->connection, REMOTE_FRAME_OUTPUT, buffer, length);
+}
+
+static void daemon_report_exit(session_t* session) {
+  if (session->connection) {
+    int32_t exit_status = session->terminal->exit_status;
+    daemon_queue_frame(session->connection, REMOTE_FRAME_EXIT, &exit_status, sizeof(exit_status));
+  }
+}
+
+static void daemon_error(connection_t* connection, const char* message) {
+  daemon_queue_frame(connection, REMOTE_FRAME_ERROR, message, strlen(message));
+  connection->closing = 1;
+}
+
+// Reads a zero-terminated string out of a payload, or returns NULL if it runs off the end.
+static const char* daemon_read_string(const char* payload, uint32_t length, uint32_t* offset) {
+  const char* string = &payload[*offset];
+  const char* end = memchr(string, 0, length - *offset);
+  if (!end)
+    return NULL;
+  *offset += (end - string) + 1;
+  return string;
+}
+
+static int daemon_read_strings(const char* payload, uint32_t length, uint32_t* offset, const char** strings, int capacity) {
+  int32_t count;
+  if (length - *offset < sizeof(count))
+    return -1;
+  memcpy(&count, &payload[*offset], sizeof(count));
+  *offset += sizeof(count);
+  if (count < 0 || count >= capacity)
+    return -1;
+  for (int i = 0; i < count; ++i) {
+    if (!(strings[i] = daemon_read_string(payload, length, offset)))
+      return -1;
+  }
+  strings[count] = NULL;
+  return 0;
+}
+
+static void daemon_spawn(connection_t* connection, const char* payload, uint32_t length) {
+  int32_t numbers[3];
+  const char* arguments[256];
+  const char* environment[256];
+  uint32_t offset = sizeof(numbers);
+  if (length < sizeof(numbers))
+    return daemon_error(connection, "malformed spawn");
+  memcpy(numbers, payload, sizeof(numbers));
+  const char* term_env = daemon_read_string(payload, length, &offset);
+  const char* path = term_env ? daemon_read_string(payload, length, &offset) : NULL;
+  if (!path || numbers[0] <= 0 || numbers[1] <= 0 || daemon_read_strings(payload, length, &offset, arguments, 256) || daemon_read_strings(payload, length, &offset, environment, 256))
+    return daemon_error(connection, "malformed spawn");
+  terminal_t* terminal = terminal_new(numbers[0], numbers[1], numbers[2], term_env, path, arguments, environment);
+  if (!terminal)
+    return daemon_error(connection, terminal_get_last_error());
+  terminal_register(terminal);
+  session_t* session = calloc(1, sizeof(session_t));
+  session->id = daemon_next_session_id++;
+  session->terminal = terminal;
+  session->connection = connection;
+  session->next = daemon_sessions;
+  daemon_sessions = session;
+  connection->session = session;
+  int32_t id = session->id;
+  daemon_queue_frame(connection, REMOTE_FRAME_SESSION, &id, sizeof(id));
+}
+
+static void daemon_attach(connection_t* connection, const char* payload, uint32_t length) {
+  int32_t id;
+  if (length != sizeof(id))
+    return daemon_error(connection, "malformed attach");
+  memcpy(&id, payload, sizeof(id));
+  session_t* session = daemon_sessions;
+  while (session && (session->id != id || session->connection || session->killed))
+    session = session->next;
+  if (!session)
+    return daemon_error(connection, "no such detached session");
+  session->connection = connection;
+  connection->session = session;
+  daemon_queue_frame(connection, REMOTE_FRAME_SESSION, &id, sizeof(id));
+  size_t snapshot_length = terminal_write_snapshot(session->terminal, NULL);
+  terminal_write_snapshot(session->terminal, daemon_queue_frame(connection, REMOTE_FRAME_SNAPSHOT, NULL, snapshot_length));
+  if (session->exited)
+    daemon_report_exit(session);
+}
+
+static void daemon_list(connection_t* connection) {
+  size_t length = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    char* target = pass ? daemon_queue_frame(connection, REMOTE_FRAME_LIST, NULL, length) : NULL;
+    length = 0;
+    for (session_t* session = daemon_sessions; session; session = session->next) {
+      if (!session->connection && !session->killed) {
+        int32_t numbers[2] = { session->id, session->exited };
+        snapshot_write(target, &length, numbers, sizeof(numbers));
+        snapshot_write(target, &length, session->terminal->name, strlen(session->terminal->name) + 1);
+      }
+    }
+  }
+  connection->closing = 1;
+}
+
+static void daemon_handle_frame(connection_t* connection, char type, const char* payload, uint32_t length) {
+  session_t* session = connection->session;
+  if (!session) {
+    switch (type) {
+      case REMOTE_FRAME_SPAWN: daemon_spawn(connection, payload, length); break;
+      case REMOTE_FRAME_ATTACH: daemon_attach(connection, payload, length); break;
+      case REMOTE_FRAME_LIST: daemon_list(connection); break;
+      default: connection->dead = 1; break;
+    }
+    return;
+  }
+  switch (type) {
+    case REMOTE_FRAME_INPUT:
+      if (!session->exited)
+        terminal_input(session->terminal, payload, length);
+    break;
+    case REMOTE_FRAME_RESIZE: {
+      int32_t size[2];
+      if (length == sizeof(size)) {
+        memcpy(size, payload, sizeof(size));
+        if (size[0] > 0 && size[1] > 0 && size[0] <= 0xFFFF && size[1] <= 0xFFFF)
+          terminal_resize(session->terminal, size[0], size[1]);
+      }
+    } break;
+    case REMOTE_FRAME_KILL:
+      session->killed = 1;
+      session->connection = NULL;
+      connection->session = NULL;
+      connection->closing = 1;
+    break;
+    default: connection->dead = 1; break;
+  }
+}
+
+static void daemon_read(connection_t* connection) {
+  while (!connection->dead) {
+    if (connection->incoming_capacity - connection->incoming_length < LIBTERMINAL_CHUNK_SIZE) {
+      connection->incoming_capacity = max(connection->incoming_capacity * 2, LIBTERMINAL_CHUNK_SIZE * 2);
+      connection->incoming = realloc(connection->incoming, connection->incoming_capacity);
+    }
+    ssize_t length = read(connection->fd, &connection->incoming[connection->incoming_length], connection->incoming_capacity - connection->incoming_length);
+    if (length == -1 && errno == EINTR)
+      continue;
+    if (length <= 0) {
+      if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        connection->dead = 1;
+      break;
+    }
+    connection->incoming_length += length;
+  }
+  size_t offset = 0;
+  while (!connection->dead && !connection->closing && connection->incoming_length - offset >= LIBTERMINAL_REMOTE_FRAME_HEADER) {
+    uint32_t length;
+    memcpy(&length, &connection->incoming[offset + 1], sizeof(length));
+    if (length > connection->incoming_length - offset - LIBTERMINAL_REMOTE_FRAME_HEADER)
+      break;
+    daemon_handle_frame(connection, connection->incoming[offset], &connection->incoming[offset + LIBTERMINAL_REMOTE_FRAME_HEADER], length);
+    offset += LIBTERMINAL_REMOTE_FRAME_HEADER + length;
+  }
+  memmove(connection->incoming, &connection->incoming[offset], connection->incoming_length - offset);
+  connection->incoming_length -= offset;
+}
+
+static void daemon_write(connection_t* connection) {
+  while (!connection->dead && connection->outgoing_offset < connection->outgoing_length) {
+    ssize_t written = write(connection->fd, &connection->outgoing[connection->outgoing_offset], connection->outgoing_length - connection->outgoing_offset);
+    if (written == -1) {
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+        connection->dead = 1;
+      if (errno != EINTR)
+        break;
+    } else
+      connection->outgoing_offset += written;
+  }
+  if (connection->outgoing_offset == connection->outgoing_length)
+    connection->outgoing_offset = connection->outgoing_length = 0;
+}
+
+static void daemon_update_session(session_t* session) {
+  terminal_t* terminal = session->terminal;
+  int total_shifts = 0;
+  if (!session->exited) {
+    if (terminal_update(terminal, daemon_forward, session, &total_shifts) == -1)
+      session->hungup = 1;
+    if (terminal->exited || (session->hungup && terminal_reap(terminal))) {
+      session->exited = 1;
+      daemon_report_exit(session);
+    }
+  } else if (terminal->resize_pending && terminal_get_time() >= terminal->resize_deadline)
+    terminal_send_size(terminal);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <socket>\n", argv[0]);
+    return 1;
+  }
+  const char* socket_path = argv[1];
+  signal(SIGPIPE, SIG_IGN);
+  // If there's already a daemon of ours listening, there's nothing for us to do. If someone else is, the path's been taken from
+  // under us; otherwise, whatever's there is left over from one that died.
+  int existing = remote_connect(socket_path);
+  if (existing != -1) {
+    close(existing);
+    return 0;
+  }
+  struct stat existing_status;
+  if (lstat(socket_path, &existing_status) == 0 && existing_status.st_uid != getuid()) {
+    fprintf(stderr, "%s: %s belongs to someone else\n", argv[0], socket_path);
+    return 1;
+  }
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", argv[0]);
+    return 1;
+  }
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);
+  umask(077);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listener, 16) == -1) {
+    perror(argv[0]);
+    return 1;
+  }
+  fcntl(listener, F_SETFD, FD_CLOEXEC);
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL, 0) | O_NONBLOCK);
+  // We're listening, so whoever started us can connect as soon as we return; the rest happens in the background.
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror(argv[0]);
+    return 1;
+  }
+  if (pid > 0)
+    return 0;
+  setsid();
+  if (chdir("/")) {}
+  int null = open("/dev/null", O_RDWR);
+  if (null != -1) {
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+    if (null > 2)
+      close(null);
+  }
+
+  struct pollfd* descriptors = NULL;
+  int descriptor_capacity = 0;
+  double idle_since = terminal_get_time();
+  while (1) {
+    int count = 0, timeout = -1;
+    for (session_t* session = daemon_sessions; session; session = session->next)
+      count += 2;
+    for (connection_t* connection = daemon_connections; connection; connection = connection->next)
+      ++count;
+    if (count + 2 > descriptor_capacity) {
+      descriptor_capacity = (count + 2) * 2;
+      descriptors = realloc(descriptors, sizeof(struct pollfd) * descriptor_capacity);
+    }
+    count = 0;
+    descriptors[count++] = (struct pollfd){ listener, POLLIN, 0 };
+    if (sigchld_pipe[0] != -1)
+      descriptors[count++] = (struct pollfd){ sigchld_pipe[0], POLLIN, 0 };
+    for (session_t* session = daemon_sessions; session; session = session->next) {
+      if (!session->hungup && !session->exited)
+        descriptors[count++] = (struct pollfd){ session->terminal->master, POLLIN, 0 };
+      if (session->terminal->pidfd != -1)
+        descriptors[count++] = (struct pollfd){ session->terminal->pidfd, POLLIN, 0 };
+      if (session->terminal->resize_pending || session->terminal->input_queue_length > 0)
+        timeout = LIBTERMINAL_RESIZE_DEBOUNCE * 1000;
+    }
+    for (connection_t* connection = daemon_connections; connection; connection = connection->next)
+      descriptors[count++] = (struct pollfd){ connection->fd, POLLIN | (connection->outgoing_length > connection->outgoing_offset ? POLLOUT : 0), 0 };
+    if (orphan_count > 0 || (!daemon_sessions && !daemon_connections))
+      timeout = 1000;
+    if (poll(descriptors, count, timeout) == -1 && errno != EINTR)
+      break;
+
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) != -1) {
+      if (!remote_peer_is_us(fd)) {
+        close(fd);
+        continue;
+      }
+      connection_t* connection = calloc(1, sizeof(connection_t));
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      connection->fd = fd;
+      connection->next = daemon_connections;
+      daemon_connections = connection;
+    }
+    // Without pidfds, nobody else drains the SIGCHLD pipe once every shell has exited, so we do it here, for all of them at once.
+    if (sigchld_pipe[0] != -1) {
+      char discard[64];
+      while (read(sigchld_pipe[0], discard, sizeof(discard)) > 0);
+      for (session_t* session = daemon_sessions; session; session = session->next)
+        terminal_reap(session->terminal);
+    }
+    // Everything's nonblocking, so rather than matching up which descriptors are ready, we give everything a go.
+    for (connection_t* connection = daemon_connections; connection; connection = connection->next)
+      daemon_read(connection);
+    for (session_t* session = daemon_sessions; session; session = session->next)
+      daemon_update_session(session);
+    if (orphan_count > 0)
+      terminal_reap_orphans();
+    for (connection_t** link = &daemon_connections; *link; ) {
+      connection_t* connection = *link;
+      daemon_write(connection);
+      if (connection->dead || (connection->closing && connection->outgoing_length == 0)) {
+        if (connection->session)
+          connection->session->connection = NULL;
+        *link = connection->next;
+        close(connection->fd);
+        free(connection->incoming);
+        free(connection->outgoing);
+        free(connection);
+      } else
+        link = &connection->next;
+    }
+    for (session_t** link = &daemon_sessions; *link; ) {
+      session_t* session = *link;
+      if (session->killed) {
+        *link = session->next;
+        terminal_free(session->terminal);
+        free(session);
+      } else
+        link = &session->next;
+    }
+    double now = terminal_get_time();
+    if (daemon_sessions || daemon_connections)
+      idle_since = now;
+    else if (now - idle_since > LIBTERMINAL_DAEMON_IDLE_TIMEOUT)
+      break;
+  }
+  unlink(socket_path);
+  return 0;
+}
+#endif